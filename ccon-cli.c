@@ -30,9 +30,12 @@
 #include <jansson.h>
 #include "libccon.h"
 
-static int parse_args(int argc, char **argv, int *get_pid,
-		      const char **config_path, const char **config_string,
-		      const char **socket_path);
+static int parse_args(int argc, char **argv, int *get_pid, int *launch_mode,
+		      int *exec_mode, const char **config_path,
+		      const char **config_string, const char **socket_path);
+static int launch(int sock, const char *config_string);
+static int send_stdio(int sock);
+static int wait_exit_code(int sock, const char *peer);
 static void usage(FILE * stream, char *path);
 static void version();
 static char *read_file(const char *path);
@@ -50,12 +53,14 @@ int main(int argc, char **argv)
 	struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
 	json_t *process;
 	json_error_t error;
+	size_t size;
 	ssize_t n;
-	int sock = -1, get_pid = 0, exec_fd = -1;
+	int sock = -1, get_pid = 0, launch_mode = 0, exec_mode = 0, exec_fd = -1,
+	    err = 0;
 
 	if (parse_args
-	    (argc, argv, &get_pid, &config_path, &config_string,
-	     &socket_path)) {
+	    (argc, argv, &get_pid, &launch_mode, &exec_mode, &config_path,
+	     &config_string, &socket_path)) {
 		return 1;
 	}
 
@@ -78,6 +83,7 @@ int main(int argc, char **argv)
 
 	if (get_pid) {
 		LOG("get peer PID\n");
+		len = sizeof(ucred);
 		if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &ucred, &len) ==
 		    -1) {
 			PERROR("getsockopt");
@@ -94,6 +100,14 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (launch_mode) {
+		err = launch(sock, config_string);
+		if (config_path) {
+			free((void *)config_string);
+		}
+		return err;
+	}
+
 	if (config_string) {
 		if (strlen(config_string) == 0) {
 			config_string = "\0";
@@ -112,19 +126,21 @@ int main(int argc, char **argv)
 			}
 		}
 
-		iov.iov_base = (void *)config_string;
 		if (config_string[0] == '\0') {
-			iov.iov_len = 1;
+			size = 1;
 		} else {
-			iov.iov_len = strlen(config_string) + 1;
+			size = strlen(config_string) + 1;
 		}
-		if (iov.iov_len > CLIENT_MESSAGE_SIZE) {
-			LOG("configuration string is too long for a ccon socket message (%d > %d)\n", (int)iov.iov_len, CLIENT_MESSAGE_SIZE);
-			return 1;
+		if (exec_mode) {
+			LOG("send exec request\n");
+			if (send(sock, EXEC_REQUEST, strlen(EXEC_REQUEST), 0) ==
+			    -1) {
+				PERROR("send");
+				return 1;
+			}
 		}
 		LOG("send start message\n");
-		if (sendmsg(sock, &msg, 0) == -1) {
-			PERROR("sendmsg");
+		if (send_message(sock, config_string, size)) {
 			return 1;
 		}
 		if (exec_fd >= 0) {
@@ -132,6 +148,9 @@ int main(int argc, char **argv)
 				return 1;
 			}
 		}
+		if (exec_mode && send_stdio(sock)) {
+			return 1;
+		}
 
 		iov.iov_base = (void *)buf;
 		iov.iov_len = CLIENT_MESSAGE_SIZE;
@@ -147,18 +166,22 @@ int main(int argc, char **argv)
 			return 1;
 		}
 		LOG("received response\n");
+
+		if (exec_mode) {
+			err = wait_exit_code(sock, "exec process");
+		}
 	}
 
 	if (config_path) {
 		free((void *)config_string);
 	}
 
-	return 0;
+	return err;
 }
 
-static int parse_args(int argc, char **argv, int *get_pid,
-		      const char **config_path, const char **config_string,
-		      const char **socket_path)
+static int parse_args(int argc, char **argv, int *get_pid, int *launch_mode,
+		      int *exec_mode, const char **config_path,
+		      const char **config_string, const char **socket_path)
 {
 	int c, option_index;
 	static struct option long_options[] = {
@@ -169,12 +192,14 @@ static int parse_args(int argc, char **argv, int *get_pid,
 		{"config-string", required_argument, NULL, 's'},
 		{"socket", required_argument, NULL, 'S'},
 		{"pid", no_argument, NULL, 'p'},
+		{"launch", no_argument, NULL, 'l'},
+		{"exec", no_argument, NULL, 'e'},
 		{NULL},
 	};
 
 	while (1) {
 		option_index = 0;
-		c = getopt_long(argc, argv, "hVvc:s:S:p", long_options,
+		c = getopt_long(argc, argv, "hVvc:s:S:ple", long_options,
 				&option_index);
 		if (c == -1) {
 			break;
@@ -205,6 +230,12 @@ static int parse_args(int argc, char **argv, int *get_pid,
 		case 'p':
 			*get_pid = 1;
 			break;
+		case 'l':
+			*launch_mode = 1;
+			break;
+		case 'e':
+			*exec_mode = 1;
+			break;
 		default:	/* '?' */
 			usage(stderr, argv[0]);
 			exit(1);
@@ -216,6 +247,21 @@ static int parse_args(int argc, char **argv, int *get_pid,
 		exit(1);
 	}
 
+	if (*launch_mode && !*config_path && !*config_string) {
+		LOG("--launch requires --config or --config-string\n");
+		exit(1);
+	}
+
+	if (*exec_mode && !*config_path && !*config_string) {
+		LOG("--exec requires --config or --config-string\n");
+		exit(1);
+	}
+
+	if (*exec_mode && *launch_mode) {
+		LOG("--exec and --launch are mutually exclusive\n");
+		exit(1);
+	}
+
 	return 0;
 }
 
@@ -232,6 +278,87 @@ static void usage(FILE * stream, char *path)
 	fprintf(stream, "  -S, --socket=PATH\tCcon socket path\n");
 	fprintf(stream,
 		"  -p, --pid\tPrint the container process's PID to stdout\n");
+	fprintf(stream,
+		"  -l, --launch\tSend a container config (not process JSON) to a ccon --daemon and wait for its exit code\n");
+	fprintf(stream,
+		"  -e, --exec\tRun the process in the waiting container alongside its own and wait for its exit code\n");
+}
+
+/*
+ * Send a container config and our stdin, stdout, and stderr to a
+ * ccon --daemon, and return the container's exit code.
+ */
+static int launch(int sock, const char *config_string)
+{
+	char buf[CLIENT_MESSAGE_SIZE];
+	struct iovec iov;
+	struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
+	ssize_t n;
+
+	LOG("send launch message\n");
+	if (send_message(sock, config_string, strlen(config_string) + 1)) {
+		return 1;
+	}
+	if (send_stdio(sock)) {
+		return 1;
+	}
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = sizeof(buf) - 1;
+	LOG("wait for response\n");
+	n = recvmsg(sock, &msg, 0);
+	if (n == -1) {
+		PERROR("recvmsg");
+		return 1;
+	}
+	if (n != 1 || buf[0] != '\0') {
+		LOG("unexpected message from daemon (%d): %.*s\n", (int)n,
+		    (int)n, buf);
+		return 1;
+	}
+
+	return wait_exit_code(sock, "container");
+}
+
+/* lend our stdin, stdout, and stderr to the remote process */
+static int send_stdio(int sock)
+{
+	int fd;
+
+	for (fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+		if (sendfd(sock, &fd, 0)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* read an ASCII decimal exit code, which is the final message */
+static int wait_exit_code(int sock, const char *peer)
+{
+	char buf[CLIENT_MESSAGE_SIZE];
+	struct iovec iov = { buf, sizeof(buf) - 1 };
+	struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
+	char *end;
+	ssize_t n;
+	long code;
+
+	LOG("wait for exit code\n");
+	n = recvmsg(sock, &msg, 0);
+	if (n == -1) {
+		PERROR("recvmsg");
+		return 1;
+	}
+	buf[n] = '\0';
+	errno = 0;
+	code = strtol(buf, &end, 10);
+	if (n == 0 || errno || *end != '\0' || code < 0 || code > 255) {
+		LOG("unexpected message from %s (%d): %s\n", peer, (int)n,
+		    buf);
+		return 1;
+	}
+	LOG("%s exited with %ld\n", peer, code);
+	return (int)code;
 }
 
 static void version()
@@ -253,8 +380,8 @@ static char *read_file(const char *path)
 	}
 
 	while (1) {
-		if (pos >= len - 1) {
-			len += 1024;
+		if (pos + 1 >= len) {
+			len = len ? 2 * len : CLIENT_MESSAGE_SIZE;
 			buf = realloc(buf, sizeof(char) * len);
 			if (!buf) {
 				PERROR("realloc");
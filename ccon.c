@@ -24,24 +24,41 @@
 #include <getopt.h>
 #include <grp.h>
 #include <libgen.h>
+#include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/prctl.h>
+#include <sys/signalfd.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <linux/audit.h>
+#include <linux/capability.h>
+#include <linux/filter.h>
+#include <linux/io_uring.h>
+#include <linux/seccomp.h>
 
 #include <cap-ng.h>
 #include <jansson.h>
 #include "libccon.h"
+#include "syscalls.h"
 
 #define STACK_SIZE (1024 * 1024)
 
@@ -52,6 +69,188 @@
 #define EXEC_PROCESS "exec-process"
 #define CONNECTION_SOCKET "connection-socket"
 
+/* --namespace-pool request, answered by run_pool */
+#define NAMESPACE_REQUEST "namespaces"
+
+/* maximum number of events handled per epoll_wait(2) call */
+#define EVENT_BATCH_SIZE 16
+
+/* client_connection_t states for serve_socket */
+#define CLIENT_READ_REQUEST 0
+#define CLIENT_READ_EXEC_FD 1
+#define CLIENT_STARTED 2
+#define CLIENT_NAMESPACES 3
+#define CLIENT_READ_STDIO 4
+#define CLIENT_EXEC 5
+
+/* pool_worker_t states for run_pool */
+#define POOL_WORKER_STARTING 0
+#define POOL_WORKER_READY 1
+#define POOL_WORKER_RUNNING 2
+
+/* daemon_container_t states for run_daemon */
+#define DAEMON_READ_CONFIG 0
+#define DAEMON_READ_STDIO 1
+#define DAEMON_RUNNING 2
+
+/* run_pool and run_daemon epoll data (clients and workers tag their array index) */
+#define POOL_EVENT_MASK 0xc0000000u
+#define POOL_EVENT_CONNECTION 0x00000000u
+#define POOL_EVENT_SIGNAL 0x00000001u
+#define POOL_EVENT_CLIENT 0x40000000u
+#define POOL_EVENT_WORKER 0x80000000u
+#define POOL_EVENT_RELAY 0xc0000000u
+
+/* serve_socket epoll data for its signalfd (clients are index + 1) */
+#define SERVE_EVENT_SIGNAL 0xffffffffu
+
+/* splice_pseudoterminal_master_epoll return code requesting the select(2) relay */
+#define RELAY_FALLBACK 2
+
+/* splice_pseudoterminal_master_uring ring size and user_data tags */
+#define RING_ENTRIES 16
+#define RING_EXIT 2		/* channels are tagged with their index */
+#define RING_TIMEOUT 3
+#define RING_POLL 4		/* + channel index, linked ahead of a splice */
+#define RING_CANCEL 6
+
+/* mount_fd return code requesting mount(2) */
+#define MOUNT_FALLBACK 2
+
+/* process.seccomp filters only match the native architecture */
+#if defined(__x86_64__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__i386__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_I386
+#elif defined(__aarch64__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#elif defined(__arm__) && !defined(__ARMEB__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_ARM
+#elif defined(__powerpc64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_PPC64LE
+#elif defined(__s390x__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_S390X
+#elif defined(__riscv) && __riscv_xlen == 64
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_RISCV64
+#endif
+#ifndef SECCOMP_RET_KILL_PROCESS
+#define SECCOMP_RET_KILL_PROCESS 0x80000000U
+#endif
+#ifndef SECCOMP_RET_LOG
+#define SECCOMP_RET_LOG 0x7ffc0000U
+#endif
+
+/* seccomp syscall rules compared linearly at each leaf of the search */
+#define SECCOMP_LEAF_RULES 4
+
+/* int64_t plan data slots for a compiled filter */
+#define FILTER_SLOTS(length) \
+	(((length) * sizeof(struct sock_filter) + sizeof(int64_t) - 1) / sizeof(int64_t))
+
+/* overlayfs options for "layers" mounts; mount(2) accepts one page */
+#define OVERLAY_DATA_SIZE 4096
+
+/* MS_* flags mount_fd can express as mount attributes */
+#define MOUNT_ATTR_FLAGS (MS_RDONLY | MS_NOSUID | MS_NODEV | MS_NOEXEC | \
+	MS_NOATIME | MS_NODIRATIME | MS_RELATIME | MS_STRICTATIME)
+#define MOUNT_PROPAGATION_FLAGS (MS_PRIVATE | MS_SHARED | MS_SLAVE | \
+	MS_UNBINDABLE)
+
+/* the tmpfs and devpts under a "minimal-dev" mount */
+#define MINIMAL_DEV_DATA "mode=755,size=64k"
+#define MINIMAL_DEV_PTS_DATA "newinstance,ptmxmode=0666,mode=620"
+
+/* directory descriptors kept by handle_mounts' dir_cache_t */
+#define DIR_CACHE_SIZE 16
+
+/* maximum number of grouped hooks run concurrently */
+#define HOOK_BATCH_SIZE 16
+
+/* helper threads opening namespace paths before clone(2) */
+#define PREPARE_THREADS 4
+
+/* criu(8) restore arguments: fixed options, --root, and four --join-ns */
+#define RESTORE_ARGS 24
+#define RESTORE_JOIN_NAMESPACES 4
+
+/* --plan-cache file header */
+#define CONFIG_PLAN_MAGIC "cconplan"
+#define CONFIG_PLAN_FORMAT 3
+
+/* --trace timeline capacity */
+#define TRACE_EVENTS 256
+#define TRACE_NAME_SIZE 64
+
+#ifndef __NR_clone3
+#define __NR_clone3 435
+#endif
+
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+/* the mount API from linux/mount.h, for libcs that predate it */
+#ifndef __NR_open_tree
+#define __NR_open_tree 428
+#endif
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+#ifndef __NR_fsopen
+#define __NR_fsopen 430
+#endif
+#ifndef __NR_fsconfig
+#define __NR_fsconfig 431
+#endif
+#ifndef __NR_fsmount
+#define __NR_fsmount 432
+#endif
+#ifndef __NR_mount_setattr
+#define __NR_mount_setattr 442
+#endif
+
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC 0x00000001
+#endif
+#ifndef FSMOUNT_CLOEXEC
+#define FSMOUNT_CLOEXEC 0x00000001
+#endif
+#ifndef FSCONFIG_SET_FLAG
+#define FSCONFIG_SET_FLAG 0
+#define FSCONFIG_SET_STRING 1
+#define FSCONFIG_CMD_CREATE 6
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#define MOUNT_ATTR_NOSUID 0x00000002
+#define MOUNT_ATTR_NODEV 0x00000004
+#define MOUNT_ATTR_NOEXEC 0x00000008
+#define MOUNT_ATTR__ATIME 0x00000070
+#define MOUNT_ATTR_NOATIME 0x00000010
+#define MOUNT_ATTR_STRICTATIME 0x00000020
+#define MOUNT_ATTR_NODIRATIME 0x00000080
+#endif
+
 #ifndef execveat
 static int execveat(int fd, const char *path, char **argv, char **envp,
 		    int flags)
@@ -60,11 +259,70 @@ static int execveat(int fd, const char *path, char **argv, char **envp,
 }
 #endif
 
+/* struct clone_args from linux/sched.h (CLONE_ARGS_SIZE_VER2) */
+typedef struct clone3_args {
+	uint64_t flags;
+	uint64_t pidfd;
+	uint64_t child_tid;
+	uint64_t parent_tid;
+	uint64_t exit_signal;
+	uint64_t stack;
+	uint64_t stack_size;
+	uint64_t tls;
+	uint64_t set_tid;
+	uint64_t set_tid_size;
+	uint64_t cgroup;
+} clone3_args_t;
+
+/* struct mount_attr from linux/mount.h (MOUNT_ATTR_SIZE_VER0) */
+typedef struct mount_attr_args {
+	uint64_t attr_set;
+	uint64_t attr_clr;
+	uint64_t propagation;
+	uint64_t userns_fd;
+} mount_attr_t;
+
+/* an O_PATH descriptor for a directory handle_mounts already walked */
+typedef struct dir_cache_entry {
+	size_t len;		/* 0 for unused slots */
+	int fd;
+	char path[MAX_PATH];
+} dir_cache_entry_t;
+
+typedef struct dir_cache {
+	dir_cache_entry_t entries[DIR_CACHE_SIZE];
+	size_t next;		/* the next slot to evict */
+} dir_cache_t;
+
+/* a character device created by a "minimal-dev" mount */
+typedef struct dev_node {
+	const char *name;
+	unsigned int major;
+	unsigned int minor;
+} dev_node_t;
+
 typedef struct namespace_fd {
 	int type;
 	int fd;
 } namespace_fd_t;
 
+/* a namespaces.*.path opened by a preparation thread */
+typedef struct namespace_open {
+	const char *key;
+	const char *path;
+	int type;
+	int fd;
+	int err;		/* errno from a failed open(2) */
+} namespace_open_t;
+
+typedef struct namespace_opens {
+	namespace_open_t *opens;
+	size_t count;
+	size_t next;		/* the next unclaimed entry in opens */
+	pthread_t threads[PREPARE_THREADS];
+	size_t n_threads;
+} namespace_opens_t;
+
 typedef struct child_func_args {
 	json_t *config;
 	int socket;
@@ -72,18 +330,206 @@ typedef struct child_func_args {
 	namespace_fd_t *namespace_fds;	/* end of array when type == 0 */
 } child_func_args_t;
 
+/* user namespace ID mappings, formatted before clone(2) */
+typedef struct user_map {
+	char *buf;		/* "containerID hostID size\n" lines */
+	size_t len;
+	char **argv;		/* newuidmap(1) or newgidmap(1) arguments */
+} user_map_t;
+
+typedef struct user_mappings {
+	const char *setgroups;	/* "allow", "deny", or NULL */
+	user_map_t uid;
+	user_map_t gid;
+	char pid[24];		/* container PID, argv[1] for the helpers */
+} user_mappings_t;
+
+/*
+ * A validated config with its hot lookups resolved by compile_plan.
+ * There are no pointers, so --plan-cache can map the plan straight
+ * from disk.  data holds mount_count mount flags, the filter_length
+ * instructions of the process.seccomp filter, and then the
+ * config_size bytes of config text the plan was compiled from (only
+ * kept for cached plans).
+ */
+typedef struct config_plan {
+	char magic[8];		/* CONFIG_PLAN_MAGIC, without the trailing null */
+	char version[16];	/* CCON_VERSION of the compiling ccon */
+	uint32_t format;	/* CONFIG_PLAN_FORMAT */
+	uint32_t mount_count;	/* namespaces.mount.mounts entries */
+	int32_t capability_count;	/* -1 if process.capabilities is unset or unresolved */
+	int32_t clone_flags;	/* CLONE_NEW* for the new namespaces */
+	uint64_t hash;		/* FNV-1a hash of the config text */
+	uint64_t config_size;
+	uint64_t capabilities;	/* process.capabilities as a bitmask */
+	uint64_t filter_length;	/* process.seccomp instructions, 0 if unset */
+	int64_t data[];
+} config_plan_t;
+
+/* a process.seccomp syscall rule, sorted by compile_seccomp */
+typedef struct seccomp_rule {
+	int number;
+	size_t index;		/* earlier rules win */
+	uint32_t action;
+} seccomp_rule_t;
+
+/* a hook launched by run_hook_batch */
+typedef struct hook_process {
+	pid_t pid;		/* -1 once reaped */
+	int index;		/* position in the hooks array */
+	struct timespec start;
+	struct timespec deadline;	/* only used if has_deadline */
+	int has_deadline;
+	int timed_out;
+} hook_process_t;
+
+/* one direction of the pseudoterminal relay */
+typedef struct relay_channel {
+	int src;		/* index into the relay's file descriptors */
+	int dst;
+	int pipe_fd[2];	/* intermediate pipe for splice(2) */
+	size_t capacity;
+	size_t pending;		/* bytes waiting in pipe_fd */
+	int open;
+} relay_channel_t;
+
+/* an io_uring(7) instance mapped by io_ring_setup */
+typedef struct io_ring {
+	int fd;
+	void *sq_ring;
+	void *cq_ring;		/* sq_ring with IORING_FEAT_SINGLE_MMAP */
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int tail;	/* sq_tail, published by io_ring_enter */
+} io_ring_t;
+
+/* exec_process argument and environment vectors, see get_exec_strings */
+typedef struct exec_strings {
+	char **argv;		/* NULL if process.args is unset */
+	char **env;		/* NULL to inherit environ */
+	const char *path;	/* the first PATH value in a packed env, or NULL */
+} exec_strings_t;
+
+/* a --socket client connection */
+typedef struct client_connection {
+	int fd;			/* -1 for unused slots */
+	int exec_fd;
+	json_t *process;
+	message_buffer_t message;
+	int state;
+	int exec;		/* set by an EXEC_REQUEST */
+	int stdio[3];		/* the exec client's stdin, stdout, and stderr */
+	pid_t pid;		/* the exec process, once forked */
+} client_connection_t;
+
+/* a --pool worker: a ccon host process whose container is parked at its start barrier */
+typedef struct pool_worker {
+	pid_t pid;		/* -1 for unused slots */
+	int ready_fd;		/* read end of the worker's readiness pipe */
+	int relay_fd;		/* the container socket a start response comes from */
+	int client_fd;		/* the pool client waiting for it, or -1 to retire */
+	int state;
+	char path[MAX_PATH];	/* the worker's --socket path */
+} pool_worker_t;
+
+/* a --daemon request, whose container runs in a forked ccon worker */
+typedef struct daemon_container {
+	int fd;			/* client data socket, or -1 */
+	int stdio[3];		/* the client's stdin, stdout, and stderr */
+	int state;
+	pid_t pid;		/* worker PID once launched, else -1 */
+	message_buffer_t config;	/* config text from the request */
+} daemon_container_t;
+
+/* a --trace event, phase is 'B' (begin), 'E' (end), or 'I' (instant) */
+typedef struct trace_event {
+	struct timespec time;
+	const char *process;
+	char phase;
+	char name[TRACE_NAME_SIZE];
+} trace_event_t;
+
+/* --trace timeline, mapped before clone(2) so every process can append */
+typedef struct trace_timeline {
+	unsigned int count;
+	trace_event_t events[TRACE_EVENTS];
+} trace_timeline_t;
+
 extern char **environ;
 
+/* the compiled config, see compile_plan */
+static const config_plan_t *config_plan = NULL;
+static size_t config_plan_size = 0;
+static int config_plan_mapped = 0;
+static json_t *config_process = NULL;	/* the process config_plan describes */
+static exec_strings_t config_exec;	/* config_process's, see prepare_config */
+
 /* global PIDs for signal handling */
 static volatile pid_t child_pid = -1;
-static volatile pid_t hook_pid = -1;
+static volatile pid_t hook_pids[HOOK_BATCH_SIZE];	/* unused when <= 0 */
+
+/* container pidfd from clone3(2), or -1 if clone(2) was used */
+static int child_pidfd = -1;
+
+/* listen(2) backlog for the --socket connection socket */
+static int socket_backlog = 5;
+
+/* --seal-exec, and the process.host executable run_pool resolved */
+static int seal_exec = 0;
+static int host_exec_fd = -1;
+
+/* --log-buffer, see log_buffer_start */
+static int log_buffer = 0;
+
+/* --io-uring, see splice_pseudoterminal_master_uring */
+static int io_uring_relay = 0;
+
+/* --checkpoint and --restore criu(8) image directories */
+static const char *checkpoint_dir = NULL;
+static const char *restore_dir = NULL;
+static volatile sig_atomic_t checkpoint_requested = 0;	/* SIGUSR1 */
+
+/* --status-fd and --async-teardown, see report_status */
+static int status_fd = -1;
+static int async_teardown = 0;
+
+/* --stats state, see emit_stats */
+static double stats_interval = 0;
+static struct timespec stats_next;
+static int stats_cgroup_fd = -1;
+static uint64_t relay_bytes[2];	/* stdin to container, container to stdout */
+
+/* --namespace-pool supervisor socket for run_container */
+static const char *namespace_pool = NULL;
+
+/* --layer-cache directory for digest-named overlay layers */
+static const char *layer_cache = NULL;
+
+/* write end of the --pool readiness pipe in pool workers */
+static int pool_ready_fd = -1;
+
+/* --trace state, trace_process names the process recording events */
+static int trace = 0;
+static trace_timeline_t *trace_timeline = NULL;
+static const char *trace_process = "host";
 
 static int parse_args(int argc, char **argv, const char **config_path,
-		      const char **config_string, const char **socket_path);
+		      const char **config_string, const char **socket_path,
+		      const char **plan_cache, int *pool_size,
+		      int *daemon_mode);
+static int prepare_config(json_t * config, const char *name,
+			  const char *text, size_t size, uint64_t hash,
+			  const char *plan_cache);
 static void usage(FILE * stream, char *path);
 static void version();
 static void kill_children(int signum, siginfo_t * siginfo, void *unused);
 static void reap_child(int signum, siginfo_t * siginfo, void *unused);
+static void request_checkpoint(int signum, siginfo_t * siginfo, void *unused);
 static int block_signals();
 static int unblock_signals();
 static int install_signal_handlers();
@@ -91,58 +537,238 @@ static int uninstall_signal_handlers();
 static int validate_config(json_t * config);
 static int validate_version(const char *version);
 static float version_api(const char *version);
+static int upgrade_config(json_t * config);
+static int read_file(const char *path, char **buf, size_t * size);
+static uint64_t hash_config(const char *text, size_t size);
+static int compile_plan(json_t * config, const char *text, size_t size,
+			uint64_t hash);
+static int get_plan_path(const char *plan_cache, uint64_t hash, char *path);
+static int load_plan(const char *plan_cache, const char *text, size_t size,
+		     uint64_t hash);
+static int save_plan(const char *plan_cache);
+static void free_plan();
 static int run_container(json_t * config, const char *socket_path);
-static int handle_parent(json_t * config, const char *socket_path, pid_t cpid,
-			 int *socket);
+static int restore_container(json_t * config);
+static int get_restore_args(json_t * config, char **argv, char *root,
+			    char join[][MAX_PATH]);
+static void checkpoint_tick();
+static int checkpoint_container(pid_t cpid);
+static pid_t clone_container(int flags, child_func_args_t * child_args,
+			     char **stack, int cgroup_fd, int *placed);
+static int open_cgroup(json_t * config, int *cgroup_fd, int *created);
+static int join_cgroup(int cgroup_fd, pid_t pid);
+static void remove_cgroup(json_t * config);
+static int handle_parent(json_t * config, user_mappings_t * user_mappings,
+			 const char *socket_path, pid_t cpid, int *socket);
+static void report_status(int code);
+static void background_teardown(int code);
 static int child_func(void *arg);
 static int handle_child(json_t * config, int *socket, int *exec_fd,
 			namespace_fd_t ** namespace_fds);
-static int set_path(char **env);
+static int set_path(const char *path);
+static int get_exec_strings(json_t * process, exec_strings_t * strings);
+static void free_exec_strings(exec_strings_t * strings);
+static char **merge_environ(json_t * array);
+static size_t env_key_length(const char *entry);
 static int set_terminal(json_t * process, int console, int dup_stdin,
 			int *socket);
 static int set_working_directory(json_t * process);
 static int set_user_group(json_t * process);
 static int _capng_name_to_capability(const char *name);
 static int set_capabilities(json_t * process);
+static int apply_capabilities(uint64_t mask);
+static int get_seccomp_filter(json_t * process, struct sock_filter **filter,
+			      size_t *length, int *allocated);
+static int compile_seccomp(json_t * process, struct sock_filter **filter,
+			   size_t *length);
+static int get_seccomp_action(json_t * object, const char *key,
+			      const char *name, uint32_t * action);
+static int compare_syscall_names(const void *a, const void *b);
+static int compare_seccomp_rules(const void *a, const void *b);
+static int emit_seccomp_search(struct sock_filter *filter, size_t *length,
+			       seccomp_rule_t * rules, size_t start, size_t end,
+			       uint32_t default_action);
+static int install_seccomp(struct sock_filter *filter, size_t length);
 static void exec_process(json_t * process, int console, int dup_stdin,
 			 int process_env_path, int *socket, int *exec_fd);
-static int get_namespace_fds(json_t * config, namespace_fd_t ** namespace_fds);
+static int start_namespace_fds(json_t * config, namespace_opens_t * prepare,
+			       int busy);
+static void *open_namespace_fds(void *arg);
+static int collect_namespace_fds(namespace_opens_t * prepare,
+				 namespace_fd_t ** namespace_fds);
+static int add_namespace_fd(namespace_fd_t ** namespace_fds, int type, int fd);
+static int borrow_namespaces(const char *path, namespace_fd_t ** namespace_fds,
+			     int *flags);
 static int run_hooks(json_t * config, const char *name, pid_t cpid);
+static int get_hook_batch(json_t * hook_array, const char *name, size_t start,
+			  size_t * end);
+static int run_hook_batch(json_t * hook_array, const char *name, pid_t cpid,
+			  size_t start, size_t end,
+			  const struct timespec *deadline);
+static int launch_hook(json_t * hook, const char *name, pid_t cpid,
+		       hook_process_t * hook_process, size_t slot,
+		       const struct timespec *deadline);
+static int get_timeout(json_t * object, const char *name, int index,
+		       double *seconds);
+static void add_seconds(struct timespec *time, double seconds);
+static int timespec_before(const struct timespec *a,
+			   const struct timespec *b);
+static long elapsed_ms(const struct timespec *start,
+		       const struct timespec *end);
+static int wait_hooks(hook_process_t * hook_processes, size_t n,
+		      const char *name, pid_t cpid);
 static int setup_socket(const char *path, int *container_socket);
 static int serve_socket(json_t * process, int console, int *socket);
+static int serve_exec(client_connection_t * client, int connection_socket,
+		      int *socket, sigset_t * mask);
+static void serve_reap(int epoll_fd, int signal_fd,
+		       client_connection_t * clients, size_t n_clients);
+static int add_client(int epoll_fd, client_connection_t ** clients,
+		      size_t * n_clients, int data_socket, uint32_t tag);
+static void remove_client(int epoll_fd, client_connection_t * client);
+static int handle_client(client_connection_t * client, json_t * process);
+static void send_client_error(int data_socket, const char *message);
+static int run_pool(json_t * config, const char *socket_path, int size);
+static int pool_spawn(json_t * config, const char *pool_dir, int epoll_fd,
+		      pool_worker_t ** workers, size_t * n_workers,
+		      int connection_socket, int signal_fd,
+		      client_connection_t * clients, size_t n_clients);
+static int pool_handle_worker(int epoll_fd, pool_worker_t * worker,
+			      int *failures);
+static int pool_forward(int epoll_fd, pool_worker_t * worker,
+			uint32_t index, client_connection_t * client);
+static int pool_watch_relay(int epoll_fd, pool_worker_t * worker,
+			    uint32_t index, int sock);
+static void pool_relay(int epoll_fd, pool_worker_t * worker);
+static int pool_lend_namespaces(int epoll_fd, pool_worker_t * worker,
+				uint32_t index, client_connection_t * client);
+static int run_daemon(const char *socket_path, const char *plan_cache);
+static int daemon_add(int epoll_fd, daemon_container_t ** containers,
+		      size_t * n_containers, int data_socket);
+static void daemon_remove(int epoll_fd, daemon_container_t * container);
+static int daemon_handle_client(daemon_container_t * container);
+static int daemon_spawn(daemon_container_t * container,
+			daemon_container_t * containers, size_t n_containers,
+			const char *plan_cache, int connection_socket,
+			int epoll_fd, int signal_fd);
+static int daemon_launch(daemon_container_t * container,
+			 const char *plan_cache);
+static void daemon_exited(int epoll_fd, daemon_container_t * container,
+			  siginfo_t * siginfo);
+static int bind_socket(const char *path);
+static int connect_socket(const char *path);
 static int get_namespace_type(const char *name, int *nstype);
+static const char *get_namespace_name(int nstype);
 static int get_clone_flags(json_t * config, int *flags);
-static int join_namespaces(json_t * config, namespace_fd_t ** namespace_fds);
-static int join_namespace(const char *name, json_t * namespace,
-			  namespace_fd_t ** namespace_fds);
-static int set_user_namespace_mappings(json_t * config, pid_t cpid);
-static int set_user_map(json_t * user, pid_t cpid, const char *key,
-			const char *filename);
-static int set_user_setgroups(json_t * user, pid_t cpid);
+static int join_namespaces(namespace_fd_t * namespace_fds);
+static int join_namespace(namespace_fd_t * namespace_fd);
+static int get_user_mappings(json_t * config, user_mappings_t * mappings);
+static int get_user_map(json_t * user, const char *key, const char *helper,
+			user_map_t * map, char *pid);
+static void free_user_mappings(user_mappings_t * mappings);
+static int set_user_namespace_mappings(user_mappings_t * mappings, pid_t cpid);
+static int set_user_map(user_map_t * map, pid_t cpid, const char *filename);
+static void log_user_map(const char *action, user_map_t * map,
+			 const char *path);
+static int run_user_map_helper(user_map_t * map);
+static int run_helper(char **argv);
+static int set_user_setgroups(const char *value, pid_t cpid);
 static int get_mount_flag(const char *name, unsigned long *flag);
 static int handle_mounts(json_t * config);
+static int get_overlay_data(json_t * mt, size_t index, const char *cwd,
+			    dir_cache_t * dir_cache, char *data, size_t size);
+static int get_layer_path(const char *layer, const char *cwd, char *path);
+static int get_overlay_path(const char *path, const char *cwd, char *full);
+static int mount_fd(const char *source, const char *target, const char *type,
+		    unsigned long flags, const char *data);
+static void get_mount_attr(unsigned long flags, mount_attr_t * attr,
+			   int remount);
+static int set_fs_options(int fs_fd, const char *data);
+static int mount_minimal_dev(dir_cache_t * dir_cache, const char *target);
+static int bind_dev_node(int dev_fd, const char *target, const char *name);
+static int mount_attach(const char *source, const char *target,
+			const char *type, unsigned long flags,
+			const char *data);
 static int pivot_root_remove_old(const char *new_root);
 static int _wait(pid_t pid, const char *name);
+static int wait_status(pid_t pid, const char *name, siginfo_t * siginfo);
+static int wait_container(pid_t cpid);
+static int wait_container_pidfd(pid_t cpid);
+static int stats_timeout_ms();
+static void stats_tick();
+static void emit_stats(pid_t cpid);
+static ssize_t read_stats_file(int dir_fd, const char *path, char *buf,
+			       size_t size);
+static void add_cgroup_stats(json_t * stats);
 static char **json_array_of_strings_value(json_t * array);
+static char **pack_strings(const char **strings, size_t count);
 static int close_pipe(int pipe_fd[]);
 static int splice_pseudoterminal_master(int *master, int *slave);
-static int mkdir_all(const char *path, mode_t mode);
-static int mkfile_all(const char *path, mode_t dir_mode, mode_t file_mode);
+static int splice_pseudoterminal_master_uring(int *master, int *slave);
+static int io_ring_setup(io_ring_t * ring, unsigned int entries);
+static struct io_uring_sqe *io_ring_get_sqe(io_ring_t * ring);
+static int io_ring_enter(io_ring_t * ring, unsigned int min_complete);
+static struct io_uring_cqe *io_ring_peek(io_ring_t * ring);
+static void io_ring_advance(io_ring_t * ring);
+static int io_ring_close(io_ring_t * ring);
+static int splice_pseudoterminal_master_epoll(int *master, int *slave);
+static int relay_drain(relay_channel_t * channel, int *fds, int master);
+static int splice_pseudoterminal_master_select(int *master, int *slave);
+static size_t path_length(const char *path);
+static int open_dir_all(dir_cache_t * cache, const char *path, mode_t mode);
+static void dir_cache_insert(dir_cache_t * cache, const char *path,
+			     size_t len, int fd);
+static void dir_cache_invalidate(dir_cache_t * cache, const char *path);
+static void dir_cache_flush(dir_cache_t * cache);
+static int mkdir_all(dir_cache_t * cache, const char *path, mode_t mode);
+static int mkfile_all(dir_cache_t * cache, const char *path,
+		      mode_t dir_mode, mode_t file_mode);
+static int trace_open();
+static void trace_event(char phase, const char *format, ...);
+static int trace_close();
 
 int main(int argc, char **argv)
 {
 	const char *config_path = "config.json";
 	const char *config_string = NULL;
 	const char *socket_path = NULL;
-	int err;
+	const char *plan_cache = NULL;
+	const char *text = NULL;
+	char *buf = NULL;
+	size_t size = 0;
+	uint64_t hash = 0;
+	int err, pool_size = 0, daemon_mode = 0;
 	json_t *config;
 	json_error_t error;
 
-	if (parse_args(argc, argv, &config_path, &config_string, &socket_path)) {
+	if (parse_args
+	    (argc, argv, &config_path, &config_string, &socket_path,
+	     &plan_cache, &pool_size, &daemon_mode)) {
 		return 1;
 	}
 
-	if (config_string) {
+	if (daemon_mode) {
+		return run_daemon(socket_path, plan_cache);
+	}
+
+	if (plan_cache) {
+		/* hash the raw text, so cache hits skip validation */
+		if (config_string) {
+			text = config_string;
+			size = strlen(config_string);
+		} else {
+			if (read_file(config_path, &buf, &size)) {
+				return 1;
+			}
+			text = buf;
+		}
+		hash = hash_config(text, size);
+		if (load_plan(plan_cache, text, size, hash)) {
+			free(buf);
+			return 1;
+		}
+		config = json_loadb(text, size, JSON_REJECT_DUPLICATES, &error);
+	} else if (config_string) {
 		config =
 		    json_loads(config_string, JSON_REJECT_DUPLICATES, &error);
 	} else {
@@ -152,42 +778,106 @@ int main(int argc, char **argv)
 	if (!config) {
 		LOG("error on %s:%d:%d: %s\n", config_path, error.line,
 		    error.column, error.text);
-		return 1;
+		err = 1;
+		goto cleanup;
 	}
 
-	err = validate_config(config);
+	err = prepare_config(config, config_path, text, size, hash, plan_cache);
 	if (err) {
-		LOG("%s invalid\n", config_path);
 		goto cleanup;
 	}
 
-	err = run_container(config, socket_path);
+	if (pool_size) {
+		err = run_pool(config, socket_path, pool_size);
+	} else if (restore_dir) {
+		err = restore_container(config);
+	} else {
+		err = run_container(config, socket_path);
+	}
 
  cleanup:
 	if (config) {
 		json_decref(config);
 	}
+	free_plan();
+	if (buf) {
+		free(buf);
+	}
 
 	return err;
 }
 
+/*
+ * Validate (unless a cached plan was loaded), upgrade, and compile a
+ * freshly parsed config.  name is only used for logging.
+ */
+static int prepare_config(json_t * config, const char *name,
+			  const char *text, size_t size, uint64_t hash,
+			  const char *plan_cache)
+{
+	if (!config_plan) {
+		if (validate_config(config)) {
+			LOG("%s invalid\n", name);
+			return 1;
+		}
+	}
+
+	if (upgrade_config(config)) {
+		return 1;
+	}
+
+	if (!config_plan) {
+		if (compile_plan(config, text, size, hash)) {
+			LOG("%s invalid\n", name);
+			return 1;
+		}
+		if (plan_cache) {
+			(void)save_plan(plan_cache);	/* the cache is best-effort */
+		}
+	}
+	config_process = json_object_get(config, "process");
+	if (config_process && get_exec_strings(config_process, &config_exec)) {
+		return 1;
+	}
+
+	return 0;
+}
+
 static int parse_args(int argc, char **argv, const char **config_path,
-		      const char **config_string, const char **socket_path)
+		      const char **config_string, const char **socket_path,
+		      const char **plan_cache, int *pool_size,
+		      int *daemon_mode)
 {
 	int c, option_index;
 	static struct option long_options[] = {
 		{"help", no_argument, NULL, 'h'},
 		{"verbose", no_argument, &verbose, 1},
+		{"trace", no_argument, &trace, 1},
 		{"version", no_argument, NULL, 'v'},
 		{"config", required_argument, NULL, 'c'},
 		{"config-string", required_argument, NULL, 's'},
 		{"socket", required_argument, NULL, 'S'},
+		{"socket-backlog", required_argument, NULL, 'b'},
+		{"pool", required_argument, NULL, 'p'},
+		{"daemon", no_argument, NULL, 'd'},
+		{"plan-cache", required_argument, NULL, 'P'},
+		{"namespace-pool", required_argument, NULL, 'n'},
+		{"layer-cache", required_argument, NULL, 'l'},	/* long-only */
+		{"seal-exec", no_argument, &seal_exec, 1},
+		{"status-fd", required_argument, NULL, 'f'},	/* long-only */
+		{"async-teardown", no_argument, &async_teardown, 1},
+		{"log-buffer", no_argument, &log_buffer, 1},
+		{"stats", required_argument, NULL, 'i'},	/* long-only */
+		{"io-uring", no_argument, &io_uring_relay, 1},
+		{"checkpoint", required_argument, NULL, 'k'},	/* long-only */
+		{"restore", required_argument, NULL, 'r'},	/* long-only */
 		{NULL},
 	};
+	char *end;
 
 	while (1) {
 		option_index = 0;
-		c = getopt_long(argc, argv, "hVvc:s:S:", long_options,
+		c = getopt_long(argc, argv, "hVtvc:s:S:b:p:dP:n:", long_options,
 				&option_index);
 		if (c == -1) {
 			break;
@@ -201,6 +891,9 @@ static int parse_args(int argc, char **argv, const char **config_path,
 		case 'V':
 			verbose = 1;	/* set short-option flag */
 			break;
+		case 't':
+			trace = 1;	/* set short-option flag */
+			break;
 		case 'v':
 			version();
 			exit(0);
@@ -213,12 +906,96 @@ static int parse_args(int argc, char **argv, const char **config_path,
 		case 'S':
 			*socket_path = optarg;
 			break;
+		case 'b':
+			errno = 0;
+			socket_backlog = (int)strtol(optarg, &end, 10);
+			if (errno || *end != '\0' || socket_backlog <= 0) {
+				LOG("invalid --socket-backlog: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'p':
+			errno = 0;
+			*pool_size = (int)strtol(optarg, &end, 10);
+			if (errno || *end != '\0' || *pool_size <= 0) {
+				LOG("invalid --pool: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'd':
+			*daemon_mode = 1;
+			break;
+		case 'P':
+			*plan_cache = optarg;
+			break;
+		case 'n':
+			namespace_pool = optarg;
+			break;
+		case 'l':
+			layer_cache = optarg;
+			break;
+		case 'k':
+			checkpoint_dir = optarg;
+			break;
+		case 'r':
+			restore_dir = optarg;
+			break;
+		case 'i':
+			errno = 0;
+			stats_interval = strtod(optarg, &end);
+			if (errno || *end != '\0' || !(stats_interval > 0)) {
+				LOG("invalid --stats: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'f':
+			errno = 0;
+			status_fd = (int)strtol(optarg, &end, 10);
+			if (errno || *end != '\0' || status_fd < 0) {
+				LOG("invalid --status-fd: %s\n", optarg);
+				exit(1);
+			}
+			/* keep it out of the container and hook processes */
+			if (fcntl(status_fd, F_SETFD, FD_CLOEXEC) == -1) {
+				PERROR("fcntl");
+				exit(1);
+			}
+			break;
 		default:	/* '?' */
 			usage(stderr, argv[0]);
 			exit(1);
 		}
 	}
 
+	if (*pool_size && !*socket_path) {
+		LOG("--pool requires --socket\n");
+		exit(1);
+	}
+
+	if (*daemon_mode && !*socket_path) {
+		LOG("--daemon requires --socket\n");
+		exit(1);
+	}
+
+	if (*daemon_mode && *pool_size) {
+		LOG("--daemon and --pool are mutually exclusive\n");
+		exit(1);
+	}
+
+	if (restore_dir && (*socket_path || *daemon_mode || *pool_size)) {
+		LOG("--restore skips container setup, so it can't be used with --socket, --daemon, or --pool\n");
+		exit(1);
+	}
+
+	if (status_fd >= 0 && (*daemon_mode || *pool_size)) {
+		LOG("--status-fd reports a single container, so it can't be used with --daemon or --pool\n");
+		exit(1);
+	}
+
+	if (log_buffer && verbose && log_buffer_start()) {
+		exit(1);
+	}
+
 	return 0;
 }
 
@@ -228,6 +1005,8 @@ static void usage(FILE * stream, char *path)
 	fprintf(stream, "Options:\n");
 	fprintf(stream, "  -h, --help\tShow this usage information and exit\n");
 	fprintf(stream, "  -V, --verbose\tEnable debug logging to stderr\n");
+	fprintf(stream,
+		"  -t, --trace\tWrite a JSON timeline of container setup to stderr\n");
 	fprintf(stream,
 		"  -v, --version\tPrint version information and exit\n");
 	fprintf(stream,
@@ -236,6 +1015,34 @@ static void usage(FILE * stream, char *path)
 		"  -s, --config-string=JSON\tSpecify config JSON on the command line, overriding --config and its PATH\n");
 	fprintf(stream,
 		"  -S, --socket=PATH\tSpecify a socket path for container PID and start requests\n");
+	fprintf(stream,
+		"  -b, --socket-backlog=N\tListen for up to N pending --socket connections (default 5)\n");
+	fprintf(stream,
+		"  -p, --pool=N\tKeep N containers waiting for --socket start requests\n");
+	fprintf(stream,
+		"  -d, --daemon\tLaunch a container for each config received on --socket\n");
+	fprintf(stream,
+		"  -P, --plan-cache=DIR\tCache compiled configs in DIR and reuse them on later launches\n");
+	fprintf(stream,
+		"  -n, --namespace-pool=PATH\tBorrow namespaces from the --pool supervisor listening on PATH\n");
+	fprintf(stream,
+		"  --layer-cache=DIR\tResolve ALGORITHM:HEX overlay layers to DIR/ALGORITHM/HEX\n");
+	fprintf(stream,
+		"  --seal-exec\tRun process.host executables from a sealed memfd copy\n");
+	fprintf(stream,
+		"  --status-fd=FD\tWrite the container process's exit code to FD as soon as it is collected\n");
+	fprintf(stream,
+		"  --async-teardown\tExit with the container process's code and run post-stop hooks in the background\n");
+	fprintf(stream,
+		"  --log-buffer\tCollect --verbose lines in memory and write them in batches\n");
+	fprintf(stream,
+		"  --stats=SECONDS\tWrite a JSON line of container resource usage to stderr every SECONDS\n");
+	fprintf(stream,
+		"  --io-uring\tRelay pseudoterminals with io_uring, falling back to epoll\n");
+	fprintf(stream,
+		"  --checkpoint=DIR\tDump the running container to DIR with criu on SIGUSR1\n");
+	fprintf(stream,
+		"  --restore=DIR\tRestore the container from the criu images in DIR\n");
 }
 
 static void version()
@@ -245,16 +1052,20 @@ static void version()
 
 static void kill_children(int signum, siginfo_t * siginfo, void *unused)
 {
-	pid_t cpid = child_pid, hpid = hook_pid;
+	pid_t cpid = child_pid, hpid;
+	int i;
 
 	if (cpid > 0) {
 		if (kill(cpid, signum)) {
 			PERROR("kill");
 		}
 	}
-	if (hpid > 0) {
-		if (kill(hpid, signum)) {
-			PERROR("kill");
+	for (i = 0; i < HOOK_BATCH_SIZE; i++) {
+		hpid = hook_pids[i];
+		if (hpid > 0) {
+			if (kill(hpid, signum)) {
+				PERROR("kill");
+			}
 		}
 	}
 
@@ -263,18 +1074,36 @@ static void kill_children(int signum, siginfo_t * siginfo, void *unused)
 
 static void reap_child(int signum, siginfo_t * siginfo, void *unused)
 {
-	pid_t cpid = child_pid, hpid = hook_pid;
+	pid_t cpid = child_pid;
+	int i;
 
 	if ((*siginfo).si_pid == cpid) {
 		child_pid = -1;
-	} else if ((*siginfo).si_pid == hpid) {
-		hook_pid = -1;
-	} else {
-		if (waitid(P_PID, (*siginfo).si_pid, siginfo, WEXITED) == -1) {
-			PERROR("waitid");
+		return;
+	}
+	for (i = 0; i < HOOK_BATCH_SIZE; i++) {
+		if (hook_pids[i] > 0 && (*siginfo).si_pid == hook_pids[i]) {
+			hook_pids[i] = -1;
+			return;
 		}
 	}
+	/*
+	 * An untracked PID may be an orphan to reap, or a grouped hook
+	 * wait_hooks already reaped while SIGCHLD was blocked, so don't
+	 * block on a PID that may be gone (or reused).
+	 */
+	if (waitid(P_PID, (*siginfo).si_pid, siginfo, WEXITED | WNOHANG) ==
+	    -1 && errno != ECHILD) {
+		PERROR("waitid");
+	}
+
+	return;
+}
 
+/* checkpoint_tick does the work outside of signal context */
+static void request_checkpoint(int signum, siginfo_t * siginfo, void *unused)
+{
+	checkpoint_requested = 1;
 	return;
 }
 
@@ -282,9 +1111,18 @@ static int block_signals()
 {
 	sigset_t sa_mask;
 
-	LOG("block SIGHUP, SIGINT, and SIGTERM\n");
-	if (sigaddset(&sa_mask, SIGHUP) || sigaddset(&sa_mask, SIGINT)
-	    || sigaddset(&sa_mask, SIGTERM)) {
+	/*
+	 * Holding SIGCHLD keeps reap_child from reaping a fresh child
+	 * (as an unknown PID) before we record it in child_pid or
+	 * hook_pids.
+	 */
+	LOG("block SIGCHLD, SIGHUP, SIGINT, and SIGTERM\n");
+	if (sigemptyset(&sa_mask) == -1) {
+		PERROR("sigemptyset");
+		return -1;
+	}
+	if (sigaddset(&sa_mask, SIGCHLD) || sigaddset(&sa_mask, SIGHUP)
+	    || sigaddset(&sa_mask, SIGINT) || sigaddset(&sa_mask, SIGTERM)) {
 		PERROR("sigaddset");
 		return -1;
 	}
@@ -300,7 +1138,7 @@ static int unblock_signals()
 {
 	sigset_t sa_mask;
 
-	LOG("unblock SIGHUP, SIGINT, and SIGTERM\n");
+	LOG("unblock SIGCHLD, SIGHUP, SIGINT, and SIGTERM\n");
 	if (sigemptyset(&sa_mask) == -1) {
 		PERROR("sigemptyset");
 		return -1;
@@ -342,6 +1180,17 @@ static int install_signal_handlers()
 		return -1;
 	}
 
+	if (checkpoint_dir) {
+		LOG("install ccon's SIGUSR1 handler\n");
+		/* a request during setup shouldn't fail its reads with EINTR */
+		act.sa_flags = SA_SIGINFO | SA_RESTART;
+		act.sa_sigaction = request_checkpoint;
+		if (sigaction(SIGUSR1, &act, NULL)) {
+			PERROR("sigaction");
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -366,10 +1215,9 @@ static int uninstall_signal_handlers()
 
 static int validate_config(json_t * config)
 {
-	json_t *value, *pre_start;
+	json_t *value;
 	json_error_t error;
 	const char *version;
-	float api;
 	int err;
 
 	if (!json_is_object(config)) {
@@ -403,6 +1251,7 @@ static int validate_config(json_t * config)
 	      "s?{,"	/* "user": { */
 	        "s?s,"	/* "path": "/proc/123/ns/user" */
 	        "s?b,"	/* "setgroups": false */
+	        "s?b,"	/* "mappingHelpers": true */
 	        "s?[*],"	/* "uidMappings": [...] */
 	        "s?[*]"	/* "gidMappings": [...] */
 	      "},"	/* }  (user) */
@@ -440,18 +1289,30 @@ static int validate_config(json_t * config)
 	      "s?s,"	/* "path": "busybox" */
 	      "s?b,"	/* "host": true */
 	      "s?[*],"	/* "env": [...] */
+	      "s?b,"	/* "inheritEnv": true */
+	      "s?{"	/* "seccomp": { */
+	        "s:s,"	/* "defaultAction": "SCMP_ACT_ALLOW" */
+	        "s?i,"	/* "defaultErrnoRet": 1 */
+	        "s?[*]"	/* "syscalls": [...] */
+	      "}"	/* }  (seccomp) */
 	    "},"	/* }  (process) */
 	    "s?{"	/* "hooks": { */
+	      "s?F,"	/* "timeout": 30 */
 	      "s?[*],"	/* "post-create": [...] */
 	      "s?[*],"	/* "pre-start": [...] */
 	      "s?[*]"	/* "post-stop": [...] */
 	    "},"	/* }  (hooks) */
+	    "s?{"	/* "cgroup": { */
+	      "s:s,"	/* "path": "/sys/fs/cgroup/ccon" */
+	      "s?b"	/* "create": true */
+	    "},"	/* }  (cgroup) */
 	  "}",
 	  "version",
 	  "namespaces",
 	    "user",
 	      "path",
 	      "setgroups",
+	      "mappingHelpers",
 	      "uidMappings",
 	      "gidMappings",
 	    "mount",
@@ -480,10 +1341,19 @@ static int validate_config(json_t * config)
 	    "path",
 	    "host",
 	    "env",
+	    "inheritEnv",
+	    "seccomp",
+	      "defaultAction",
+	      "defaultErrnoRet",
+	      "syscalls",
 	  "hooks",
+	    "timeout",
 	    "post-create",
 	    "pre-start",
-	    "post-stop"
+	    "post-stop",
+	  "cgroup",
+	    "path",
+	    "create"
 	);
 /* *INDENT-ON* */
 	if (err) {
@@ -491,7 +1361,22 @@ static int validate_config(json_t * config)
 		return err;
 	}
 
-	api = version_api(version);
+	/*
+	 * TODO, validate:
+	 * * v0.1.0 spec doesn't contain process.host
+	 * * array values (process.env, hooks.post-create, ...)
+	 */
+	return 0;
+}
+
+/* adjust a valid config from an older version to the current API */
+static int upgrade_config(json_t * config)
+{
+	json_t *value, *pre_start;
+	float api;
+
+	value = json_object_get(config, "version");
+	api = version_api(json_string_value(value));
 	if (api < 0) {
 		return 1;
 	}
@@ -512,11 +1397,6 @@ static int validate_config(json_t * config)
 		}
 	}
 
-	/*
-	 * TODO, validate:
-	 * * v0.1.0 spec doesn't contain process.host
-	 * * array values (process.env, hooks.post-create, ...)
-	 */
 	return 0;
 }
 
@@ -585,78 +1465,510 @@ static float version_api(const char *version)
 	return api;
 }
 
-static int run_container(json_t * config, const char *socket_path)
+static int read_file(const char *path, char **buf, size_t * size)
 {
-	json_t *process;
-	child_func_args_t child_args;
-	char *stack = NULL, *stack_top;
-	int sockets[2];
-	int flags = SIGCHLD;
-	pid_t cpid;
-	int err = 0, i;
-
-	child_args.config = NULL;
-	child_args.socket = -1;
-	child_args.exec_fd = -1;
-	child_args.namespace_fds = NULL;
-
-	if (get_clone_flags(config, &flags)) {
-		return 1;
-	}
+	struct stat st;
+	ssize_t n;
+	size_t len = 0;
+	int fd, err = 0;
 
-	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) == -1) {
-		PERROR("socketpair");
+	*buf = NULL;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		PERROR("open");
+		LOG("failed to read %s\n", path);
 		return 1;
 	}
 
-	child_args.config = config;
-	child_args.socket = sockets[1];
-
-	process = json_object_get(config, "process");
-	if (process) {
-		if (get_host_exec_fd(process, &child_args.exec_fd) == -1) {
-			err = 1;
-			goto cleanup;
-		}
-	}
-
-	if (get_namespace_fds(config, &child_args.namespace_fds)) {
+	if (fstat(fd, &st) == -1) {
+		PERROR("fstat");
 		err = 1;
 		goto cleanup;
 	}
 
-	stack = malloc(STACK_SIZE);
-	if (!stack) {
+	*buf = malloc((size_t) st.st_size + 1);
+	if (!*buf) {
 		PERROR("malloc");
 		err = 1;
 		goto cleanup;
 	}
-	stack_top = stack + STACK_SIZE;	/* assume stack grows downward */
 
-	if (block_signals() == -1) {
-		err = 1;
-		goto cleanup;
+	while (len < (size_t) st.st_size) {
+		n = read(fd, *buf + len, (size_t) st.st_size - len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			PERROR("read");
+			err = 1;
+			goto cleanup;
+		}
+		if (n == 0) {
+			break;	/* truncated while we were reading */
+		}
+		len += (size_t) n;
 	}
+	(*buf)[len] = '\0';
+	*size = len;
 
-	if (install_signal_handlers() == -1) {
+ cleanup:
+	if (close(fd) == -1) {
+		PERROR("close");
 		err = 1;
-		goto cleanup;
 	}
-
-	child_pid = cpid = clone(&child_func, stack_top, flags, &child_args);
-	if (cpid == -1) {
-		PERROR("clone");
-		err = 1;
-		goto cleanup;
+	if (err && *buf) {
+		free(*buf);
+		*buf = NULL;
 	}
-	LOG("launched container process with PID %d\n", cpid);
+	return err;
+}
 
-	if (unblock_signals() == -1) {
-		err = 1;
-		goto cleanup;
+/* 64-bit FNV-1a */
+static uint64_t hash_config(const char *text, size_t size)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		hash ^= (unsigned char)text[i];
+		hash *= 0x100000001b3ULL;
 	}
+	return hash;
+}
 
-	if (close(sockets[1]) == -1) {
+/*
+ * Resolve the lookups the container setup would otherwise repeat
+ * from the JSON: the clone(2) flags, each mount's flags, the
+ * process.capabilities bitmask, and the process.seccomp filter.  If
+ * text is set, it is copied into the plan for save_plan.
+ */
+static int compile_plan(json_t * config, const char *text, size_t size,
+			uint64_t hash)
+{
+	config_plan_t *plan;
+	json_t *mounts = NULL, *capabilities = NULL, *mt, *value, *v2;
+	struct sock_filter *filter = NULL;
+	const char *flag, *name;
+	unsigned long flags, f;
+	size_t i, j, n_mounts = 0, n_capabilities = 0, filter_length = 0;
+	size_t plan_size;
+	int clone_flags = 0, cap;
+
+	if (get_clone_flags(config, &clone_flags)) {
+		return 1;
+	}
+
+	value = json_object_get(config, "namespaces");
+	if (value) {
+		value = json_object_get(value, "mount");
+		if (value) {
+			mounts = json_object_get(value, "mounts");
+			n_mounts = json_array_size(mounts);
+		}
+	}
+
+	value = json_object_get(config, "process");
+	if (value) {
+		capabilities = json_object_get(value, "capabilities");
+		n_capabilities = json_array_size(capabilities);
+		if (compile_seccomp(value, &filter, &filter_length)) {
+			return 1;
+		}
+	}
+
+	if (!text) {
+		size = 0;
+	}
+	plan_size =
+	    sizeof(config_plan_t) + sizeof(int64_t) * (n_mounts +
+						       FILTER_SLOTS
+						       (filter_length)) + size;
+	plan = calloc(1, plan_size);
+	if (!plan) {
+		PERROR("calloc");
+		free(filter);
+		return 1;
+	}
+
+	memcpy(plan->magic, CONFIG_PLAN_MAGIC, sizeof(plan->magic));
+	strncpy(plan->version, CCON_VERSION, sizeof(plan->version) - 1);
+	plan->format = CONFIG_PLAN_FORMAT;
+	plan->mount_count = (uint32_t) n_mounts;
+	plan->capability_count = capabilities ? (int32_t) n_capabilities : -1;
+	plan->clone_flags = clone_flags;
+	plan->hash = hash;
+	plan->config_size = size;
+	plan->filter_length = filter_length;
+	if (filter) {
+		memcpy(plan->data + n_mounts, filter,
+		       filter_length * sizeof(struct sock_filter));
+		free(filter);
+	}
+
+	json_array_foreach(mounts, i, mt) {
+		flags = 0;
+		value = json_object_get(mt, "flags");
+		json_array_foreach(value, j, v2) {
+			flag = json_string_value(v2);
+			if (!flag) {
+				LOG("failed to extract namespaces.mount.mounts[%d].flags[%d]\n", (int)i, (int)j);
+				free(plan);
+				return 1;
+			}
+			if (get_mount_flag(flag, &f)) {
+				free(plan);
+				return 1;
+			}
+			flags |= f;
+		}
+		plan->data[i] = (int64_t) flags;
+	}
+
+	json_array_foreach(capabilities, i, value) {
+		name = json_string_value(value);
+		if (!name) {
+			LOG("failed to extract process.capabilities[%d]\n",
+			    (int)i);
+			free(plan);
+			return 1;
+		}
+		cap = _capng_name_to_capability(name);
+		if (cap < 0 || cap >= 64) {
+			/* leave unrecognized names for set_capabilities to report */
+			plan->capability_count = -1;
+			plan->capabilities = 0;
+			break;
+		}
+		plan->capabilities |= (uint64_t) 1 << cap;
+	}
+
+	if (size) {
+		memcpy(plan->data + n_mounts + FILTER_SLOTS(filter_length),
+		       text, size);
+	}
+
+	config_plan = plan;
+	config_plan_size = plan_size;
+	config_plan_mapped = 0;
+	return 0;
+}
+
+static int get_plan_path(const char *plan_cache, uint64_t hash, char *path)
+{
+	int size;
+
+	size =
+	    snprintf(path, MAX_PATH, "%s/%016llx.plan", plan_cache,
+		     (unsigned long long int)hash);
+	if (size < 0) {
+		LOG("failed to format the config plan path in %s\n",
+		    plan_cache);
+		return 1;
+	}
+	if (size >= MAX_PATH) {
+		LOG("failed to format the config plan path in %s (needed a buffer with %d bytes)\n", plan_cache, size);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Map a cached plan for this config text, if there is one.  Anything
+ * unexpected about the cache file makes it a miss, so the config is
+ * compiled again.
+ */
+static int load_plan(const char *plan_cache, const char *text, size_t size,
+		     uint64_t hash)
+{
+	const config_plan_t *plan;
+	struct stat st;
+	char path[MAX_PATH];
+	size_t expected;
+	void *map = MAP_FAILED;
+	int fd;
+
+	if (get_plan_path(plan_cache, hash, path)) {
+		return 1;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			PERROR("open");
+		}
+		LOG("no cached config plan at %s\n", path);
+		return 0;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		PERROR("fstat");
+		goto cleanup;
+	}
+
+	/* plans skip validation, so only trust our own */
+	if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		LOG("ignore config plan %s with an untrusted owner or mode\n",
+		    path);
+		goto cleanup;
+	}
+
+	if ((size_t) st.st_size < sizeof(config_plan_t)) {
+		LOG("ignore truncated config plan %s\n", path);
+		goto cleanup;
+	}
+
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		PERROR("mmap");
+		goto cleanup;
+	}
+	plan = map;
+
+	expected = sizeof(config_plan_t) + size;
+	expected += sizeof(int64_t) * (size_t) plan->mount_count;
+	if (plan->filter_length <= BPF_MAXINSNS) {
+		expected +=
+		    sizeof(int64_t) * FILTER_SLOTS((size_t) plan->filter_length);
+	}
+	if (memcmp(plan->magic, CONFIG_PLAN_MAGIC, sizeof(plan->magic)) != 0
+	    || plan->format != CONFIG_PLAN_FORMAT
+	    || plan->filter_length > BPF_MAXINSNS
+	    || strncmp(plan->version, CCON_VERSION,
+		       sizeof(plan->version)) != 0 || plan->hash != hash
+	    || plan->config_size != size || (size_t) st.st_size != expected
+	    || memcmp((char *)map + expected - size, text, size) != 0) {
+		LOG("ignore stale config plan %s\n", path);
+		goto cleanup;
+	}
+
+	LOG("load config plan from %s\n", path);
+	config_plan = plan;
+	config_plan_size = (size_t) st.st_size;
+	config_plan_mapped = 1;
+	map = MAP_FAILED;
+
+ cleanup:
+	if (map != MAP_FAILED) {
+		if (munmap(map, (size_t) st.st_size) == -1) {
+			PERROR("munmap");
+		}
+	}
+	if (close(fd) == -1) {
+		PERROR("close");
+	}
+	return 0;
+}
+
+/* write config_plan to a temporary file and rename it into place */
+static int save_plan(const char *plan_cache)
+{
+	char path[MAX_PATH], tmp[MAX_PATH];
+	const char *p;
+	size_t len = 0;
+	ssize_t n;
+	int fd, err = 0, size;
+
+	if (get_plan_path(plan_cache, config_plan->hash, path)) {
+		return 1;
+	}
+
+	size = snprintf(tmp, MAX_PATH, "%s.XXXXXX", path);
+	if (size < 0 || size >= MAX_PATH) {
+		LOG("failed to format a temporary path for %s\n", path);
+		return 1;
+	}
+
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		PERROR("mkstemp");
+		return 1;
+	}
+
+	p = (const char *)config_plan;
+	while (len < config_plan_size) {
+		n = write(fd, p + len, config_plan_size - len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			PERROR("write");
+			err = 1;
+			break;
+		}
+		len += (size_t) n;
+	}
+
+	if (close(fd) == -1) {
+		PERROR("close");
+		err = 1;
+	}
+
+	if (!err) {
+		LOG("write config plan to %s\n", path);
+		if (rename(tmp, path) == -1) {
+			PERROR("rename");
+			err = 1;
+		}
+	}
+
+	if (err && unlink(tmp) == -1) {
+		PERROR("unlink");
+	}
+	return err;
+}
+
+static void free_plan()
+{
+	free_exec_strings(&config_exec);
+	config_process = NULL;
+	if (!config_plan) {
+		return;
+	}
+	if (config_plan_mapped) {
+		if (munmap((void *)config_plan, config_plan_size) == -1) {
+			PERROR("munmap");
+		}
+	} else {
+		free((void *)config_plan);
+	}
+	config_plan = NULL;
+	config_plan_size = 0;
+	return;
+}
+
+static int run_container(json_t * config, const char *socket_path)
+{
+	json_t *process;
+	child_func_args_t child_args;
+	namespace_opens_t prepare;
+	user_mappings_t user_mappings;
+	char *stack = NULL;
+	int sockets[2];
+	int flags = SIGCHLD;
+	pid_t cpid;
+	int err = 0, i, cgroup_fd = -1, cgroup_created = 0, cgroup_placed = 0;
+
+	child_args.config = NULL;
+	child_args.socket = -1;
+	child_args.exec_fd = -1;
+	child_args.namespace_fds = NULL;
+	memset(&prepare, 0, sizeof(prepare));
+	memset(&user_mappings, 0, sizeof(user_mappings));
+	flags |= config_plan->clone_flags;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) == -1) {
+		PERROR("socketpair");
+		return 1;
+	}
+
+	if (trace_open()) {
+		err = 1;
+		goto cleanup;
+	}
+
+	child_args.config = config;
+	child_args.socket = sockets[1];
+
+	/* namespace paths open in helper threads while we find process.host */
+	process = json_object_get(config, "process");
+	trace_event('B', "prepare");
+	if (start_namespace_fds
+	    (config, &prepare,
+	     process && json_boolean_value(json_object_get(process, "host")))) {
+		err = 1;
+		goto cleanup;
+	}
+
+	if (process && process == config_process && host_exec_fd >= 0) {
+		child_args.exec_fd = fcntl(host_exec_fd, F_DUPFD_CLOEXEC, 0);
+		if (child_args.exec_fd == -1) {
+			PERROR("fcntl");
+			err = 1;
+			goto cleanup;
+		}
+	} else if (process) {
+		if (get_host_exec_fd(process, &child_args.exec_fd) == -1) {
+			err = 1;
+			goto cleanup;
+		}
+		if (seal_exec && child_args.exec_fd >= 0
+		    && seal_exec_fd(&child_args.exec_fd)) {
+			err = 1;
+			goto cleanup;
+		}
+	}
+
+	if (collect_namespace_fds(&prepare, &child_args.namespace_fds)) {
+		err = 1;
+		goto cleanup;
+	}
+	trace_event('E', "prepare");
+
+	if (namespace_pool) {
+		trace_event('B', "borrow-namespaces");
+		if (borrow_namespaces
+		    (namespace_pool, &child_args.namespace_fds, &flags)) {
+			err = 1;
+			goto cleanup;
+		}
+		trace_event('E', "borrow-namespaces");
+	}
+
+	if (get_user_mappings(config, &user_mappings)) {
+		err = 1;
+		goto cleanup;
+	}
+
+	if (open_cgroup(config, &cgroup_fd, &cgroup_created)) {
+		err = 1;
+		goto cleanup;
+	}
+
+	if (block_signals() == -1) {
+		err = 1;
+		goto cleanup;
+	}
+
+	if (install_signal_handlers() == -1) {
+		err = 1;
+		goto cleanup;
+	}
+
+	trace_event('B', "clone");
+	child_pid = cpid =
+	    clone_container(flags, &child_args, &stack, cgroup_fd,
+			    &cgroup_placed);
+	if (cpid == -1) {
+		err = 1;
+		goto cleanup;
+	}
+	trace_event('E', "clone");
+	LOG("launched container process with PID %d\n", cpid);
+
+	/* the container blocks on its user-namespace mappings until we join */
+	if (cgroup_fd >= 0 && !cgroup_placed && join_cgroup(cgroup_fd, cpid)) {
+		err = 1;
+		goto cleanup;
+	}
+	if (cgroup_fd >= 0 && stats_interval > 0) {
+		stats_cgroup_fd = cgroup_fd;	/* for emit_stats */
+		cgroup_fd = -1;
+	} else if (cgroup_fd >= 0) {
+		if (close(cgroup_fd) == -1) {
+			PERROR("close cgroup directory");
+			cgroup_fd = -1;
+			err = 1;
+			goto cleanup;
+		}
+		cgroup_fd = -1;
+	}
+
+	if (unblock_signals() == -1) {
+		err = 1;
+		goto cleanup;
+	}
+
+	if (close(sockets[1]) == -1) {
 		PERROR("close container-side socket");
 		sockets[1] = -1;
 		err = 1;
@@ -689,7 +2001,8 @@ static int run_container(json_t * config, const char *socket_path)
 		child_args.namespace_fds = NULL;
 	}
 
-	err = handle_parent(config, socket_path, cpid, &sockets[0]);
+	err = handle_parent(config, &user_mappings, socket_path, cpid,
+			    &sockets[0]);
 
  cleanup:
 	cpid = child_pid;
@@ -699,9 +2012,19 @@ static int run_container(json_t * config, const char *socket_path)
 		}
 		child_pid = -1;
 	}
+	if (child_pidfd >= 0) {
+		if (close(child_pidfd) == -1) {
+			PERROR("close container pidfd");
+			err = 1;
+		}
+		child_pidfd = -1;
+	}
 	if (close_pipe(sockets)) {
 		err = 1;
 	}
+	if (collect_namespace_fds(&prepare, NULL)) {
+		err = 1;
+	}
 	if (child_args.exec_fd >= 0) {
 		if (close(child_args.exec_fd) == -1) {
 			PERROR("close container-process executable");
@@ -720,28 +2043,439 @@ static int run_container(json_t * config, const char *socket_path)
 		}
 		free(child_args.namespace_fds);
 	}
+	free_user_mappings(&user_mappings);
 	if (stack) {
 		free(stack);
 	}
+	if (cgroup_fd >= 0) {
+		if (close(cgroup_fd) == -1) {
+			PERROR("close cgroup directory");
+			err = 1;
+		}
+	}
+	if (stats_cgroup_fd >= 0) {
+		if (close(stats_cgroup_fd) == -1) {
+			PERROR("close cgroup directory");
+			err = 1;
+		}
+		stats_cgroup_fd = -1;
+	}
+	if (cgroup_created) {
+		remove_cgroup(config);
+	}
+	(void)trace_close();	/* don't clobber the container's exit code */
 	return err;
 }
 
-static int handle_parent(json_t * config, const char *socket_path, pid_t cpid,
-			 int *socket)
+/*
+ * Skip clone(2) and the container setup, and have criu(8) restore the
+ * --restore images instead.  The images already record the mounts,
+ * user-namespace mappings, and any namespaces the container created,
+ * so the config only contributes namespaces to join, the pivot-root
+ * source (as criu's --root), and the post-stop hooks.  As a child
+ * subreaper, we inherit the restored process when criu exits.
+ */
+static int restore_container(json_t * config)
 {
-	json_t *process, *console = NULL, *terminal = NULL;
-	char buf[MESSAGE_SIZE];
-	struct iovec iov;
-	struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
-	size_t len;
-	ssize_t n;
-	int master = -1, slave = -1, err = 0, exit = 0;
+	char *argv[RESTORE_ARGS], *buf = NULL, *end;
+	char root[MAX_PATH], join[RESTORE_JOIN_NAMESPACES][MAX_PATH];
+	char dir[] = "/tmp/ccon-restore-XXXXXX", pidfile[MAX_PATH];
+	struct timespec zero = { 0, 0 };
+	siginfo_t siginfo;
+	sigset_t mask;
+	size_t size;
+	long value;
+	pid_t cpid;
+	int err = 0, exit, i;
 
-	if (set_user_namespace_mappings(config, cpid)) {
-		err = 1;
-		goto wait;
+	if (trace_open()) {
+		return 1;
 	}
 
+	i = get_restore_args(config, argv, root, join);
+	if (i < 0) {
+		err = 1;
+		goto cleanup;
+	}
+
+	/* criu creates the pidfile with O_EXCL */
+	if (!mkdtemp(dir)) {
+		PERROR("mkdtemp");
+		dir[0] = '\0';
+		err = 1;
+		goto cleanup;
+	}
+	(void)snprintf(pidfile, MAX_PATH, "%s/pid", dir);
+	argv[i++] = "--pidfile";
+	argv[i++] = pidfile;
+	argv[i] = NULL;
+
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1)) {
+		PERROR("prctl");
+		err = 1;
+		goto cleanup;
+	}
+
+	if (install_signal_handlers() == -1) {
+		err = 1;
+		goto cleanup;
+	}
+
+	/* hold SIGCHLD until child_pid is set, like run_container */
+	if (block_signals() == -1) {
+		err = 1;
+		goto cleanup;
+	}
+
+	trace_event('B', "restore");
+	if (run_helper(argv)) {
+		(void)unblock_signals();
+		err = 1;
+		goto cleanup;
+	}
+	trace_event('E', "restore");
+
+	if (read_file(pidfile, &buf, &size)) {
+		(void)unblock_signals();
+		err = 1;
+		goto cleanup;
+	}
+	errno = 0;
+	value = strtol(buf, &end, 10);
+	if (errno || end == buf || (*end != '\0' && *end != '\n')
+	    || value <= 0) {
+		LOG("invalid PID in criu pidfile %s: %s\n", pidfile, buf);
+		(void)unblock_signals();
+		err = 1;
+		goto cleanup;
+	}
+	child_pid = cpid = (pid_t) value;
+	LOG("restored container process with PID %d\n", cpid);
+
+	/* discard criu's SIGCHLD, which may have absorbed the container's */
+	if (sigemptyset(&mask) || sigaddset(&mask, SIGCHLD)) {
+		PERROR("sigaddset");
+	} else {
+		while (sigtimedwait(&mask, NULL, &zero) > 0) ;
+	}
+	siginfo.si_pid = 0;
+	if (waitid(P_PID, cpid, &siginfo, WEXITED | WNOHANG | WNOWAIT) == -1) {
+		PERROR("waitid");
+	} else if (siginfo.si_pid == cpid) {
+		child_pid = -1;
+	}
+
+	if (unblock_signals() == -1) {
+		err = 1;
+		goto cleanup;
+	}
+	log_flush();		/* startup is over, don't sit on its lines */
+
+	exit = wait_container(cpid);
+	trace_event('I', "container-exit");
+
+	report_status(exit);
+	if (async_teardown) {
+		background_teardown(exit);
+	}
+
+	(void)run_hooks(config, "post-stop", 0);
+	err = exit;
+
+ cleanup:
+	if (err && child_pid >= 0) {
+		if (kill(child_pid, SIGKILL)) {
+			PERROR("kill");
+		}
+		child_pid = -1;
+	}
+	if (buf) {
+		free(buf);
+	}
+	if (dir[0]) {
+		if (unlink(pidfile) == -1 && errno != ENOENT) {
+			PERROR("unlink");
+		}
+		if (rmdir(dir) == -1) {
+			PERROR("rmdir");
+		}
+	}
+	(void)trace_close();	/* don't clobber the container's exit code */
+	return err;
+}
+
+/*
+ * Fill argv with the criu restore command up to its --pidfile, and
+ * return the index of the next argument (or -1 on error).  root and
+ * join provide storage for the --root and --join-ns values.
+ */
+static int get_restore_args(json_t * config, char **argv, char *root,
+			    char join[][MAX_PATH])
+{
+	json_t *namespaces, *mount, *value, *path;
+	const char *key, *type, *source;
+	size_t j;
+	int i = 0, n = 0, size;
+
+	argv[i++] = "criu";
+	argv[i++] = "restore";
+	argv[i++] = "--images-dir";
+	argv[i++] = (char *)restore_dir;
+	argv[i++] = "--restore-detached";
+	argv[i++] = "--shell-job";
+
+	namespaces = json_object_get(config, "namespaces");
+	mount = json_object_get(json_object_get(namespaces, "mount"), "mounts");
+	json_array_foreach(mount, j, value) {
+		type = json_string_value(json_object_get(value, "type"));
+		if (!type || strcmp(type, "pivot-root")) {
+			continue;
+		}
+		source = json_string_value(json_object_get(value, "source"));
+		if (!source) {
+			LOG("failed to get namespaces.mount.mounts[%d].source\n", (int)j);
+			return -1;
+		}
+		if (!realpath(source, root)) {
+			PERROR("realpath");
+			return -1;
+		}
+		argv[i++] = "--root";
+		argv[i++] = root;
+		break;
+	}
+
+	json_object_foreach(namespaces, key, value) {
+		path = json_object_get(value, "path");
+		if (!path) {
+			continue;
+		}
+		if (strcmp(key, "net") && strcmp(key, "uts") && strcmp(key, "ipc")
+		    && strcmp(key, "user")) {
+			LOG("criu cannot join the %s namespace at %s\n", key,
+			    json_string_value(path));
+			return -1;
+		}
+		size =
+		    snprintf(join[n], MAX_PATH, "%s:%s", key,
+			     json_string_value(path));
+		if (size < 0 || size >= MAX_PATH) {
+			LOG("failed to format --join-ns for the %s namespace\n",
+			    key);
+			return -1;
+		}
+		argv[i++] = "--join-ns";
+		argv[i++] = join[n++];
+	}
+
+	return i;
+}
+
+/* service a SIGUSR1 from the host process's wait and relay loops */
+static void checkpoint_tick()
+{
+	if (!checkpoint_requested) {
+		return;
+	}
+	checkpoint_requested = 0;
+	if (child_pid < 0) {
+		return;
+	}
+	(void)checkpoint_container(child_pid);	/* the container keeps running */
+}
+
+/*
+ * Dump the container's process tree to the --checkpoint directory with
+ * criu(8), leaving it running.  --shell-job lets criu dump a tree whose
+ * session and standard streams come from outside it.
+ */
+static int checkpoint_container(pid_t cpid)
+{
+	char pid[32];
+	char *argv[] = {
+		"criu", "dump", "--tree", pid, "--images-dir",
+		(char *)checkpoint_dir, "--leave-running", "--shell-job", NULL
+	};
+	int err;
+
+	(void)snprintf(pid, sizeof(pid), "%d", (int)cpid);
+	trace_event('B', "checkpoint");
+	err = run_helper(argv);
+	trace_event('E', "checkpoint");
+	if (!err) {
+		LOG("checkpointed container process %d to %s\n", (int)cpid,
+		    checkpoint_dir);
+	}
+	return err;
+}
+
+/*
+ * Prefer clone3(2), which returns a pidfd for the relay loops to poll
+ * and needs no separate stack: without one, the child continues on a
+ * copy of ours like fork(2).  Older kernels (and seccomp profiles that
+ * reject clone3) get clone(2) with a STACK_SIZE stack.
+ */
+/*
+ * With a cgroup_fd, the container is born in that cgroup
+ * (CLONE_INTO_CGROUP, Linux 5.7) and *placed is set.  Otherwise the
+ * caller must move the container with join_cgroup.
+ */
+static pid_t clone_container(int flags, child_func_args_t * child_args,
+			     char **stack, int cgroup_fd, int *placed)
+{
+	clone3_args_t args;
+	int pidfd = -1;
+	pid_t cpid;
+
+	*placed = 0;
+	memset(&args, 0, sizeof(args));
+	args.flags = (uint64_t) (flags & ~CSIGNAL) | CLONE_PIDFD;
+	args.pidfd = (uint64_t) (uintptr_t) & pidfd;
+	args.exit_signal = (uint64_t) (flags & CSIGNAL);
+	if (cgroup_fd >= 0) {
+		args.flags |= CLONE_INTO_CGROUP;
+		args.cgroup = (uint64_t) cgroup_fd;
+	}
+	/* flush before each clone, or the container would repeat lines */
+	log_flush();
+	cpid = (pid_t) syscall(__NR_clone3, &args, sizeof(args));
+	if (cpid == -1 && cgroup_fd >= 0 && (errno == E2BIG || errno == EINVAL)) {
+		/* kernels before 5.7 don't know CLONE_INTO_CGROUP */
+		LOG("clone3 without CLONE_INTO_CGROUP\n");
+		args.flags &= ~CLONE_INTO_CGROUP;
+		args.cgroup = 0;
+		log_flush();
+		cpid = (pid_t) syscall(__NR_clone3, &args, sizeof(args));
+		cgroup_fd = -1;
+	}
+	if (cpid == 0) {	/* child */
+		_exit(child_func(child_args));
+	}
+	if (cpid > 0) {
+		child_pidfd = pidfd;
+		*placed = cgroup_fd >= 0;
+		return cpid;
+	}
+	if (errno != ENOSYS && errno != EPERM) {
+		PERROR("clone3");
+		return -1;
+	}
+
+	*stack = malloc(STACK_SIZE);
+	if (!*stack) {
+		PERROR("malloc");
+		return -1;
+	}
+	/* assume stack grows downward */
+	log_flush();
+	cpid = clone(&child_func, *stack + STACK_SIZE, flags, child_args);
+	if (cpid == -1) {
+		PERROR("clone");
+	}
+	return cpid;
+}
+
+/*
+ * Open the configured cgroup v2 directory for clone_container,
+ * creating it first if cgroup.create is set.  *created is only set if
+ * we made the directory, so we don't remove cgroups we didn't create.
+ */
+static int open_cgroup(json_t * config, int *cgroup_fd, int *created)
+{
+	json_t *cgroup;
+	const char *path;
+
+	cgroup = json_object_get(config, "cgroup");
+	if (!cgroup) {
+		return 0;
+	}
+
+	path = json_string_value(json_object_get(cgroup, "path"));
+	if (!path) {
+		LOG("cgroup.path is not a string\n");
+		return 1;
+	}
+
+	if (json_boolean_value(json_object_get(cgroup, "create"))) {
+		if (mkdir(path, 0755) == 0) {
+			LOG("created cgroup %s\n", path);
+			*created = 1;
+		} else if (errno != EEXIST) {
+			PERROR("mkdir");
+			return 1;
+		}
+	}
+
+	*cgroup_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (*cgroup_fd == -1) {
+		PERROR("open");
+		LOG("failed to open cgroup %s\n", path);
+		return 1;
+	}
+	LOG("place container process in cgroup %s\n", path);
+
+	return 0;
+}
+
+/* fallback when clone_container could not use CLONE_INTO_CGROUP */
+static int join_cgroup(int cgroup_fd, pid_t pid)
+{
+	int fd, err = 0;
+
+	fd = openat(cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+	if (fd == -1) {
+		PERROR("openat");
+		return 1;
+	}
+
+	LOG("write %d to cgroup.procs\n", (int)pid);
+	if (dprintf(fd, "%d", (int)pid) < 0) {
+		PERROR("dprintf");
+		err = 1;
+	}
+
+	if (close(fd) == -1) {
+		PERROR("close cgroup.procs");
+		err = 1;
+	}
+	return err;
+}
+
+static void remove_cgroup(json_t * config)
+{
+	const char *path;
+
+	path =
+	    json_string_value(json_object_get
+			      (json_object_get(config, "cgroup"), "path"));
+	if (!path) {
+		return;
+	}
+
+	LOG("remove cgroup %s\n", path);
+	if (rmdir(path) == -1) {
+		PERROR("rmdir");
+	}
+}
+
+static int handle_parent(json_t * config, user_mappings_t * user_mappings,
+			 const char *socket_path, pid_t cpid, int *socket)
+{
+	json_t *process, *console = NULL, *terminal = NULL;
+	char buf[MESSAGE_SIZE];
+	struct iovec iov;
+	struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
+	size_t len;
+	ssize_t n;
+	int master = -1, slave = -1, err = 0, exit = 0;
+
+	trace_event('B', "user-namespace-mappings");
+	if (set_user_namespace_mappings(user_mappings, cpid)) {
+		err = 1;
+		goto wait;
+	}
+	trace_event('E', "user-namespace-mappings");
+
 	iov.iov_base = (void *)USER_NAMESPACE_MAPPING_COMPLETE;
 	iov.iov_len = strlen(iov.iov_base);
 	n = sendmsg(*socket, &msg, 0);
@@ -830,6 +2564,7 @@ static int handle_parent(json_t * config, const char *socket_path, pid_t cpid,
 		kill_children(SIGKILL, NULL, NULL);
 	}
 	*socket = -1;
+	log_flush();		/* startup is over, don't sit on its lines */
 
 	if (!err && master >= 0) {
 		if (splice_pseudoterminal_master(&master, &slave)) {
@@ -854,21 +2589,94 @@ static int handle_parent(json_t * config, const char *socket_path, pid_t cpid,
 		}
 	}
 
-	exit = _wait(cpid, "container");
+	exit = wait_container(cpid);
+	trace_event('I', "container-exit");
+	if (err) {
+		exit = err;
+	}
+
+	report_status(exit);
+	if (async_teardown) {
+		background_teardown(exit);
+	}
 
 	(void)run_hooks(config, "post-stop", 0);
 
-	if (err) {
-		return err;
-	}
 	return exit;
 }
 
+/* write the container process's exit code to --status-fd */
+static void report_status(int code)
+{
+	if (status_fd < 0) {
+		return;
+	}
+
+	LOG("report exit code %d on %d\n", code, status_fd);
+	if (dprintf(status_fd, "%d\n", code) < 0) {
+		PERROR("dprintf");
+	}
+	if (close(status_fd) == -1) {
+		PERROR("close status file descriptor");
+	}
+	status_fd = -1;
+}
+
+/*
+ * Exit with the container process's code right away, and leave the
+ * rest of the teardown (post-stop hooks, --trace output) to a forked
+ * child.  The child drops stdin and stdout, so callers reading our
+ * stdout see EOF now instead of after the post-stop hooks.  If the
+ * fork fails, the teardown just runs in the foreground.
+ */
+static void background_teardown(int code)
+{
+	pid_t pid;
+	int fd;
+
+	/* so the child doesn't repeat buffered output */
+	log_flush();
+	if (fflush(NULL)) {
+		PERROR("fflush");
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		PERROR("fork");
+		return;
+	}
+
+	if (pid > 0) {
+		LOG("continue teardown in PID %d\n", (int)pid);
+		log_flush();
+		_exit(code);
+	}
+
+	trace_process = "teardown";
+	if (setsid() == -1) {
+		PERROR("setsid");
+	}
+	fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+	if (fd == -1) {
+		PERROR("open");
+		return;
+	}
+	if (dup2(fd, STDIN_FILENO) == -1 || dup2(fd, STDOUT_FILENO) == -1) {
+		PERROR("dup2");
+	}
+	if (close(fd) == -1) {
+		PERROR("close /dev/null");
+	}
+}
+
 static int child_func(void *arg)
 {
 	child_func_args_t *child_args = (child_func_args_t *) arg;
 	int err = 0, i;
 
+	trace_process = "container";
+	trace_event('I', "container-start");
+
 	if (prctl(PR_SET_PDEATHSIG, SIGKILL)) {
 		PERROR("prctl");
 		err = 1;
@@ -913,6 +2721,7 @@ static int child_func(void *arg)
 		}
 		free(child_args->namespace_fds);
 	}
+	log_flush();		/* we return to _exit(2), skipping atexit(3) */
 	return err;
 }
 
@@ -939,9 +2748,11 @@ static int handle_child(json_t * config, int *socket, int *exec_fd,
 		return 1;
 	}
 
-	if (join_namespaces(config, namespace_fds)) {
+	trace_event('B', "join-namespaces");
+	if (join_namespaces(*namespace_fds)) {
 		return 1;
 	}
+	trace_event('E', "join-namespaces");
 
 	if (handle_mounts(config)) {
 		return 1;
@@ -993,53 +2804,187 @@ static int handle_child(json_t * config, int *socket, int *exec_fd,
 	return 1;
 }
 
-static int set_path(char **env)
+/* execvpe(3) searches our own PATH, so adopt the container's */
+static int set_path(const char *path)
 {
-	size_t path_len, i;
-
-	path_len = strlen("PATH=");
-	for (i = 0; env[i] != NULL; i++) {
-		if (strncmp("PATH=", env[i], path_len) == 0) {
-			if (setenv("PATH", env[i] + path_len, 1)) {
-				PERROR("setenv");
-				return 1;
-			}
-			break;
-		}
+	if (path && setenv("PATH", path, 1)) {
+		PERROR("setenv");
+		return 1;
 	}
 
 	return 0;
 }
 
-static int set_terminal(json_t * process, int console, int dup_stdin,
-			int *socket)
+/*
+ * Materialize process.args and process.env (merged with our environ
+ * for process.inheritEnv) as packed vectors, and find the PATH entry
+ * for set_path.  prepare_config does this once for config_process, so
+ * pool workers inherit the result.
+ */
+static int get_exec_strings(json_t * process, exec_strings_t * strings)
 {
-	json_t *terminal;
-	char *slave_name;
-	int err = 0, master = -1, slave = -1;
+	json_t *value;
+	size_t i, len;
 
-	terminal = json_object_get(process, "terminal");
-	if (!terminal && !console) {
-		return 0;
-	}
+	memset(strings, 0, sizeof(*strings));
 
-	if (json_boolean_value(terminal) || console) {
-		if (socket == NULL) {
-			LOG("cannot create a pseudoterminal without a socket for master\n");
+	value = json_object_get(process, "args");
+	if (value) {
+		strings->argv = json_array_of_strings_value(value);
+		if (!strings->argv) {
+			LOG("failed to extract args\n");
 			return 1;
 		}
+	}
 
-		LOG("open a pseudoterminal device pair\n");
-		master = posix_openpt(O_RDWR);
-		if (master == -1) {
-			PERROR("posix_openpt");
-			return 1;
-		}
+	value = json_object_get(process, "env");
+	if (!value) {
+		return 0;
+	}
 
-		if (grantpt(master)) {
-			PERROR("grantpt");
-			if (errno == EPERM) {
-				LOG("grantpt permission errors appear nonfatal, so carrying on\n");
+	if (json_boolean_value(json_object_get(process, "inheritEnv"))) {
+		strings->env = merge_environ(value);
+	} else {
+		strings->env = json_array_of_strings_value(value);
+	}
+	if (!strings->env) {
+		LOG("failed to extract env\n");
+		free_exec_strings(strings);
+		return 1;
+	}
+
+	len = strlen("PATH=");
+	for (i = 0; strings->env[i]; i++) {
+		if (strncmp("PATH=", strings->env[i], len) == 0) {
+			strings->path = strings->env[i] + len;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static void free_exec_strings(exec_strings_t * strings)
+{
+	if (strings->argv) {
+		free(strings->argv);
+	}
+	if (strings->env) {
+		free(strings->env);
+	}
+	memset(strings, 0, sizeof(*strings));
+	return;
+}
+
+/*
+ * Pack our environ, minus the variables set in array, followed by
+ * array's entries.  The overridden names go in an open-addressing hash
+ * set, so the merge is linear in the size of both environments.
+ */
+static char **merge_environ(json_t * array)
+{
+	const char **strings = NULL, **keys = NULL, *entry;
+	char **env = NULL;
+	json_t *value;
+	size_t i, j, n, count = 0, size = 1, len;
+
+	for (n = 0; environ[n]; n++) ;
+
+	while (size < 2 * json_array_size(array)) {
+		size <<= 1;
+	}
+	keys = calloc(size, sizeof(const char *));
+	strings =
+	    malloc(sizeof(const char *) * (n + json_array_size(array) + 1));
+	if (!keys || !strings) {
+		PERROR("malloc");
+		goto cleanup;
+	}
+
+	json_array_foreach(array, i, value) {
+		entry = json_string_value(value);
+		if (!entry) {
+			goto cleanup;
+		}
+		len = env_key_length(entry);
+		j = (size_t) hash_config(entry, len) & (size - 1);
+		while (keys[j] && (env_key_length(keys[j]) != len
+				   || strncmp(keys[j], entry, len))) {
+			j = (j + 1) & (size - 1);
+		}
+		keys[j] = entry;
+	}
+
+	for (i = 0; i < n; i++) {
+		entry = environ[i];
+		len = env_key_length(entry);
+		j = (size_t) hash_config(entry, len) & (size - 1);
+		while (keys[j] && (env_key_length(keys[j]) != len
+				   || strncmp(keys[j], entry, len))) {
+			j = (j + 1) & (size - 1);
+		}
+		if (!keys[j]) {
+			strings[count++] = entry;
+		}
+	}
+
+	json_array_foreach(array, i, value) {
+		strings[count++] = json_string_value(value);
+	}
+
+	env = pack_strings(strings, count);
+
+ cleanup:
+	if (keys) {
+		free(keys);
+	}
+	if (strings) {
+		free(strings);
+	}
+	return env;
+}
+
+/* the length of an environment entry's name, before its '=' */
+static size_t env_key_length(const char *entry)
+{
+	const char *equals;
+
+	equals = strchr(entry, '=');
+	if (!equals) {
+		return strlen(entry);
+	}
+	return (size_t) (equals - entry);
+}
+
+static int set_terminal(json_t * process, int console, int dup_stdin,
+			int *socket)
+{
+	json_t *terminal;
+	char *slave_name;
+	int err = 0, master = -1, slave = -1;
+
+	terminal = json_object_get(process, "terminal");
+	if (!terminal && !console) {
+		return 0;
+	}
+
+	if (json_boolean_value(terminal) || console) {
+		if (socket == NULL) {
+			LOG("cannot create a pseudoterminal without a socket for master\n");
+			return 1;
+		}
+
+		LOG("open a pseudoterminal device pair\n");
+		master = posix_openpt(O_RDWR);
+		if (master == -1) {
+			PERROR("posix_openpt");
+			return 1;
+		}
+
+		if (grantpt(master)) {
+			PERROR("grantpt");
+			if (errno == EPERM) {
+				LOG("grantpt permission errors appear nonfatal, so carrying on\n");
 			} else {
 				err = 1;
 				goto cleanup;
@@ -1250,41 +3195,391 @@ static int set_capabilities(json_t * process)
 {
 	json_t *capabilities, *value;
 	const char *name;
+	uint64_t mask = 0;
 	size_t i;
-	int cap;
+	int cap, planned = 0;
 
 	capabilities = json_object_get(process, "capabilities");
 	if (!capabilities) {
 		return 0;
 	}
 
+	/* hooks and --socket clients bring their own processes */
+	if (process == config_process
+	    && config_plan->capability_count ==
+	    (int32_t) json_array_size(capabilities)) {
+		planned = 1;
+		mask = config_plan->capabilities;
+	}
+
 	LOG("remove all capabilities from the scratch space\n");
-	capng_clear(CAPNG_SELECT_BOTH);
+	if (!planned || verbose) {
+		json_array_foreach(capabilities, i, value) {
+			name = json_string_value(value);
+			if (!name) {
+				LOG("failed to extract process.capabilities[%d]\n", (int)i);
+				return 1;
+			}
+			if (!planned) {
+				cap = _capng_name_to_capability(name);
+				if (cap < 0 || cap >= 64) {
+					LOG("unrecognized capability name: %s\n", name);
+					return 1;
+				}
+				mask |= (uint64_t) 1 << cap;
+			}
+			LOG("restore %s capability to scratch space\n", name);
+		}
+	}
 
-	json_array_foreach(capabilities, i, value) {
-		name = json_string_value(value);
-		if (!name) {
-			LOG("failed to extract process.capabilities[%d]\n",
-			    (int)i);
+	LOG("apply specified capabilities to bounding and traditional sets\n");
+	if (apply_capabilities(mask)) {
+		LOG("failed to apply capabilities\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Drop everything outside mask from the bounding set, then set the
+ * effective, permitted, and inheritable sets with a single capset(2).
+ * The kernel has no bulk bounding-set call, so that's one prctl(2)
+ * per dropped capability, stopping at the first one the kernel
+ * doesn't have.  Drops come first, because they need CAP_SETPCAP.
+ */
+static int apply_capabilities(uint64_t mask)
+{
+	struct __user_cap_header_struct header;
+	struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+	unsigned int cap;
+	int i;
+
+	for (cap = 0; cap < 64; cap++) {
+		if (mask & ((uint64_t) 1 << cap)) {
+			continue;
+		}
+		if (prctl(PR_CAPBSET_DROP, cap, 0, 0, 0) == -1) {
+			if (errno == EINVAL) {
+				break;	/* past CAP_LAST_CAP */
+			}
+			PERROR("prctl");
 			return 1;
 		}
-		cap = _capng_name_to_capability(name);
-		if (cap < 0) {
-			LOG("unrecognized capability name: %s\n", name);
-		}
-		LOG("restore %s capability to scratch space\n", name);
-		if (capng_update
-		    (CAPNG_ADD,
-		     CAPNG_EFFECTIVE | CAPNG_PERMITTED | CAPNG_INHERITABLE |
-		     CAPNG_BOUNDING_SET, (unsigned int)cap)) {
-			LOG("failed to restore the %s capability\n", name);
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.version = _LINUX_CAPABILITY_VERSION_3;
+	memset(data, 0, sizeof(data));
+	for (i = 0; i < _LINUX_CAPABILITY_U32S_3; i++) {
+		data[i].effective = data[i].permitted = data[i].inheritable =
+		    (uint32_t) (mask >> (32 * i));
+	}
+	if (syscall(__NR_capset, &header, data) == -1) {
+		PERROR("capset");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* use the planned filter for the container process, else compile one */
+static int get_seccomp_filter(json_t * process, struct sock_filter **filter,
+			      size_t *length, int *allocated)
+{
+	*filter = NULL;
+	*length = 0;
+	*allocated = 0;
+
+	if (!json_object_get(process, "seccomp")) {
+		return 0;
+	}
+
+	if (process == config_process && config_plan->filter_length) {
+		*filter =
+		    (struct sock_filter *)(config_plan->data +
+					   config_plan->mount_count);
+		*length = (size_t) config_plan->filter_length;
+		return 0;
+	}
+
+	if (compile_seccomp(process, filter, length)) {
+		return 1;
+	}
+	*allocated = 1;
+	return 0;
+}
+
+/*
+ * Compile process.seccomp into a classic BPF program.  After
+ * checking the architecture, the program binary-searches the sorted
+ * syscall numbers with BPF_JGE, so a syscall costs a handful of
+ * comparisons however long the rule list is.  Names the native
+ * architecture doesn't have are skipped, so one profile can list
+ * syscalls for several architectures.
+ */
+static int compile_seccomp(json_t * process, struct sock_filter **filter,
+			   size_t *length)
+{
+	json_t *seccomp, *syscalls, *syscall, *names, *value;
+	const syscall_name_t *found;
+	syscall_name_t key;
+	seccomp_rule_t *rules = NULL;
+	uint32_t default_action, action;
+	size_t i, j, n = 0, count = 0, filter_size;
+	int err = 0;
+
+	*filter = NULL;
+	*length = 0;
+
+	seccomp = json_object_get(process, "seccomp");
+	if (!seccomp) {
+		return 0;
+	}
+
+#ifndef SECCOMP_AUDIT_ARCH
+	LOG("process.seccomp is not supported on this architecture\n");
+	return 1;
+#else
+	if (get_seccomp_action
+	    (seccomp, "defaultErrnoRet", "defaultAction", &default_action)) {
+		return 1;
+	}
+
+	syscalls = json_object_get(seccomp, "syscalls");
+	json_array_foreach(syscalls, i, syscall) {
+		count += json_array_size(json_object_get(syscall, "names"));
+	}
+
+	if (count) {
+		rules = calloc(count, sizeof(seccomp_rule_t));
+		if (!rules) {
+			PERROR("calloc");
 			return 1;
 		}
 	}
 
-	LOG("apply specified capabilities to bounding and traditional sets\n");
-	if (capng_apply(CAPNG_SELECT_BOTH)) {
-		LOG("failed to apply capabilities\n");
+	json_array_foreach(syscalls, i, syscall) {
+		if (get_seccomp_action(syscall, "errnoRet", "action", &action)) {
+			err = 1;
+			goto cleanup;
+		}
+		names = json_object_get(syscall, "names");
+		json_array_foreach(names, j, value) {
+			key.name = json_string_value(value);
+			if (!key.name) {
+				LOG("failed to extract process.seccomp.syscalls[%d].names[%d]\n", (int)i, (int)j);
+				err = 1;
+				goto cleanup;
+			}
+			found =
+			    bsearch(&key, syscall_names,
+				    sizeof(syscall_names) /
+				    sizeof(syscall_names[0]),
+				    sizeof(syscall_names[0]),
+				    compare_syscall_names);
+			if (!found) {
+				LOG("skip unknown syscall %s\n", key.name);
+				continue;
+			}
+			rules[n].number = found->number;
+			rules[n].index = n;
+			rules[n].action = action;
+			n++;
+		}
+	}
+
+	if (n) {
+		qsort(rules, n, sizeof(seccomp_rule_t), compare_seccomp_rules);
+		for (i = j = 1; i < n; i++) {
+			if (rules[i].number != rules[j - 1].number) {
+				rules[j++] = rules[i];
+			}
+		}
+		n = j;
+	}
+
+	/*
+	 * Six prologue instructions, and two per rule plus one per leaf.
+	 * Leaves (but the lone one) have at least two rules, and each also
+	 * accounts for at most one inner node of two more instructions.
+	 */
+	filter_size = 7 + 4 * n;
+	*filter = calloc(filter_size, sizeof(struct sock_filter));
+	if (!*filter) {
+		PERROR("calloc");
+		err = 1;
+		goto cleanup;
+	}
+
+	(*filter)[(*length)++] = (struct sock_filter)
+	    BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+		     offsetof(struct seccomp_data, arch));
+	(*filter)[(*length)++] = (struct sock_filter)
+	    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_AUDIT_ARCH, 1, 0);
+	(*filter)[(*length)++] = (struct sock_filter)
+	    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS);
+	(*filter)[(*length)++] = (struct sock_filter)
+	    BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+		     offsetof(struct seccomp_data, nr));
+#ifdef __X32_SYSCALL_BIT
+	/* x32 calls share AUDIT_ARCH_X86_64, but not our numbers */
+	(*filter)[(*length)++] = (struct sock_filter)
+	    BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, __X32_SYSCALL_BIT, 0, 1);
+	(*filter)[(*length)++] = (struct sock_filter)
+	    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS);
+#endif
+
+	if (emit_seccomp_search
+	    (*filter, length, rules, 0, n, default_action)) {
+		err = 1;
+		goto cleanup;
+	}
+
+	if (*length > BPF_MAXINSNS) {
+		LOG("process.seccomp needs %d BPF instructions (the kernel accepts %d)\n", (int)*length, BPF_MAXINSNS);
+		err = 1;
+		goto cleanup;
+	}
+
+	LOG("compiled a %d-instruction seccomp filter for %d syscalls\n",
+	    (int)*length, (int)n);
+
+ cleanup:
+	if (rules) {
+		free(rules);
+	}
+	if (err && *filter) {
+		free(*filter);
+		*filter = NULL;
+		*length = 0;
+	}
+	return err;
+#endif
+}
+
+/* translate the SCMP_ACT_* name at key into a SECCOMP_RET_* action */
+static int get_seccomp_action(json_t * object, const char *errno_key,
+			      const char *key, uint32_t * action)
+{
+	json_t *value;
+	const char *name;
+	int errno_ret = EPERM;
+
+	name = json_string_value(json_object_get(object, key));
+	if (!name) {
+		LOG("failed to extract process.seccomp %s\n", key);
+		return 1;
+	}
+
+	value = json_object_get(object, errno_key);
+	if (value) {
+		/* the kernel's MAX_ERRNO; libc doesn't read larger values as errors */
+		if (!json_is_integer(value) || json_integer_value(value) < 0
+		    || json_integer_value(value) > 4095) {
+			LOG("process.seccomp %s must be an integer from 0 to 4095\n", errno_key);
+			return 1;
+		}
+		errno_ret = (int)json_integer_value(value);
+	}
+
+	if (strcmp(name, "SCMP_ACT_ALLOW") == 0) {
+		*action = SECCOMP_RET_ALLOW;
+	} else if (strcmp(name, "SCMP_ACT_ERRNO") == 0) {
+		*action = SECCOMP_RET_ERRNO | (errno_ret & SECCOMP_RET_DATA);
+	} else if (strcmp(name, "SCMP_ACT_KILL") == 0
+		   || strcmp(name, "SCMP_ACT_KILL_THREAD") == 0) {
+		*action = SECCOMP_RET_KILL;
+	} else if (strcmp(name, "SCMP_ACT_KILL_PROCESS") == 0) {
+		*action = SECCOMP_RET_KILL_PROCESS;
+	} else if (strcmp(name, "SCMP_ACT_TRAP") == 0) {
+		*action = SECCOMP_RET_TRAP;
+	} else if (strcmp(name, "SCMP_ACT_LOG") == 0) {
+		*action = SECCOMP_RET_LOG;
+	} else {
+		LOG("unrecognized seccomp action: %s\n", name);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int compare_syscall_names(const void *a, const void *b)
+{
+	return strcmp(((const syscall_name_t *)a)->name,
+		      ((const syscall_name_t *)b)->name);
+}
+
+static int compare_seccomp_rules(const void *a, const void *b)
+{
+	const seccomp_rule_t *x = a, *y = b;
+
+	if (x->number != y->number) {
+		return x->number < y->number ? -1 : 1;
+	}
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/*
+ * Search rules[start:end] for the loaded syscall number.  Inner nodes
+ * are a BPF_JGE on the middle rule followed by a BPF_JA over the
+ * lower half, since BPF_JGE only has an 8-bit jump offset.  Leaves
+ * compare up to SECCOMP_LEAF_RULES numbers and then return the
+ * default action.
+ */
+static int emit_seccomp_search(struct sock_filter *filter, size_t *length,
+			       seccomp_rule_t * rules, size_t start, size_t end,
+			       uint32_t default_action)
+{
+	size_t i, mid, jump;
+
+	if (end - start <= SECCOMP_LEAF_RULES) {
+		for (i = start; i < end; i++) {
+			filter[(*length)++] = (struct sock_filter)
+			    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+				     (uint32_t) rules[i].number, 0, 1);
+			filter[(*length)++] = (struct sock_filter)
+			    BPF_STMT(BPF_RET | BPF_K, rules[i].action);
+		}
+		filter[(*length)++] = (struct sock_filter)
+		    BPF_STMT(BPF_RET | BPF_K, default_action);
+		return 0;
+	}
+
+	mid = start + (end - start) / 2;
+	filter[(*length)++] = (struct sock_filter)
+	    BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, (uint32_t) rules[mid].number,
+		     0, 1);
+	jump = (*length)++;
+	if (emit_seccomp_search
+	    (filter, length, rules, start, mid, default_action)) {
+		return 1;
+	}
+	filter[jump] = (struct sock_filter)
+	    BPF_JUMP(BPF_JMP | BPF_JA, (uint32_t) (*length - jump - 1), 0, 0);
+	return emit_seccomp_search(filter, length, rules, mid, end,
+				   default_action);
+}
+
+/*
+ * Install the filter just before exec.  Without CAP_SYS_ADMIN the
+ * kernel requires no_new_privs, so always set it, as other runtimes
+ * do, rather than have the filter depend on the capabilities left.
+ */
+static int install_seccomp(struct sock_filter *filter, size_t length)
+{
+	struct sock_fprog program;
+
+	program.len = (unsigned short)length;
+	program.filter = filter;
+
+	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1) {
+		PERROR("prctl");
+		return 1;
+	}
+
+	if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program) == -1) {
+		PERROR("prctl");
 		return 1;
 	}
 
@@ -1295,10 +3590,14 @@ static void exec_process(json_t * process, int console, int dup_stdin,
 			 int process_env_path, int *socket, int *exec_fd)
 {
 	char *path = NULL;
-	char **argv = NULL, **env = NULL;
+	char **argv = NULL, **env;
+	exec_strings_t strings, *exec_strings = &config_exec;
 	json_t *value;
-	size_t i;
+	struct sock_filter *filter = NULL;
+	size_t i, filter_length = 0;
+	int filter_allocated = 0;
 
+	memset(&strings, 0, sizeof(strings));
 	value = json_object_get(process, "args");
 	if (!value) {
 		LOG("args not specified, exiting\n");
@@ -1326,31 +3625,29 @@ static void exec_process(json_t * process, int console, int dup_stdin,
 		goto cleanup;
 	}
 
+	trace_event('B', "capabilities");
 	if (set_capabilities(process)) {
 		goto cleanup;
 	}
+	trace_event('E', "capabilities");
 
-	argv = json_array_of_strings_value(value);
-	if (!argv) {
-		LOG("failed to extract args\n");
+	if (get_seccomp_filter
+	    (process, &filter, &filter_length, &filter_allocated)) {
 		goto cleanup;
 	}
 
-	value = json_object_get(process, "env");
-	if (value) {
-		env = json_array_of_strings_value(value);
-		if (!env) {
-			LOG("failed to extract env\n");
+	/* hooks and --socket clients bring their own processes */
+	if (process != config_process) {
+		if (get_exec_strings(process, &strings)) {
 			goto cleanup;
 		}
+		exec_strings = &strings;
+	}
+	argv = exec_strings->argv;
+	env = exec_strings->env ? exec_strings->env : environ;
 
-		if (process_env_path) {
-			if (set_path(env)) {
-				goto cleanup;
-			}
-		}
-	} else {
-		env = environ;
+	if (process_env_path && set_path(exec_strings->path)) {
+		goto cleanup;
 	}
 
 	if (exec_fd && *exec_fd >= 0) {
@@ -1359,6 +3656,11 @@ static void exec_process(json_t * process, int console, int dup_stdin,
 			LOG(" %s", argv[i]);
 		}
 		LOG("\n");
+		log_flush();
+		/* while the log is still open to report a failure */
+		if (filter && install_seccomp(filter, filter_length)) {
+			goto cleanup;
+		}
 		if (log_fd != STDERR_FILENO) {
 			if (close(log_fd) == -1) {
 				PERROR("close log file descriptor");
@@ -1366,6 +3668,7 @@ static void exec_process(json_t * process, int console, int dup_stdin,
 			}
 			log_fd = -1;
 		}
+		trace_event('I', "execveat");
 		execveat(*exec_fd, "", argv, env, AT_EMPTY_PATH);
 		PERROR("execveat");
 		goto cleanup;
@@ -1389,6 +3692,11 @@ static void exec_process(json_t * process, int console, int dup_stdin,
 	}
 	LOG("\n");
 
+	log_flush();
+	/* while the log is still open to report a failure */
+	if (filter && install_seccomp(filter, filter_length)) {
+		goto cleanup;
+	}
 	if (log_fd != STDERR_FILENO) {
 		if (close(log_fd) == -1) {
 			PERROR("close log file descriptor");
@@ -1396,34 +3704,37 @@ static void exec_process(json_t * process, int console, int dup_stdin,
 		}
 		log_fd = -1;
 	}
+	trace_event('I', "execvpe");
 	execvpe(path, argv, env);
 	PERROR("execvpe");
 
  cleanup:
-	if (argv) {
-		for (i = 0; argv[i] != NULL; i++) {
-			free(argv[i]);
-		}
-		free(argv);
-	}
-	if (env && env != environ) {
-		for (i = 0; env[i] != NULL; i++) {
-			free(env[i]);
-		}
-		free(env);
-	}
-	if (path) {
+	if (path && path != argv[0]) {
 		free(path);
 	}
+	free_exec_strings(&strings);
+	if (filter_allocated) {
+		free(filter);
+	}
 	return;
 }
 
-static int get_namespace_fds(json_t * config, namespace_fd_t ** namespace_fds)
+/*
+ * Joined namespaces live at paths (often under /proc, sometimes on
+ * slow bind mounts), so queue an open(2) for each namespaces.*.path
+ * and start helper threads to work through the queue.  With a busy
+ * caller (still looking up process.host), every entry gets a thread;
+ * otherwise the caller takes one entry itself in
+ * collect_namespace_fds.  The helpers never LOG, so the buffered log
+ * stays single-threaded; collect_namespace_fds reports for them.
+ */
+static int start_namespace_fds(json_t * config, namespace_opens_t * prepare,
+			       int busy)
 {
 	json_t *namespaces, *value, *path;
-	const char *key, *p;
-	int i = 0;
-	int len = 0;
+	const char *key;
+	size_t n;
+	int nstype;
 
 	namespaces = json_object_get(config, "namespaces");
 	if (!namespaces) {
@@ -1436,1142 +3747,5455 @@ static int get_namespace_fds(json_t * config, namespace_fd_t ** namespace_fds)
 			continue;
 		}
 
-		if (i + 1 >= len) {
-			len += 10;
-			*namespace_fds =
-			    realloc(*namespace_fds,
-				    sizeof(namespace_fd_t) * len);
-			if (!*namespace_fds) {
-				PERROR("realloc");
+		if (get_namespace_type(key, &nstype)) {
+			return 1;
+		}
+		if (!prepare->opens) {
+			prepare->opens =
+			    calloc(json_object_size(namespaces),
+				   sizeof(namespace_open_t));
+			if (!prepare->opens) {
+				PERROR("calloc");
 				return 1;
 			}
-			memset(&(*namespace_fds)[i], 0,
-			       sizeof(namespace_fd_t) * (len - i));
-		}
-
-		p = json_string_value(path);
-		if (get_namespace_type(key, &(*namespace_fds)[i].type)) {
-			return 1;
 		}
-		LOG("open %s namespace at %s\n", key, p);
-		(*namespace_fds)[i].fd = open(p, O_RDONLY);
-		if ((*namespace_fds)[i++].fd == -1) {
-			PERROR("open");
-			return 1;
+		prepare->opens[prepare->count].key = key;
+		prepare->opens[prepare->count].path = json_string_value(path);
+		prepare->opens[prepare->count].type = nstype;
+		prepare->opens[prepare->count].fd = -1;
+		prepare->count++;
+	}
+
+	n = prepare->count;
+	if (n && !busy) {
+		n--;
+	}
+	if (n > PREPARE_THREADS) {
+		n = PREPARE_THREADS;
+	}
+	for (; prepare->n_threads < n; prepare->n_threads++) {
+		errno =
+		    pthread_create(&prepare->threads[prepare->n_threads], NULL,
+				   open_namespace_fds, prepare);
+		if (errno) {
+			PERROR("pthread_create");
+			break;	/* collect_namespace_fds opens the rest */
 		}
 	}
 
 	return 0;
 }
 
-static int run_hooks(json_t * config, const char *name, pid_t cpid)
+static void *open_namespace_fds(void *arg)
 {
-	pid_t hpid;
-	json_t *hooks, *hook_array, *hook, *terminal;
+	namespace_opens_t *prepare = (namespace_opens_t *) arg;
+	namespace_open_t *entry;
 	size_t i;
-	int sockets[2], pipe_fd[2], master = -1, err = 0;
-
-	sockets[0] = sockets[1] = -1;
-	pipe_fd[0] = pipe_fd[1] = -1;
-
-	hooks = json_object_get(config, "hooks");
-	if (!hooks) {
-		return 0;
-	}
-
-	hook_array = json_object_get(hooks, name);
-	if (!hook_array) {
-		return 0;
-	}
-
-	json_array_foreach(hook_array, i, hook) {
-		LOG("run %s hook %d\n", name, (int)i);
-
-		if (cpid) {
-			if (pipe(pipe_fd) == -1) {
-				PERROR("pipe");
-				return 1;
-			}
-
-			/* write to kernel buffer, this is less than PIPE_BUF */
-			if (dprintf(pipe_fd[1], "%d\n", cpid) < 0) {
-				PERROR("dprintf");
-				err = 1;
-				goto cleanup;
-			}
-
-			if (close(pipe_fd[1])) {
-				PERROR("close host-to-hook pipe write-end");
-				pipe_fd[1] = -1;
-				err = 1;
-				goto cleanup;
-			}
-			pipe_fd[1] = -1;
 
-			if (child_pid < 0) {
-				err = 1;
-				goto cleanup;
-			}
+	for (;;) {
+		i = __atomic_fetch_add(&prepare->next, 1, __ATOMIC_RELAXED);
+		if (i >= prepare->count) {
+			break;
 		}
-
-		LOG("create socketpair for hook\n");
-		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) == -1) {
-			PERROR("socketpair");
-			err = 1;
-			goto cleanup;
+		entry = &prepare->opens[i];
+		entry->fd = open(entry->path, O_RDONLY);
+		if (entry->fd == -1) {
+			entry->err = errno;
 		}
+	}
 
-		if (block_signals() == -1) {
-			err = 1;
-			goto cleanup;
-		}
+	return NULL;
+}
+
+/*
+ * Open any queued paths the helpers haven't claimed, join the helpers,
+ * and append the results to namespace_fds in configuration order.
+ * With a NULL namespace_fds (error cleanup), just close the results.
+ */
+static int collect_namespace_fds(namespace_opens_t * prepare,
+				 namespace_fd_t ** namespace_fds)
+{
+	namespace_open_t *entry;
+	size_t i;
+	int err = 0;
 
-		hpid = fork();
-		if (hpid == -1) {
-			PERROR("fork");
+	(void)open_namespace_fds(prepare);
+	for (i = 0; i < prepare->n_threads; i++) {
+		errno = pthread_join(prepare->threads[i], NULL);
+		if (errno) {
+			PERROR("pthread_join");
 			err = 1;
-			goto cleanup;
 		}
+	}
+	prepare->n_threads = 0;
 
-		if (hpid == 0) {	/* child */
-			if (prctl(PR_SET_PDEATHSIG, SIGKILL)) {
-				PERROR("prctl");
-				err = 1;
-				goto cleanup;
-			}
-
-			if (uninstall_signal_handlers() || unblock_signals()) {
+	for (i = 0; i < prepare->count; i++) {
+		entry = &prepare->opens[i];
+		if (namespace_fds && !err) {
+			LOG("open %s namespace at %s\n", entry->key,
+			    entry->path);
+			if (entry->fd == -1) {
+				errno = entry->err;
+				PERROR("open");
 				err = 1;
-				goto cleanup;
-			}
-
-			if (close(sockets[0])) {
-				PERROR
-				    ("close host side of socket pair after fork");
-				sockets[0] = -1;
+			} else if (add_namespace_fd
+				   (namespace_fds, entry->type, entry->fd)) {
 				err = 1;
-				goto cleanup;
-			}
-			sockets[0] = -1;
-
-			if (cpid) {
-				if (dup2(pipe_fd[0], STDIN_FILENO) == -1) {
-					PERROR("dup2");
-					err = 1;
-					goto cleanup;
-				}
-				if (close(pipe_fd[0])) {
-					PERROR
-					    ("close host-to-hook pipe read-end after stdin dup");
-					pipe_fd[0] = -1;
-					err = 1;
-					goto cleanup;
-				}
-				pipe_fd[0] = -1;
+			} else {
+				continue;	/* namespace_fds owns it now */
 			}
-
-			exec_process(hook, 0, cpid == 0, 0, &sockets[1], NULL);
-			err = 1;
-			goto cleanup;
-		}
-
-		hook_pid = hpid;
-		LOG("launched hook %d with PID %d\n", (int)i, hpid);
-
-		if (unblock_signals() == -1) {
-			err = 1;
-			goto cleanup;
-		}
-
-		if (close(sockets[1])) {
-			PERROR("close hook side of socket pair after fork");
-			sockets[1] = -1;
-			err = 1;
-			goto cleanup;
-		}
-		sockets[1] = -1;
-
-		if (cpid && close_pipe(pipe_fd)) {
-			err = 1;
-			goto cleanup;
 		}
-
-		terminal = json_object_get(hook, "terminal");
-		if (json_boolean_value(terminal)) {
-			if (recvfd(sockets[0], &master)) {
+		if (entry->fd >= 0) {
+			if (close(entry->fd) == -1) {
+				PERROR("close namespace file descriptor");
 				err = 1;
-				goto cleanup;
 			}
 		}
+	}
 
-		if (master >= 0) {
-			if (splice_pseudoterminal_master(&master, NULL)) {
-				err = 1;
-				goto cleanup;
-			}
-		}
+	free(prepare->opens);
+	prepare->opens = NULL;
+	prepare->count = prepare->next = 0;
+	return err;
+}
 
-		if (master >= 0) {
-			if (close(master)) {
-				PERROR("close pseudoterminal master");
-				master = -1;
-				err = 1;
-				goto cleanup;
-			}
-			master = -1;
-		}
+/* append to a namespace_fds array, keeping its type == 0 terminator */
+static int add_namespace_fd(namespace_fd_t ** namespace_fds, int type, int fd)
+{
+	namespace_fd_t *fds;
+	size_t i = 0;
 
-		err = _wait(hpid, "hook");
-		hook_pid = -1;
-		if (cpid && err) {
-			err = 1;	/* abort failed post-create execution */
-			goto cleanup;
-		} else {
-			err = 0;	/* ignore failed post-stop execution */
+	if (*namespace_fds) {
+		for (; (*namespace_fds)[i].type; i++) {
+			;
 		}
 	}
 
- cleanup:
-	if (close_pipe(sockets)) {
-		err = 1;
-	}
-	if (close_pipe(pipe_fd)) {
-		err = 1;
-	}
-	if (master >= 0) {
-		if (close(master)) {
-			PERROR("close pseudoterminal master");
-			err = 1;
-		}
+	fds = realloc(*namespace_fds, sizeof(namespace_fd_t) * (i + 2));
+	if (!fds) {
+		PERROR("realloc");
+		return 1;
 	}
+	fds[i].type = type;
+	fds[i].fd = fd;
+	fds[i + 1].type = 0;
+	fds[i + 1].fd = -1;
+	*namespace_fds = fds;
 
-	return err;
+	return 0;
 }
 
-static int setup_socket(const char *path, int *container_socket)
+/*
+ * Ask the --pool supervisor listening on path for a parked
+ * container's namespaces, and add them to namespace_fds for
+ * join_namespaces.  Borrowed namespaces replace the matching new
+ * namespaces in *flags.
+ */
+static int borrow_namespaces(const char *path, namespace_fd_t ** namespace_fds,
+			     int *flags)
 {
-	char buf[MESSAGE_SIZE];
-	struct iovec iov = { buf, MESSAGE_SIZE };
+	char buf[CLIENT_MESSAGE_SIZE];
+	struct iovec iov;
 	struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
-	struct sockaddr_un name;
-	size_t len;
+	char *name, *saveptr = NULL;
 	ssize_t n;
-	int connection_socket = -1, err = 0;
-
-	connection_socket = socket(AF_UNIX, SOCK_SEQPACKET, 0);
-	if (connection_socket == -1) {
-		PERROR("socket");
-		err = 1;
-		goto cleanup;
-	}
+	int sock, fd = -1, nstype, i, err = 0;
 
-	memset(&name, 0, sizeof(struct sockaddr_un));
-	name.sun_family = AF_UNIX;
-	strncpy(name.sun_path, path, sizeof(name.sun_path) - 1);
-	LOG("bind connection socket to %s\n", path);
-	if (bind
-	    (connection_socket, (const struct sockaddr *)&name,
-	     sizeof(struct sockaddr_un)) == -1) {
-		PERROR("bind");
-		err = 1;
-		goto cleanup;
+	LOG("request namespaces from %s\n", path);
+	sock = connect_socket(path);
+	if (sock == -1) {
+		return 1;
 	}
 
-	iov.iov_base = (void *)CONNECTION_SOCKET;
+	iov.iov_base = (void *)NAMESPACE_REQUEST;
 	iov.iov_len = strlen(iov.iov_base);
-	if (sendmsg(*container_socket, &msg, 0) == -1) {
+	n = sendmsg(sock, &msg, 0);
+	if (n == -1) {
 		PERROR("sendmsg");
 		err = 1;
 		goto cleanup;
-	}
-
-	if (sendfd(*container_socket, &connection_socket, 1)) {
+	} else if ((size_t) n != iov.iov_len) {
+		LOG("did not send the expected number of bytes: %d != %d\n",
+		    (int)n, (int)iov.iov_len);
 		err = 1;
 		goto cleanup;
 	}
 
-	iov.iov_base = (char *)buf;
-	iov.iov_len = MESSAGE_SIZE;
-	n = recvmsg(*container_socket, &msg, 0);
+	/* a null byte and the lent namespaces, or an error message */
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf) - 1;
+	n = recvmsg(sock, &msg, 0);
 	if (n == -1) {
 		PERROR("recvmsg");
 		err = 1;
 		goto cleanup;
 	}
-	len = strlen(EXEC_PROCESS);
-	if (len != (size_t) n || strncmp(EXEC_PROCESS, iov.iov_base, len) != 0) {
-		LOG("unexpected message from container (%d): %.*s\n", (int)n,
-		    (int)n, (char *)iov.iov_base);
+	if (n == 0 || buf[0] != '\0') {
+		LOG("namespace pool %s failed: %.*s\n", path, (int)n, buf);
 		err = 1;
+		goto cleanup;
+	}
+	buf[n] = '\0';
+
+	/* one file descriptor message follows for each name */
+	for (name = strtok_r(buf + 1, " ", &saveptr); name;
+	     name = strtok_r(NULL, " ", &saveptr)) {
+		if (get_namespace_type(name, &nstype)) {
+			err = 1;
+			goto cleanup;
+		}
+		for (i = 0; *namespace_fds && (*namespace_fds)[i].type; i++) {
+			if ((*namespace_fds)[i].type == nstype) {
+				LOG("namespaces.%s.path conflicts with --namespace-pool\n", name);
+				err = 1;
+				goto cleanup;
+			}
+		}
+		if (recvfd(sock, &fd) == -1) {
+			err = 1;
+			goto cleanup;
+		}
+		LOG("borrow %s namespace from %s\n", name, path);
+		if (add_namespace_fd(namespace_fds, nstype, fd)) {
+			err = 1;
+			goto cleanup;
+		}
+		fd = -1;
+		*flags &= ~nstype;
 	}
 
  cleanup:
-	if (connection_socket >= 0) {
-		if (close(connection_socket) == -1) {
-			PERROR("close connection socket");
+	if (fd >= 0) {
+		if (close(fd) == -1) {
+			PERROR("close namespace file descriptor");
 			err = 1;
 		}
 	}
-	LOG("unlink connection socket at %s\n", path);
-	if (unlink(path) == -1) {
-		PERROR("unlink");
-		return 1;
+	if (close(sock) == -1) {
+		PERROR("close namespace pool socket");
+		err = 1;
 	}
 	return err;
 }
 
-static int serve_socket(json_t * process, int console, int *socket)
+static int run_hooks(json_t * config, const char *name, pid_t cpid)
 {
-	char buf[CLIENT_MESSAGE_SIZE];
-	struct iovec iov = { buf, CLIENT_MESSAGE_SIZE };
-	struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
-	json_t *host;
-	json_error_t error;
-	ssize_t n;
-	int connection_socket = -1, data_socket = -1, exec_fd = -1,
-	    err = 0, size;
+	json_t *hooks, *hook_array;
+	struct timespec deadline, now;
+	double timeout;
+	size_t i, end;
+	int err = 0;
 
-	if (recvfd(*socket, &connection_socket) == -1) {
+	hooks = json_object_get(config, "hooks");
+	if (!hooks) {
+		return 0;
+	}
+
+	hook_array = json_object_get(hooks, name);
+	if (!hook_array) {
+		return 0;
+	}
+
+	/* hooks.timeout bounds all of this event's hooks together */
+	if (get_timeout(hooks, NULL, -1, &timeout)) {
 		return 1;
 	}
-	LOG("listen on %d\n", connection_socket);
-	if (listen(connection_socket, 5) == -1) {
-		PERROR("listen");
-		err = 1;
-		goto cleanup;
+	if (timeout > 0) {
+		(void)clock_gettime(CLOCK_MONOTONIC, &deadline);
+		add_seconds(&deadline, timeout);
 	}
 
-	while (1) {
-		data_socket = accept(connection_socket, NULL, NULL);
-		if (data_socket == -1) {
-			PERROR("accept");
-			err = 1;
-			goto cleanup;
+	for (i = 0; i < json_array_size(hook_array); i = end) {
+		if (get_hook_batch(hook_array, name, i, &end)) {
+			return 1;
 		}
-		LOG("accepted connection on %d\n", data_socket);
 
-		while (1) {
-			n = recvmsg(data_socket, &msg, 0);
-			if (n == -1) {
-				perror("recvmsg");
-				err = 1;
-				goto cleanup;
-			} else if (n == 0) {
-				LOG("lost connection on %d\n", data_socket);
-				if (close(data_socket) == -1) {
-					PERROR("close data socket");
-					err = 1;
-					data_socket = -1;
-					goto cleanup;
-				}
-				data_socket = -1;
-				break;
+		if (cpid && child_pid < 0) {
+			return 1;
+		}
+
+		if (timeout > 0) {
+			(void)clock_gettime(CLOCK_MONOTONIC, &now);
+			if (!timespec_before(&now, &deadline)) {
+				LOG("hooks.timeout expired before %s hook %d\n",
+				    name, (int)i);
+				return 1;
 			}
+		}
 
-			LOG("received start request (%d): %.*s\n", (int)n,
-			    (int)n, (char *)iov.iov_base);
-			if (n == 1 && ((char *)iov.iov_base)[0] != '\0') {
-				LOG("unexpected message from client (%d): %.*s\n", (int)n, (int)n, (char *)iov.iov_base);
-				err = 1;
-				iov.iov_base =
-				    (void *)"unexpected length-one message";
-				iov.iov_len = strlen((char *)iov.iov_base);
-				n = sendmsg(data_socket, &msg, 0);
-				if (n == -1) {
-					PERROR("sendmsg");
-				} else if ((size_t) n != iov.iov_len) {
-					LOG("did not send the expected number of bytes: %d != %d\n", (int)n, (int)iov.iov_len);
-				}
-				goto cleanup;
-			} else if (n > 1) {
-				process =
-				    json_loads(iov.iov_base,
-					       JSON_REJECT_DUPLICATES, &error);
-				if (!process) {
-					err = 1;
-					size =
-					    snprintf((char *)buf,
-						     CLIENT_MESSAGE_SIZE,
-						     "error on process message %d:%d: %s\n",
-						     error.line, error.column,
-						     error.text);
-					if (size < 0) {
-						LOG("failed to format process JSON error\n");
-					} else {
-						LOG("%s\n", buf);
-						iov.iov_base = (void *)buf;
-						iov.iov_len = strlen(buf) - 1;	/* -1 to remove trailing \n */
-						n = sendmsg(data_socket,
-							    &msg, 0);
-						if (n == -1) {
-							PERROR("sendmsg");
-						} else if ((size_t) n !=
-							   iov.iov_len) {
-							LOG("did not send the expected number of bytes: %d != %d\n", (int)n, (int)iov.iov_len);
-						}
-					}
-					goto cleanup;
-				}
-				host = json_object_get(process, "host");
-				if (host && json_boolean_value(host)) {
-					if (recvfd(data_socket, &exec_fd) == -1) {
-						err = 1;
-						LOG("failed to receive executable file descriptor\n");
-						iov.iov_base = (void *)
-						    "failed to receive executable file descriptor";
-						iov.iov_len =
-						    strlen(iov.iov_base);
-						n = sendmsg(data_socket,
-							    &msg, 0);
-						if (n == -1) {
-							PERROR("sendmsg");
-						} else if ((size_t) n !=
-							   iov.iov_len) {
-							LOG("did not send the expected number of bytes: %d != %d\n", (int)n, (int)iov.iov_len);
-						}
-						goto cleanup;
-					}
-				}
+		if (run_hook_batch
+		    (hook_array, name, cpid, i, end,
+		     timeout > 0 ? &deadline : NULL)) {
+			err = 1;
+			if (cpid) {
+				break;	/* abort failed post-create execution */
 			}
+		}
+	}
 
-			iov.iov_base = "\0";
-			iov.iov_len = 1;
-			n = sendmsg(data_socket, &msg, 0);
-			if (n == -1) {
-				PERROR("sendmsg");
-				err = 1;
-				goto cleanup;
-			} else if ((size_t) n != iov.iov_len) {
-				LOG("did not send the expected number of bytes: %d != %d\n", (int)n, (int)iov.iov_len);
-				err = 1;
-				goto cleanup;
-			}
-
-			if (close(data_socket) == -1) {
-				PERROR("close data socket");
-				err = 1;
-				data_socket = -1;
-				goto cleanup;
-			}
-			data_socket = -1;
-			if (close(connection_socket) == -1) {
-				PERROR("close connection socket");
-				err = 1;
-				connection_socket = -1;
-				goto cleanup;
-			}
-			connection_socket = -1;
+	return err;
+}
 
-			iov.iov_base = (void *)EXEC_PROCESS;
-			iov.iov_len = strlen(iov.iov_base);
-			n = sendmsg(*socket, &msg, 0);
-			if (n == -1) {
-				PERROR("sendmsg");
-				err = 1;
-				goto cleanup;
-			} else if ((size_t) n != iov.iov_len) {
-				LOG("did not send the expected number of bytes: %d != %d\n", (int)n, (int)iov.iov_len);
-				err = 1;
-				goto cleanup;
-			}
+/*
+ * Adjacent hooks with the same group run concurrently, so set *end
+ * to the index after the last hook in start's batch.
+ */
+static int get_hook_batch(json_t * hook_array, const char *name, size_t start,
+			  size_t * end)
+{
+	json_t *hook, *group, *value;
+	const char *group_name = NULL, *other;
+	size_t i;
 
-			exec_process(process, console, 1, 1, socket, &exec_fd);
-			err = 1;
-			goto cleanup;
+	hook = json_array_get(hook_array, start);
+	group = json_object_get(hook, "group");
+	if (group) {
+		group_name = json_string_value(group);
+		if (!group_name) {
+			LOG("hooks.%s[%d].group is not a string\n", name,
+			    (int)start);
+			return 1;
 		}
 	}
 
- cleanup:
-	if (exec_fd >= 0) {
-		if (close(exec_fd) == -1) {
-			PERROR("close container-process executable");
-			err = 1;
-		}
-	}
-	if (connection_socket >= 0) {
-		if (close(connection_socket) == -1) {
-			PERROR("close connection socket");
-			err = 1;
-		}
-	}
-	if (data_socket >= 0) {
-		if (close(data_socket) == -1) {
-			PERROR("close data socket");
-			err = 1;
+	for (i = start + 1;
+	     group_name && i < json_array_size(hook_array)
+	     && i - start < HOOK_BATCH_SIZE; i++) {
+		value = json_object_get(json_array_get(hook_array, i), "group");
+		other = json_string_value(value);
+		if (!other || strcmp(group_name, other) != 0) {
+			break;
 		}
 	}
-	return err;
-}
-
-static int get_namespace_type(const char *name, int *nstype)
-{
-	if (strncmp("mount", name, strlen("mount") + 1) == 0) {
-		*nstype = CLONE_NEWNS;
-	} else if (strncmp("cgroup", name, strlen("cgroup") + 1) == 0) {
-		*nstype = CLONE_NEWCGROUP;
-	} else if (strncmp("uts", name, strlen("uts") + 1) == 0) {
-		*nstype = CLONE_NEWUTS;
-	} else if (strncmp("ipc", name, strlen("ipc") + 1) == 0) {
-		*nstype = CLONE_NEWIPC;
-	} else if (strncmp("net", name, strlen("net") + 1) == 0) {
-		*nstype = CLONE_NEWNET;
-	} else if (strncmp("pid", name, strlen("pid") + 1) == 0) {
-		*nstype = CLONE_NEWPID;
-	} else if (strncmp("user", name, strlen("user") + 1) == 0) {
-		*nstype = CLONE_NEWUSER;
-	} else {
-		LOG("unrecognized namespace '%s'\n", name);
-		return 1;
-	}
-
-	return 0;
-}
-
-static int get_clone_flags(json_t * config, int *flags)
-{
-	json_t *namespace, *value, *path;
-	const char *key;
-	int nstype;
+	*end = i;
 
-	namespace = json_object_get(config, "namespaces");
-	if (!namespace) {
+	if (*end - start == 1) {
 		return 0;
 	}
 
-	json_object_foreach(namespace, key, value) {
-		path = json_object_get(value, "path");
-		if (path) {
-			continue;
-		}
-		if (get_namespace_type(key, &nstype)) {
+	for (i = start; i < *end; i++) {
+		hook = json_array_get(hook_array, i);
+		if (json_boolean_value(json_object_get(hook, "terminal"))) {
+			LOG("hooks.%s[%d] sets terminal, so it cannot share group %s\n", name, (int)i, group_name);
 			return 1;
 		}
-		*flags |= nstype;
 	}
 
 	return 0;
 }
 
-static int join_namespaces(json_t * config, namespace_fd_t ** namespace_fds)
+static int run_hook_batch(json_t * hook_array, const char *name, pid_t cpid,
+			  size_t start, size_t end,
+			  const struct timespec *deadline)
 {
-	json_t *namespaces, *value;
-	const char *key;
+	hook_process_t hook_processes[HOOK_BATCH_SIZE];
+	size_t i, n = 0;
+	int err = 0;
 
-	namespaces = json_object_get(config, "namespaces");
-	if (!namespaces) {
-		return 0;
+	for (i = start; i < end; i++) {
+		hook_processes[n].index = (int)i;
+		err = launch_hook(json_array_get(hook_array, i), name, cpid,
+				  &hook_processes[n], n, deadline);
+		if (hook_processes[n].pid > 0) {
+			n++;
+		}
+		if (err) {
+			break;
+		}
 	}
 
-	value = json_object_get(namespaces, "user");
-	if (value) {
-		if (join_namespace("user", value, namespace_fds)) {
-			return 1;
+	if (err && cpid) {
+		for (i = 0; i < n; i++) {
+			if (kill(hook_processes[i].pid, SIGKILL)) {
+				PERROR("kill");
+			}
 		}
 	}
 
-	json_object_foreach(namespaces, key, value) {
-		if (strncmp("user", key, strlen("user") + 1) == 0) {
-			continue;	/* already handled */
-		}
-		if (join_namespace(key, value, namespace_fds)) {
-			return 1;
-		}
+	if (wait_hooks(hook_processes, n, name, cpid)) {
+		err = 1;
 	}
 
-	return 0;
+	return err;
 }
 
-static int join_namespace(const char *name, json_t * namespace,
-			  namespace_fd_t ** namespace_fds)
+static int launch_hook(json_t * hook, const char *name, pid_t cpid,
+		       hook_process_t * hook_process, size_t slot,
+		       const struct timespec *deadline)
 {
-	json_t *path;
-	int nstype, i;
+	pid_t hpid;
+	json_t *terminal;
+	double timeout;
+	int sockets[2], pipe_fd[2], master = -1, err = 0;
 
-	path = json_object_get(namespace, "path");
-	if (!path) {
-		return 0;
-	}
-	if (get_namespace_type(name, &nstype)) {
-		return 1;
-	}
-	for (i = 0;
-	     (*namespace_fds)[i].type != nstype && (*namespace_fds)[i].type > 0;
-	     i++) {
-		;
-	}
-	if ((*namespace_fds)[i].type != nstype) {
-		LOG("no namespace file descriptor found for %s", name);
-		return 1;
-	}
-	LOG("join %s namespace\n", name);
-	if (setns((*namespace_fds)[i].fd, nstype) == -1) {
-		PERROR("setns");
-		return 1;
-	}
-	if (close((*namespace_fds)[i].fd) == -1) {
-		PERROR("close");
-		(*namespace_fds)[i].fd = -1;
+	sockets[0] = sockets[1] = -1;
+	pipe_fd[0] = pipe_fd[1] = -1;
+	hook_process->pid = -1;
+	hook_process->has_deadline = 0;
+	hook_process->timed_out = 0;
+
+	LOG("run %s hook %d\n", name, hook_process->index);
+
+	if (get_timeout(hook, name, hook_process->index, &timeout)) {
 		return 1;
 	}
-	(*namespace_fds)[i].fd = -1;
 
-	return 0;
-}
+	if (cpid) {
+		if (pipe(pipe_fd) == -1) {
+			PERROR("pipe");
+			return 1;
+		}
 
-static int set_user_namespace_mappings(json_t * config, pid_t cpid)
-{
-	json_t *namespaces, *user;
+		/* write to kernel buffer, this is less than PIPE_BUF */
+		if (dprintf(pipe_fd[1], "%d\n", cpid) < 0) {
+			PERROR("dprintf");
+			err = 1;
+			goto cleanup;
+		}
 
-	namespaces = json_object_get(config, "namespaces");
-	if (!namespaces) {
-		return 0;
+		if (close(pipe_fd[1])) {
+			PERROR("close host-to-hook pipe write-end");
+			pipe_fd[1] = -1;
+			err = 1;
+			goto cleanup;
+		}
+		pipe_fd[1] = -1;
 	}
 
-	user = json_object_get(namespaces, "user");
-	if (!user) {
-		return 0;
+	LOG("create socketpair for hook\n");
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) == -1) {
+		PERROR("socketpair");
+		err = 1;
+		goto cleanup;
 	}
 
-	if (set_user_map(user, cpid, "uidMappings", "uid_map")) {
-		return 1;
+	if (block_signals() == -1) {
+		err = 1;
+		goto cleanup;
 	}
 
-	if (set_user_setgroups(user, cpid)) {
-		return 1;
+	trace_event('B', "%s hook %d", name, hook_process->index);
+	(void)clock_gettime(CLOCK_MONOTONIC, &hook_process->start);
+	if (timeout > 0) {
+		hook_process->deadline = hook_process->start;
+		add_seconds(&hook_process->deadline, timeout);
+		hook_process->has_deadline = 1;
 	}
-
-	if (set_user_map(user, cpid, "gidMappings", "gid_map")) {
-		return 1;
+	if (deadline
+	    && (!hook_process->has_deadline
+		|| timespec_before(deadline, &hook_process->deadline))) {
+		hook_process->deadline = *deadline;
+		hook_process->has_deadline = 1;
+	}
+	hpid = fork();
+	if (hpid == -1) {
+		PERROR("fork");
+		(void)unblock_signals();
+		err = 1;
+		goto cleanup;
 	}
 
-	return 0;
-}
+	if (hpid == 0) {	/* child */
+		trace_process = "hook";
+		if (prctl(PR_SET_PDEATHSIG, SIGKILL)) {
+			PERROR("prctl");
+			_exit(1);
+		}
 
-static int set_user_map(json_t * user, pid_t cpid, const char *key,
-			const char *filename)
-{
-	json_t *mappings, *mapping, *value;
-	char path[MAX_PATH];
-	size_t i;
-	uid_t host, container;
-	int err = 0, fd = -1, size;
+		if (uninstall_signal_handlers() || unblock_signals()) {
+			_exit(1);
+		}
 
-	mappings = json_object_get(user, key);
-	if (!mappings) {
-		return 0;
-	}
+		if (close(sockets[0])) {
+			PERROR("close host side of socket pair after fork");
+			_exit(1);
+		}
+		sockets[0] = -1;
 
-	size =
-	    snprintf(path, MAX_PATH, "/proc/%lu/%s", (unsigned long int)cpid,
-		     filename);
-	if (size < 0) {
-		LOG("failed to format /proc/%lu/%s\n", (unsigned long int)cpid,
-		    filename);
-		return 1;
-	}
-	if (size >= MAX_PATH) {
-		LOG("failed to format /proc/%lu/%s (needed a buffer with %d bytes)\n", (unsigned long int)cpid, filename, size);
-		return 1;
-	}
+		if (cpid) {
+			if (dup2(pipe_fd[0], STDIN_FILENO) == -1) {
+				PERROR("dup2");
+				_exit(1);
+			}
+			if (close(pipe_fd[0])) {
+				PERROR
+				    ("close host-to-hook pipe read-end after stdin dup");
+				_exit(1);
+			}
+			pipe_fd[0] = -1;
+		}
 
-	if (child_pid < 0) {
-		return 1;
+		exec_process(hook, 0, cpid == 0, 0, &sockets[1], NULL);
+		_exit(1);
 	}
 
-	fd = open(path, O_WRONLY);
-	if (fd == -1) {
-		PERROR("open");
-		return 1;
+	hook_process->pid = hook_pids[slot] = hpid;
+	LOG("launched hook %d with PID %d\n", hook_process->index, hpid);
+
+	if (unblock_signals() == -1) {
+		err = 1;
+		goto cleanup;
 	}
 
-	json_array_foreach(mappings, i, mapping) {
-		value = json_object_get(mapping, "containerID");
-		if (!value) {
-			LOG("failed to get namespaces.user.%s[%d].containerID\n", key, (int)i);
-			err = 1;
-			goto cleanup;
-		}
-		container = (uid_t) json_integer_value(value);
+	if (close(sockets[1])) {
+		PERROR("close hook side of socket pair after fork");
+		sockets[1] = -1;
+		err = 1;
+		goto cleanup;
+	}
+	sockets[1] = -1;
 
-		value = json_object_get(mapping, "hostID");
-		if (!value) {
-			LOG("failed to get namespaces.user.%s[%d].hostID\n",
-			    key, (int)i);
-			err = 1;
-			goto cleanup;
-		}
-		host = (uid_t) json_integer_value(value);
+	if (cpid && close_pipe(pipe_fd)) {
+		err = 1;
+		goto cleanup;
+	}
 
-		value = json_object_get(mapping, "size");
-		if (!value) {
-			LOG("failed to get namespaces.user.%s[%d].size\n", key,
-			    (int)i);
+	/* terminal hooks are never grouped, so relay now */
+	terminal = json_object_get(hook, "terminal");
+	if (json_boolean_value(terminal)) {
+		if (recvfd(sockets[0], &master)) {
 			err = 1;
 			goto cleanup;
 		}
-		size = (int)json_integer_value(value);
 
-		LOG("write '%u %u %d' to %s\n",
-		    (unsigned int)container, (unsigned int)host, size, path);
-		if (dprintf
-		    (fd, "%u %u %d\n", (unsigned int)container,
-		     (unsigned int)host, size) < 0) {
-			LOG("failed to write '%u %u %d' to %s\n",
-			    (unsigned int)container, (unsigned int)host,
-			    size, path);
+		if (splice_pseudoterminal_master(&master, NULL)) {
 			err = 1;
 			goto cleanup;
 		}
 	}
 
  cleanup:
-	if (fd >= 0) {
-		if (close(fd) == -1) {
-			PERROR("close");
+	if (close_pipe(sockets)) {
+		err = 1;
+	}
+	if (close_pipe(pipe_fd)) {
+		err = 1;
+	}
+	if (master >= 0) {
+		if (close(master)) {
+			PERROR("close pseudoterminal master");
 			err = 1;
 		}
 	}
+
 	return err;
 }
 
-static int set_user_setgroups(json_t * user, pid_t cpid)
+/*
+ * Reap every launched hook, whatever order they exit in.  SIGCHLD
+ * stays blocked between the WNOHANG sweeps and is only unblocked
+ * inside ppoll(2), so an exit can't slip in before we sleep.
+ */
+static int wait_hooks(hook_process_t * hook_processes, size_t n,
+		      const char *name, pid_t cpid)
 {
-	json_t *setgroups;
-	const char *value;
-	char path[MAX_PATH];
-	int err = 0, fd = -1, size;
-
-	setgroups = json_object_get(user, "setgroups");
-	if (!setgroups) {
-		return 0;
-	}
+	sigset_t mask, orig_mask, wait_mask;
+	siginfo_t siginfo;
+	struct timespec now, next = { 0, 0 }, timeout;
+	size_t i, j, running = n;
+	int err = 0, status, have_next;
 
-	if (json_boolean_value(setgroups)) {
-		value = "allow";
-	} else {
-		value = "deny";
+	if (sigemptyset(&mask) == -1) {
+		PERROR("sigemptyset");
+		return 1;
+	}
+	if (sigaddset(&mask, SIGCHLD) == -1) {
+		PERROR("sigaddset");
+		return 1;
+	}
+	if (sigprocmask(SIG_BLOCK, &mask, &orig_mask) == -1) {
+		PERROR("sigprocmask");
+		return 1;
+	}
+	wait_mask = orig_mask;
+	if (sigdelset(&wait_mask, SIGCHLD) == -1) {
+		PERROR("sigdelset");
+		(void)sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+		return 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (hook_processes[i].pid < 0) {
+			running--;
+		}
+	}
+
+	while (running) {
+		for (i = 0; i < n; i++) {
+			if (hook_processes[i].pid < 0) {
+				continue;
+			}
+			siginfo.si_pid = 0;
+			if (waitid
+			    (P_PID, hook_processes[i].pid, &siginfo,
+			     WEXITED | WNOHANG) == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				PERROR("waitid");
+				status = 1;
+			} else if (siginfo.si_pid == 0) {
+				continue;	/* still running */
+			} else {
+				status =
+				    wait_status(hook_processes[i].pid, "hook",
+						&siginfo);
+			}
+			trace_event('E', "%s hook %d", name,
+				    hook_processes[i].index);
+			(void)clock_gettime(CLOCK_MONOTONIC, &now);
+			LOG("%s hook %d finished after %ld ms\n", name,
+			    hook_processes[i].index,
+			    elapsed_ms(&hook_processes[i].start, &now));
+			hook_processes[i].pid = hook_pids[i] = -1;
+			running--;
+			if (status && cpid && !err) {
+				err = 1;	/* kill the rest of a failed post-create batch */
+				for (j = 0; j < n; j++) {
+					if (hook_processes[j].pid > 0) {
+						if (kill
+						    (hook_processes[j].pid,
+						     SIGKILL)) {
+							PERROR("kill");
+						}
+					}
+				}
+			}
+		}
+
+		if (!running) {
+			break;
+		}
+
+		/* kill overdue hooks and sleep until the next deadline */
+		(void)clock_gettime(CLOCK_MONOTONIC, &now);
+		have_next = 0;
+		for (i = 0; i < n; i++) {
+			if (hook_processes[i].pid < 0
+			    || !hook_processes[i].has_deadline
+			    || hook_processes[i].timed_out) {
+				continue;
+			}
+			if (!timespec_before(&now, &hook_processes[i].deadline)) {
+				LOG("%s hook %d timed out after %ld ms\n",
+				    name, hook_processes[i].index,
+				    elapsed_ms(&hook_processes[i].start, &now));
+				hook_processes[i].timed_out = 1;
+				if (kill(hook_processes[i].pid, SIGKILL)) {
+					PERROR("kill");
+				}
+				continue;
+			}
+			if (!have_next
+			    || timespec_before(&hook_processes[i].deadline,
+					       &next)) {
+				next = hook_processes[i].deadline;
+				have_next = 1;
+			}
+		}
+		if (have_next) {
+			timeout.tv_sec = next.tv_sec - now.tv_sec;
+			timeout.tv_nsec = next.tv_nsec - now.tv_nsec;
+			if (timeout.tv_nsec < 0) {
+				timeout.tv_sec--;
+				timeout.tv_nsec += 1000000000;
+			}
+		}
+
+		if (ppoll(NULL, 0, have_next ? &timeout : NULL, &wait_mask) ==
+		    -1 && errno != EINTR) {
+			PERROR("ppoll");
+			err = 1;
+			break;
+		}
+	}
+
+	if (sigprocmask(SIG_SETMASK, &orig_mask, NULL) == -1) {
+		PERROR("sigprocmask");
+		err = 1;
+	}
+
+	return err;
+}
+
+/* get a positive timeout (in seconds) from object, or 0 if unset */
+static int get_timeout(json_t * object, const char *name, int index,
+		       double *seconds)
+{
+	json_t *value;
+
+	*seconds = 0;
+	value = json_object_get(object, "timeout");
+	if (!value) {
+		return 0;
+	}
+
+	if (!json_is_number(value) || json_number_value(value) <= 0) {
+		if (name) {
+			LOG("hooks.%s[%d].timeout is not a positive number\n",
+			    name, index);
+		} else {
+			LOG("hooks.timeout is not a positive number\n");
+		}
+		return 1;
+	}
+
+	*seconds = json_number_value(value);
+	return 0;
+}
+
+static void add_seconds(struct timespec *time, double seconds)
+{
+	time_t whole = (time_t) seconds;
+
+	time->tv_sec += whole;
+	time->tv_nsec += (long)((seconds - whole) * 1000000000);
+	if (time->tv_nsec >= 1000000000) {
+		time->tv_sec++;
+		time->tv_nsec -= 1000000000;
+	}
+	return;
+}
+
+static int timespec_before(const struct timespec *a,
+			   const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec
+	    || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static long elapsed_ms(const struct timespec *start,
+		       const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000 +
+	    (end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int setup_socket(const char *path, int *container_socket)
+{
+	char buf[MESSAGE_SIZE];
+	struct iovec iov = { buf, MESSAGE_SIZE };
+	struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
+	size_t len;
+	ssize_t n;
+	int connection_socket = -1, err = 0;
+
+	connection_socket = bind_socket(path);
+	if (connection_socket == -1) {
+		err = 1;
+		goto cleanup;
+	}
+
+	iov.iov_base = (void *)CONNECTION_SOCKET;
+	iov.iov_len = strlen(iov.iov_base);
+	if (sendmsg(*container_socket, &msg, 0) == -1) {
+		PERROR("sendmsg");
+		err = 1;
+		goto cleanup;
+	}
+
+	if (sendfd(*container_socket, &connection_socket, 1)) {
+		err = 1;
+		goto cleanup;
+	}
+
+	iov.iov_base = (char *)buf;
+	iov.iov_len = MESSAGE_SIZE;
+	n = recvmsg(*container_socket, &msg, 0);
+	if (n == -1) {
+		PERROR("recvmsg");
+		err = 1;
+		goto cleanup;
+	}
+	len = strlen(EXEC_PROCESS);
+	if (len != (size_t) n || strncmp(EXEC_PROCESS, iov.iov_base, len) != 0) {
+		LOG("unexpected message from container (%d): %.*s\n", (int)n,
+		    (int)n, (char *)iov.iov_base);
+		err = 1;
+	}
+
+ cleanup:
+	if (connection_socket >= 0) {
+		if (close(connection_socket) == -1) {
+			PERROR("close connection socket");
+			err = 1;
+		}
+	}
+	LOG("unlink connection socket at %s\n", path);
+	if (unlink(path) == -1) {
+		PERROR("unlink");
+		return 1;
+	}
+	return err;
+}
+
+static int serve_socket(json_t * process, int console, int *socket)
+{
+	struct epoll_event event;
+	struct epoll_event events[EVENT_BATCH_SIZE];
+	client_connection_t *clients = NULL, *client, *started = NULL;
+	struct iovec iov;
+	struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
+	sigset_t mask, orig_mask;
+	size_t n_clients = 0;
+	ssize_t n;
+	int connection_socket = -1, epoll_fd = -1, exec_fd = -1, data_socket,
+	    signal_fd = -1, err = 0, i, m, flags, masked = 0;
+
+	if (recvfd(*socket, &connection_socket) == -1) {
+		return 1;
+	}
+	LOG("listen on %d (backlog %d)\n", connection_socket, socket_backlog);
+	if (listen(connection_socket, socket_backlog) == -1) {
+		PERROR("listen");
+		err = 1;
+		goto cleanup;
+	}
+
+	if (pool_ready_fd >= 0) {
+		LOG("notify the pool that the container is ready\n");
+		if (write(pool_ready_fd, "", 1) == -1) {
+			PERROR("write pool readiness pipe");
+			err = 1;
+			goto cleanup;
+		}
+		if (close(pool_ready_fd) == -1) {
+			PERROR("close pool readiness pipe");
+			err = 1;
+			goto cleanup;
+		}
+		pool_ready_fd = -1;
+	}
+
+	flags = fcntl(connection_socket, F_GETFL);
+	if (flags == -1
+	    || fcntl(connection_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+		PERROR("fcntl");
+		err = 1;
+		goto cleanup;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		PERROR("epoll_create1");
+		err = 1;
+		goto cleanup;
+	}
+
+	event.events = EPOLLIN;
+	event.data.u32 = 0;	/* zero marks the connection socket, clients are index + 1 */
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection_socket, &event) == -1) {
+		PERROR("epoll_ctl");
+		err = 1;
+		goto cleanup;
+	}
+
+	/* exec processes report through SIGCHLD */
+	if (sigemptyset(&mask) || sigaddset(&mask, SIGCHLD)) {
+		PERROR("sigaddset");
+		err = 1;
+		goto cleanup;
+	}
+	if (sigprocmask(SIG_BLOCK, &mask, &orig_mask) == -1) {
+		PERROR("sigprocmask");
+		err = 1;
+		goto cleanup;
+	}
+	masked = 1;
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd == -1) {
+		PERROR("signalfd");
+		err = 1;
+		goto cleanup;
+	}
+	event.data.u32 = SERVE_EVENT_SIGNAL;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == -1) {
+		PERROR("epoll_ctl");
+		err = 1;
+		goto cleanup;
+	}
+
+	log_flush();		/* we may wait a long time for the start request */
+	while (!started) {
+		m = epoll_wait(epoll_fd, events, EVENT_BATCH_SIZE, -1);
+		if (m == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			PERROR("epoll_wait");
+			err = 1;
+			goto cleanup;
+		}
+
+		for (i = 0; i < m && !started; i++) {
+			if (events[i].data.u32 == SERVE_EVENT_SIGNAL) {
+				serve_reap(epoll_fd, signal_fd, clients,
+					   n_clients);
+				continue;
+			}
+			if (events[i].data.u32 == 0) {
+				while (1) {
+					data_socket =
+					    accept4(connection_socket, NULL,
+						    NULL,
+						    SOCK_NONBLOCK |
+						    SOCK_CLOEXEC);
+					if (data_socket == -1) {
+						if (errno == EAGAIN
+						    || errno == EWOULDBLOCK
+						    || errno == EINTR) {
+							break;
+						}
+						PERROR("accept4");
+						if (errno == EMFILE
+						    || errno == ENFILE
+						    || errno == ECONNABORTED) {
+							break;
+						}
+						err = 1;
+						goto cleanup;
+					}
+					LOG("accepted connection on %d\n",
+					    data_socket);
+					if (add_client
+					    (epoll_fd, &clients, &n_clients,
+					     data_socket, 1)) {
+						if (close(data_socket) == -1) {
+							PERROR
+							    ("close data socket");
+						}
+					}
+				}
+				continue;
+			}
+
+			client = &clients[events[i].data.u32 - 1];
+			if (client->pid > 0) {
+				/* the exec client hung up (or misbehaved) */
+				LOG("lost exec client %d, stopping process %d\n", client->fd, (int)client->pid);
+				if (kill(client->pid, SIGTERM)) {
+					PERROR("kill");
+				}
+				remove_client(epoll_fd, client);
+			} else if (handle_client(client, process)) {
+				remove_client(epoll_fd, client);
+			} else if (client->state == CLIENT_EXEC) {
+				if (serve_exec
+				    (client, connection_socket, socket,
+				     &orig_mask)) {
+					remove_client(epoll_fd, client);
+				}
+			} else if (client->state == CLIENT_NAMESPACES) {
+				send_client_error(client->fd,
+						  "namespace requests need a --pool supervisor");
+				remove_client(epoll_fd, client);
+			} else if (client->state == CLIENT_STARTED) {
+				started = client;
+			}
+		}
+	}
+
+	trace_event('I', "start-request");
+
+	iov.iov_base = "\0";
+	iov.iov_len = 1;
+	n = sendmsg(started->fd, &msg, 0);
+	if (n == -1) {
+		PERROR("sendmsg");
+		err = 1;
+		goto cleanup;
+	} else if ((size_t) n != iov.iov_len) {
+		LOG("did not send the expected number of bytes: %d != %d\n",
+		    (int)n, (int)iov.iov_len);
+		err = 1;
+		goto cleanup;
+	}
+
+	process = started->process;
+	started->process = NULL;
+	exec_fd = started->exec_fd;
+	started->exec_fd = -1;
+	for (i = 0; (size_t) i < n_clients; i++) {
+		if (&clients[i] == started) {
+			continue;
+		}
+		remove_client(epoll_fd, &clients[i]);
+	}
+	if (close(started->fd) == -1) {
+		PERROR("close data socket");
+		started->fd = -1;
+		err = 1;
+		goto cleanup;
+	}
+	started->fd = -1;
+	if (close(connection_socket) == -1) {
+		PERROR("close connection socket");
+		err = 1;
+		connection_socket = -1;
+		goto cleanup;
+	}
+	connection_socket = -1;
+	if (close(epoll_fd) == -1) {
+		PERROR("close epoll file descriptor");
+		err = 1;
+		epoll_fd = -1;
+		goto cleanup;
+	}
+	epoll_fd = -1;
+	if (close(signal_fd) == -1) {
+		PERROR("close signal file descriptor");
+		err = 1;
+		signal_fd = -1;
+		goto cleanup;
+	}
+	signal_fd = -1;
+	if (sigprocmask(SIG_SETMASK, &orig_mask, NULL) == -1) {
+		PERROR("sigprocmask");
+		err = 1;
+		goto cleanup;
+	}
+	masked = 0;
+
+	iov.iov_base = (void *)EXEC_PROCESS;
+	iov.iov_len = strlen(iov.iov_base);
+	n = sendmsg(*socket, &msg, 0);
+	if (n == -1) {
+		PERROR("sendmsg");
+		err = 1;
+		goto cleanup;
+	} else if ((size_t) n != iov.iov_len) {
+		LOG("did not send the expected number of bytes: %d != %d\n",
+		    (int)n, (int)iov.iov_len);
+		err = 1;
+		goto cleanup;
+	}
+
+	exec_process(process, console, 1, 1, socket, &exec_fd);
+	err = 1;
+
+ cleanup:
+	if (exec_fd >= 0) {
+		if (close(exec_fd) == -1) {
+			PERROR("close container-process executable");
+			err = 1;
+		}
+	}
+	for (i = 0; (size_t) i < n_clients; i++) {
+		remove_client(-1, &clients[i]);
+	}
+	if (clients) {
+		free(clients);
+	}
+	if (epoll_fd >= 0) {
+		if (close(epoll_fd) == -1) {
+			PERROR("close epoll file descriptor");
+			err = 1;
+		}
+	}
+	if (connection_socket >= 0) {
+		if (close(connection_socket) == -1) {
+			PERROR("close connection socket");
+			err = 1;
+		}
+	}
+	if (signal_fd >= 0) {
+		if (close(signal_fd) == -1) {
+			PERROR("close signal file descriptor");
+			err = 1;
+		}
+	}
+	if (masked && sigprocmask(SIG_SETMASK, &orig_mask, NULL) == -1) {
+		PERROR("sigprocmask");
+		err = 1;
+	}
+	return err;
+}
+
+/*
+ * Fork an exec request's process from the configured container init.
+ * The child inherits the finished namespaces, mounts, and root, and
+ * runs with the client's stdio.  The exit code is sent by serve_reap.
+ */
+static int serve_exec(client_connection_t * client, int connection_socket,
+		      int *socket, sigset_t * mask)
+{
+	struct iovec iov = { "\0", 1 };
+	struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
+	pid_t pid;
+	int i;
+
+	if (json_boolean_value(json_object_get(client->process, "terminal"))) {
+		LOG("exec request on %d sets process.terminal\n", client->fd);
+		send_client_error(client->fd,
+				  "exec requests cannot set process.terminal");
+		return 1;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		PERROR("fork");
+		send_client_error(client->fd, "failed to fork exec process");
+		return 1;
+	}
+
+	if (pid == 0) {		/* exec process */
+		trace_process = "exec";
+		for (i = 0; i < 3; i++) {
+			if (dup2(client->stdio[i], i) == -1) {
+				PERROR("dup2");
+				_exit(1);
+			}
+		}
+		for (i = 0; i < 3; i++) {
+			if (client->stdio[i] > 2 && close(client->stdio[i])) {
+				PERROR("close client stdio in exec process");
+				_exit(1);
+			}
+			client->stdio[i] = -1;
+		}
+		if (close(connection_socket) || close(*socket)) {
+			PERROR("close container socket in exec process");
+			_exit(1);
+		}
+		*socket = -1;
+		if (sigprocmask(SIG_SETMASK, mask, NULL) == -1) {
+			PERROR("sigprocmask");
+			_exit(1);
+		}
+		exec_process(client->process, 0, 1, 1, NULL, &client->exec_fd);
+		_exit(1);
+	}
+
+	client->pid = pid;
+	LOG("launched exec process %d for client %d\n", (int)pid, client->fd);
+	for (i = 0; i < 3; i++) {
+		if (close(client->stdio[i]) == -1) {
+			PERROR("close client stdio");
+		}
+		client->stdio[i] = -1;
+	}
+	if (client->exec_fd >= 0) {
+		if (close(client->exec_fd) == -1) {
+			PERROR("close container-process executable");
+		}
+		client->exec_fd = -1;
+	}
+
+	if (sendmsg(client->fd, &msg, 0) == -1) {
+		PERROR("sendmsg");
+	}
+	return 0;
+}
+
+/* reap exec processes (and reparented orphans) and report exit codes */
+static void serve_reap(int epoll_fd, int signal_fd,
+		       client_connection_t * clients, size_t n_clients)
+{
+	struct signalfd_siginfo ssi;
+	siginfo_t siginfo;
+	char buf[16];
+	size_t i;
+	int code, size;
+
+	/* drain the signal file descriptor, waitid finds the children */
+	while (read(signal_fd, &ssi, sizeof(ssi)) == sizeof(ssi)) ;
+	while (1) {
+		siginfo.si_pid = 0;
+		if (waitid(P_ALL, 0, &siginfo, WEXITED | WNOHANG) == -1) {
+			if (errno != ECHILD) {
+				PERROR("waitid");
+			}
+			break;
+		}
+		if (siginfo.si_pid == 0) {
+			break;
+		}
+		for (i = 0; i < n_clients; i++) {
+			if (clients[i].fd < 0 || clients[i].pid != siginfo.si_pid) {
+				continue;
+			}
+			code = wait_status(clients[i].pid, "exec", &siginfo);
+			size = snprintf(buf, sizeof(buf), "%d", code);
+			if (size > 0 && (size_t) size < sizeof(buf)) {
+				send_client_error(clients[i].fd, buf);
+			}
+			remove_client(epoll_fd, &clients[i]);
+			break;
+		}
+	}
+}
+
+static int add_client(int epoll_fd, client_connection_t ** clients,
+		      size_t * n_clients, int data_socket, uint32_t tag)
+{
+	struct epoll_event event;
+	client_connection_t *new_clients, *client = NULL;
+	size_t i;
+
+	for (i = 0; i < *n_clients; i++) {
+		if ((*clients)[i].fd < 0) {
+			client = &(*clients)[i];
+			break;
+		}
+	}
+
+	if (!client) {
+		new_clients =
+		    realloc(*clients,
+			    sizeof(client_connection_t) * (*n_clients + 10));
+		if (!new_clients) {
+			PERROR("realloc");
+			return 1;
+		}
+		for (i = *n_clients; i < *n_clients + 10; i++) {
+			new_clients[i].fd = -1;
+			new_clients[i].exec_fd = -1;
+			new_clients[i].process = NULL;
+			memset(&new_clients[i].message, 0,
+			       sizeof(message_buffer_t));
+			new_clients[i].state = CLIENT_READ_REQUEST;
+			new_clients[i].stdio[0] = new_clients[i].stdio[1] =
+			    new_clients[i].stdio[2] = -1;
+		}
+		client = &new_clients[*n_clients];
+		*clients = new_clients;
+		*n_clients += 10;
+	}
+
+	client->fd = data_socket;
+	client->exec_fd = -1;
+	client->process = NULL;
+	memset(&client->message, 0, sizeof(message_buffer_t));
+	client->state = CLIENT_READ_REQUEST;
+	client->exec = 0;
+	client->stdio[0] = client->stdio[1] = client->stdio[2] = -1;
+	client->pid = -1;
+
+	event.events = EPOLLIN;
+	event.data.u32 = tag + (uint32_t) (client - *clients);
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data_socket, &event) == -1) {
+		PERROR("epoll_ctl");
+		client->fd = -1;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void remove_client(int epoll_fd, client_connection_t * client)
+{
+	int i;
+
+	if (client->fd >= 0) {
+		if (epoll_fd >= 0
+		    && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd,
+				 NULL) == -1) {
+			PERROR("epoll_ctl");
+		}
+		if (close(client->fd) == -1) {
+			PERROR("close data socket");
+		}
+		client->fd = -1;
+	}
+	if (client->exec_fd >= 0) {
+		if (close(client->exec_fd) == -1) {
+			PERROR("close container-process executable");
+		}
+		client->exec_fd = -1;
+	}
+	if (client->process) {
+		json_decref(client->process);
+		client->process = NULL;
+	}
+	free_message(&client->message);
+	for (i = 0; i < 3; i++) {
+		if (client->stdio[i] >= 0) {
+			if (close(client->stdio[i]) == -1) {
+				PERROR("close client stdio");
+			}
+			client->stdio[i] = -1;
+		}
+	}
+	client->state = CLIENT_READ_REQUEST;
+	client->exec = 0;
+	client->pid = -1;
+}
+
+/*
+ * Handle a single incoming message on a client connection.  Returns
+ * nonzero if the connection should be closed.  Sets client->state to
+ * CLIENT_STARTED once a complete start request has been received,
+ * CLIENT_EXEC once a complete exec request (EXEC_REQUEST, process
+ * JSON, any host executable, and three stdio descriptors) has been
+ * received, or CLIENT_NAMESPACES for a --namespace-pool request.
+ */
+static int handle_client(client_connection_t * client, json_t * process)
+{
+	char error_message[CLIENT_MESSAGE_SIZE];
+	char *buf;
+	json_t *host;
+	json_error_t error;
+	size_t n;
+	int size, i;
+
+	if (client->state == CLIENT_READ_EXEC_FD) {
+		if (recvfd(client->fd, &client->exec_fd) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			LOG("failed to receive executable file descriptor\n");
+			send_client_error(client->fd,
+					  "failed to receive executable file descriptor");
+			return 1;
+		}
+		client->state =
+		    client->exec ? CLIENT_READ_STDIO : CLIENT_STARTED;
+		return 0;
+	}
+
+	if (client->state == CLIENT_READ_STDIO) {
+		for (i = 0; i < 3; i++) {
+			if (client->stdio[i] >= 0) {
+				continue;
+			}
+			if (recvfd(client->fd, &client->stdio[i]) == -1) {
+				client->stdio[i] = -1;
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					return 0;
+				}
+				LOG("failed to receive stdio file descriptor\n");
+				send_client_error(client->fd,
+						  "failed to receive stdio file descriptor");
+				return 1;
+			}
+		}
+		client->state = CLIENT_EXEC;
+		return 0;
+	}
+
+	switch (recv_message(client->fd, &client->message)) {
+	case 0:
+		return 0;	/* would block, or a frame is still arriving */
+	case 1:
+		break;
+	default:
+		return 1;
+	}
+	buf = client->message.data;
+	n = client->message.len;
+
+	if (!client->exec && n == strlen(EXEC_REQUEST)
+	    && strncmp(EXEC_REQUEST, buf, n) == 0) {
+		LOG("received exec request on %d\n", client->fd);
+		client->exec = 1;
+		return 0;
+	}
+
+	if (n == strlen(NAMESPACE_REQUEST)
+	    && strncmp(NAMESPACE_REQUEST, buf, n) == 0) {
+		LOG("received namespace request on %d\n", client->fd);
+		client->state = CLIENT_NAMESPACES;
+		return 0;
+	}
+
+	LOG("received start request (%d): %.*s\n", (int)n, (int)n, buf);
+	if (n == 1 && buf[0] != '\0') {
+		LOG("unexpected message from client (%d): %.*s\n", (int)n,
+		    (int)n, buf);
+		send_client_error(client->fd, "unexpected length-one message");
+		return 1;
+	} else if (n == 1) {
+		if (process) {
+			client->process = json_incref(process);
+		}
+		client->state =
+		    client->exec ? CLIENT_READ_STDIO : CLIENT_STARTED;
+		return 0;
+	}
+
+	client->process =
+	    json_loadb(buf, strnlen(buf, n), JSON_REJECT_DUPLICATES, &error);
+	free_message(&client->message);
+	if (!client->process) {
+		size =
+		    snprintf(error_message, sizeof(error_message),
+			     "error on process message %d:%d: %s",
+			     error.line, error.column, error.text);
+		if (size < 0) {
+			LOG("failed to format process JSON error\n");
+		} else {
+			LOG("%s\n", error_message);
+			send_client_error(client->fd, error_message);
+		}
+		return 1;
+	}
+
+	host = json_object_get(client->process, "host");
+	if (host && json_boolean_value(host)) {
+		client->state = CLIENT_READ_EXEC_FD;
+	} else {
+		client->state =
+		    client->exec ? CLIENT_READ_STDIO : CLIENT_STARTED;
+	}
+	return 0;
+}
+
+static void send_client_error(int data_socket, const char *message)
+{
+	struct iovec iov;
+	struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
+	ssize_t n;
+
+	iov.iov_base = (void *)message;
+	iov.iov_len = strlen(message);
+	n = sendmsg(data_socket, &msg, 0);
+	if (n == -1) {
+		PERROR("sendmsg");
+	} else if ((size_t) n != iov.iov_len) {
+		LOG("did not send the expected number of bytes: %d != %d\n",
+		    (int)n, (int)iov.iov_len);
+	}
+}
+
+/*
+ * Keep a pool of containers parked at their --socket start barrier
+ * and hand them out to start requests received on socket_path.
+ */
+static int run_pool(json_t * config, const char *socket_path, int size)
+{
+	struct epoll_event event;
+	struct epoll_event events[EVENT_BATCH_SIZE];
+	struct signalfd_siginfo siginfo;
+	client_connection_t *clients = NULL;
+	pool_worker_t *workers = NULL;
+	sigset_t mask;
+	char pool_dir[MAX_PATH];
+	size_t n_clients = 0, n_workers = 0, i;
+	ssize_t n;
+	uint32_t tag, index;
+	int connection_socket = -1, epoll_fd = -1, signal_fd = -1,
+	    data_socket, err = 0, flags, j, m, ready, starting, failures = 0;
+
+	pool_dir[0] = '\0';
+
+	/* resolve process.host once, workers dup it from run_container */
+	if (config_process
+	    && get_host_exec_fd(config_process, &host_exec_fd) == -1) {
+		return 1;
+	}
+	if (seal_exec && host_exec_fd >= 0 && seal_exec_fd(&host_exec_fd)) {
+		err = 1;
+		goto cleanup;
+	}
+
+	if (sigemptyset(&mask) || sigaddset(&mask, SIGHUP)
+	    || sigaddset(&mask, SIGINT) || sigaddset(&mask, SIGTERM)) {
+		PERROR("sigaddset");
+		err = 1;
+		goto cleanup;
+	}
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+		PERROR("sigprocmask");
+		err = 1;
+		goto cleanup;
+	}
+	signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (signal_fd == -1) {
+		PERROR("signalfd");
+		err = 1;
+		goto cleanup;
+	}
+
+	connection_socket = bind_socket(socket_path);
+	if (connection_socket == -1) {
+		err = 1;
+		goto cleanup;
+	}
+	LOG("listen on %s (backlog %d)\n", socket_path, socket_backlog);
+	if (listen(connection_socket, socket_backlog) == -1) {
+		PERROR("listen");
+		err = 1;
+		goto cleanup;
+	}
+	flags = fcntl(connection_socket, F_GETFL);
+	if (flags == -1
+	    || fcntl(connection_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+		PERROR("fcntl");
+		err = 1;
+		goto cleanup;
+	}
+
+	m = snprintf(pool_dir, MAX_PATH, "%s.pool.XXXXXX", socket_path);
+	if (m < 0 || m >= MAX_PATH) {
+		LOG("failed to format %s.pool.XXXXXX\n", socket_path);
+		pool_dir[0] = '\0';
+		err = 1;
+		goto cleanup;
+	}
+	if (!mkdtemp(pool_dir)) {
+		PERROR("mkdtemp");
+		pool_dir[0] = '\0';
+		err = 1;
+		goto cleanup;
+	}
+	LOG("created pool directory %s\n", pool_dir);
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		PERROR("epoll_create1");
+		err = 1;
+		goto cleanup;
+	}
+
+	event.events = EPOLLIN;
+	event.data.u32 = POOL_EVENT_CONNECTION;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection_socket, &event) == -1) {
+		PERROR("epoll_ctl");
+		err = 1;
+		goto cleanup;
+	}
+	event.data.u32 = POOL_EVENT_SIGNAL;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == -1) {
+		PERROR("epoll_ctl");
+		err = 1;
+		goto cleanup;
+	}
+
+	while (1) {
+		/* refill the pool */
+		starting = 0;
+		for (i = 0; i < n_workers; i++) {
+			if (workers[i].pid > 0
+			    && workers[i].state != POOL_WORKER_RUNNING) {
+				starting++;
+			}
+		}
+		for (; starting < size; starting++) {
+			if (pool_spawn
+			    (config, pool_dir, epoll_fd, &workers,
+			     &n_workers, connection_socket, signal_fd,
+			     clients, n_clients)) {
+				err = 1;
+				goto cleanup;
+			}
+		}
+
+		/* hand ready containers to waiting clients */
+		for (i = 0; i < n_clients; i++) {
+			if (clients[i].fd < 0
+			    || (clients[i].state != CLIENT_STARTED
+				&& clients[i].state != CLIENT_NAMESPACES)) {
+				continue;
+			}
+			ready = -1;
+			for (j = 0; (size_t) j < n_workers; j++) {
+				if (workers[j].pid > 0
+				    && workers[j].state == POOL_WORKER_READY) {
+					ready = j;
+					break;
+				}
+			}
+			if (ready < 0) {
+				break;
+			}
+			workers[ready].state = POOL_WORKER_RUNNING;
+			if (clients[i].state == CLIENT_NAMESPACES) {
+				(void)pool_lend_namespaces(epoll_fd,
+							   &workers[ready],
+							   (uint32_t) ready,
+							   &clients[i]);
+			} else {
+				(void)pool_forward(epoll_fd, &workers[ready],
+						   (uint32_t) ready,
+						   &clients[i]);
+			}
+			remove_client(epoll_fd, &clients[i]);
+		}
+
+		m = epoll_wait(epoll_fd, events, EVENT_BATCH_SIZE, -1);
+		if (m == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			PERROR("epoll_wait");
+			err = 1;
+			goto cleanup;
+		}
+
+		for (j = 0; j < m; j++) {
+			tag = events[j].data.u32 & POOL_EVENT_MASK;
+			index = events[j].data.u32 & ~POOL_EVENT_MASK;
+			if (events[j].data.u32 == POOL_EVENT_SIGNAL) {
+				n = read(signal_fd, &siginfo, sizeof(siginfo));
+				if (n != sizeof(siginfo)) {
+					PERROR("read signal file descriptor");
+					err = 1;
+					goto cleanup;
+				}
+				LOG("pool received %s, shutting down\n",
+				    strsignal((int)siginfo.ssi_signo));
+				for (i = 0; i < n_workers; i++) {
+					if (workers[i].pid > 0) {
+						if (kill
+						    (workers[i].pid,
+						     (int)siginfo.ssi_signo)) {
+							PERROR("kill");
+						}
+					}
+				}
+				goto cleanup;
+			} else if (events[j].data.u32 == POOL_EVENT_CONNECTION) {
+				while (1) {
+					data_socket =
+					    accept4(connection_socket, NULL,
+						    NULL,
+						    SOCK_NONBLOCK |
+						    SOCK_CLOEXEC);
+					if (data_socket == -1) {
+						if (errno != EAGAIN
+						    && errno != EWOULDBLOCK
+						    && errno != EINTR) {
+							PERROR("accept4");
+						}
+						break;
+					}
+					LOG("accepted pool connection on %d\n",
+					    data_socket);
+					if (add_client
+					    (epoll_fd, &clients, &n_clients,
+					     data_socket, POOL_EVENT_CLIENT)) {
+						if (close(data_socket) == -1) {
+							PERROR
+							    ("close data socket");
+						}
+					}
+				}
+			} else if (tag == POOL_EVENT_CLIENT) {
+				if (index >= n_clients || clients[index].fd < 0) {
+					continue;
+				}
+				if (handle_client(&clients[index], NULL)) {
+					remove_client(epoll_fd,
+						      &clients[index]);
+				} else if (clients[index].exec) {
+					send_client_error(clients[index].fd,
+							  "exec requests need a container socket");
+					remove_client(epoll_fd,
+						      &clients[index]);
+				}
+			} else if (tag == POOL_EVENT_RELAY) {
+				if (index < n_workers
+				    && workers[index].relay_fd >= 0) {
+					pool_relay(epoll_fd, &workers[index]);
+				}
+			} else if (tag == POOL_EVENT_WORKER) {
+				if (index >= n_workers
+				    || workers[index].pid <= 0) {
+					continue;
+				}
+				if (pool_handle_worker
+				    (epoll_fd, &workers[index], &failures)) {
+					if (failures >= size) {
+						LOG("%d pool containers failed before becoming ready, giving up\n", failures);
+						err = 1;
+						goto cleanup;
+					}
+				}
+			}
+		}
+	}
+
+ cleanup:
+	for (i = 0; i < n_clients; i++) {
+		remove_client(-1, &clients[i]);
+	}
+	if (clients) {
+		free(clients);
+	}
+	for (i = 0; i < n_workers; i++) {
+		if (workers[i].pid > 0) {
+			if (workers[i].state != POOL_WORKER_RUNNING
+			    && kill(workers[i].pid, SIGTERM)) {
+				PERROR("kill");
+			}
+			(void)_wait(workers[i].pid, "pool worker");
+		}
+		if (workers[i].ready_fd >= 0) {
+			if (close(workers[i].ready_fd) == -1) {
+				PERROR("close pool readiness pipe");
+			}
+		}
+		if (workers[i].relay_fd >= 0) {
+			pool_relay(-1, &workers[i]);
+		}
+	}
+	if (workers) {
+		free(workers);
+	}
+	if (epoll_fd >= 0) {
+		if (close(epoll_fd) == -1) {
+			PERROR("close epoll file descriptor");
+			err = 1;
+		}
+	}
+	if (signal_fd >= 0) {
+		if (close(signal_fd) == -1) {
+			PERROR("close signal file descriptor");
+			err = 1;
+		}
+	}
+	if (connection_socket >= 0) {
+		if (close(connection_socket) == -1) {
+			PERROR("close connection socket");
+			err = 1;
+		}
+		LOG("unlink connection socket at %s\n", socket_path);
+		if (unlink(socket_path) == -1) {
+			PERROR("unlink");
+			err = 1;
+		}
+	}
+	if (pool_dir[0] != '\0') {
+		LOG("remove pool directory %s\n", pool_dir);
+		if (rmdir(pool_dir) == -1) {
+			PERROR("rmdir");
+			err = 1;
+		}
+	}
+	if (host_exec_fd >= 0) {
+		if (close(host_exec_fd) == -1) {
+			PERROR("close container-process executable");
+			err = 1;
+		}
+		host_exec_fd = -1;
+	}
+	return err;
+}
+
+/* fork a pool worker that runs a container with its own slot socket */
+static int pool_spawn(json_t * config, const char *pool_dir, int epoll_fd,
+		      pool_worker_t ** workers, size_t * n_workers,
+		      int connection_socket, int signal_fd,
+		      client_connection_t * clients, size_t n_clients)
+{
+	struct epoll_event event;
+	pool_worker_t *new_workers, *worker = NULL;
+	sigset_t mask;
+	size_t i;
+	pid_t pid;
+	int pipe_fd[2], size;
+	static unsigned long serial = 0;
+
+	for (i = 0; i < *n_workers; i++) {
+		/* a slot is busy until its start response is relayed */
+		if ((*workers)[i].pid <= 0 && (*workers)[i].relay_fd < 0) {
+			worker = &(*workers)[i];
+			break;
+		}
+	}
+
+	if (!worker) {
+		new_workers =
+		    realloc(*workers, sizeof(pool_worker_t) * (*n_workers + 10));
+		if (!new_workers) {
+			PERROR("realloc");
+			return 1;
+		}
+		for (i = *n_workers; i < *n_workers + 10; i++) {
+			new_workers[i].pid = -1;
+			new_workers[i].ready_fd = -1;
+			new_workers[i].relay_fd = -1;
+			new_workers[i].client_fd = -1;
+			new_workers[i].state = POOL_WORKER_STARTING;
+			new_workers[i].path[0] = '\0';
+		}
+		worker = &new_workers[*n_workers];
+		*workers = new_workers;
+		*n_workers += 10;
+	}
+
+	size =
+	    snprintf(worker->path, sizeof(worker->path), "%s/%lu", pool_dir,
+		     serial++);
+	if (size < 0 || (size_t) size >= sizeof(worker->path)) {
+		LOG("failed to format pool socket path in %s\n", pool_dir);
+		return 1;
+	}
+
+	if (pipe2(pipe_fd, O_CLOEXEC) == -1) {
+		PERROR("pipe2");
+		return 1;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		PERROR("fork");
+		(void)close_pipe(pipe_fd);
+		return 1;
+	}
+
+	if (pid == 0) {		/* worker */
+		if (prctl(PR_SET_PDEATHSIG, SIGTERM)) {
+			PERROR("prctl");
+			exit(1);
+		}
+		if (close(pipe_fd[0]) || close(connection_socket)
+		    || close(epoll_fd) || close(signal_fd)) {
+			PERROR("close pool file descriptor in worker");
+			exit(1);
+		}
+		for (i = 0; i < *n_workers; i++) {
+			if ((*workers)[i].ready_fd >= 0
+			    && close((*workers)[i].ready_fd)) {
+				PERROR("close pool readiness pipe in worker");
+				exit(1);
+			}
+			if (((*workers)[i].relay_fd >= 0
+			     && close((*workers)[i].relay_fd))
+			    || ((*workers)[i].client_fd >= 0
+				&& close((*workers)[i].client_fd))) {
+				PERROR("close pool relay socket in worker");
+				exit(1);
+			}
+		}
+		for (i = 0; i < n_clients; i++) {
+			if (clients[i].fd >= 0 && close(clients[i].fd)) {
+				PERROR("close data socket in worker");
+				exit(1);
+			}
+			if (clients[i].exec_fd >= 0
+			    && close(clients[i].exec_fd)) {
+				PERROR
+				    ("close container-process executable in worker");
+				exit(1);
+			}
+		}
+		if (sigemptyset(&mask) == -1
+		    || sigprocmask(SIG_SETMASK, &mask, NULL) == -1) {
+			PERROR("sigprocmask");
+			exit(1);
+		}
+		pool_ready_fd = pipe_fd[1];
+		exit(run_container(config, worker->path));
+	}
+
+	if (close(pipe_fd[1]) == -1) {
+		PERROR("close pool readiness pipe write-end");
+		if (close(pipe_fd[0]) == -1) {
+			PERROR("close pool readiness pipe read-end");
+		}
+		return 1;
+	}
+
+	worker->pid = pid;
+	worker->ready_fd = pipe_fd[0];
+	worker->state = POOL_WORKER_STARTING;
+	LOG("launched pool worker %d for %s\n", (int)pid, worker->path);
+
+	event.events = EPOLLIN;
+	event.data.u32 = POOL_EVENT_WORKER | (uint32_t) (worker - *workers);
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, worker->ready_fd, &event) == -1) {
+		PERROR("epoll_ctl");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Handle readiness (a byte) or exit (EOF) from a pool worker.
+ * Returns nonzero if the worker exited before becoming ready.
+ */
+static int pool_handle_worker(int epoll_fd, pool_worker_t * worker,
+			      int *failures)
+{
+	char buf[1];
+	ssize_t n;
+	int err = 0;
+
+	n = read(worker->ready_fd, buf, sizeof(buf));
+	if (n == -1) {
+		if (errno == EINTR || errno == EAGAIN) {
+			return 0;
+		}
+		PERROR("read pool readiness pipe");
+	} else if (n > 0) {
+		LOG("pool container for %s is ready\n", worker->path);
+		worker->state = POOL_WORKER_READY;
+		*failures = 0;
+		return 0;
+	}
+
+	/* the worker exited */
+	if (worker->state != POOL_WORKER_RUNNING) {
+		LOG("pool worker %d exited before its container started\n",
+		    (int)worker->pid);
+		(*failures)++;
+		err = 1;
+	}
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, worker->ready_fd, NULL) == -1) {
+		PERROR("epoll_ctl");
+	}
+	if (close(worker->ready_fd) == -1) {
+		PERROR("close pool readiness pipe");
+	}
+	worker->ready_fd = -1;
+	(void)_wait(worker->pid, "pool worker");
+	worker->pid = -1;
+	return err;
+}
+
+/*
+ * Pass a client's start request to a ready pool container.  The
+ * container only responds once its process starts, so rather than
+ * wait here, hand the client connection to the worker and let
+ * pool_relay pass the response on when the event loop sees it.
+ */
+static int pool_forward(int epoll_fd, pool_worker_t * worker,
+			uint32_t index, client_connection_t * client)
+{
+	char *request = NULL;
+	const char *data;
+	size_t len;
+	int sock = -1, err = 0;
+
+	LOG("hand %s to pool client %d\n", worker->path, client->fd);
+
+	if (client->process) {
+		request = json_dumps(client->process, JSON_COMPACT);
+		if (!request) {
+			LOG("failed to serialize process JSON\n");
+			send_client_error(client->fd,
+					  "failed to serialize process JSON");
+			return 1;
+		}
+		data = request;
+		len = strlen(request) + 1;
+	} else {
+		data = "\0";
+		len = 1;
+	}
+
+	sock = connect_socket(worker->path);
+	if (sock == -1) {
+		send_client_error(client->fd, "failed to connect to pool container");
+		err = 1;
+		goto cleanup;
+	}
+
+	if (send_message(sock, data, len)) {
+		send_client_error(client->fd, "failed to send start request to pool container");
+		err = 1;
+		goto cleanup;
+	}
+	if (client->exec_fd >= 0) {
+		if (sendfd(sock, &client->exec_fd, 1)) {
+			send_client_error(client->fd, "failed to send executable to pool container");
+			err = 1;
+			goto cleanup;
+		}
+	}
+
+	if (pool_watch_relay(epoll_fd, worker, index, sock)) {
+		send_client_error(client->fd, "failed to wait for pool container response");
+		err = 1;
+		goto cleanup;
+	}
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL) == -1) {
+		PERROR("epoll_ctl");
+	}
+	worker->client_fd = client->fd;
+	client->fd = -1;
+	sock = -1;
+
+ cleanup:
+	if (request) {
+		free(request);
+	}
+	if (sock >= 0) {
+		if (close(sock) == -1) {
+			PERROR("close pool container socket");
+			err = 1;
+		}
+	}
+	return err;
+}
+
+/* make sock the worker's relay_fd, which pool_relay reads when it's ready */
+static int pool_watch_relay(int epoll_fd, pool_worker_t * worker,
+			    uint32_t index, int sock)
+{
+	struct epoll_event event;
+	int flags;
+
+	flags = fcntl(sock, F_GETFL);
+	if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+		PERROR("fcntl");
+		return 1;
+	}
+	event.events = EPOLLIN;
+	event.data.u32 = POOL_EVENT_RELAY | index;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) == -1) {
+		PERROR("epoll_ctl");
+		return 1;
+	}
+	worker->relay_fd = sock;
+	worker->client_fd = -1;
+	return 0;
+}
+
+/*
+ * Pass a pool container's start response on to the client waiting
+ * for it, or check a retired container's empty response.  With
+ * epoll_fd -1, just drop the relay during shutdown.
+ */
+static void pool_relay(int epoll_fd, pool_worker_t * worker)
+{
+	char buf[CLIENT_MESSAGE_SIZE];
+	struct iovec iov;
+	struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
+	ssize_t n;
+
+	if (epoll_fd >= 0) {
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+		n = recvmsg(worker->relay_fd, &msg, 0);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK
+			    || errno == EINTR) {
+				return;
+			}
+			PERROR("recvmsg");
+			if (worker->client_fd >= 0) {
+				send_client_error(worker->client_fd,
+						  "failed to receive pool container response");
+			}
+		} else if (worker->client_fd < 0) {
+			if (n != 1 || buf[0] != '\0') {
+				LOG("failed to retire pool container %s: %.*s\n", worker->path, (int)n, buf);
+			}
+		} else if (n == 0) {
+			LOG("%s closed before responding to pool client %d\n",
+			    worker->path, worker->client_fd);
+		} else {
+			iov.iov_len = (size_t) n;
+			if (sendmsg(worker->client_fd, &msg, 0) == -1) {
+				PERROR("sendmsg");
+			}
+		}
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, worker->relay_fd, NULL)
+		    == -1) {
+			PERROR("epoll_ctl");
+		}
+	}
+
+	if (close(worker->relay_fd) == -1) {
+		PERROR("close pool container socket");
+	}
+	worker->relay_fd = -1;
+	if (worker->client_fd >= 0) {
+		if (close(worker->client_fd) == -1) {
+			PERROR("close data socket");
+		}
+		worker->client_fd = -1;
+	}
+}
+
+/*
+ * Lend the namespaces a parked pool container created to a
+ * --namespace-pool client, and then retire the container with an
+ * empty process, leaving its reply to pool_relay.  The kernel keeps each namespace alive while the
+ * client holds its file descriptor (or has processes inside it), so
+ * there is nothing to recycle.  User and PID namespaces are not lent,
+ * because setns(2) can't move the borrower's (already cloned)
+ * namespaces under the lent user namespace, and a joined PID namespace
+ * only applies to the borrower's children.
+ */
+static int pool_lend_namespaces(int epoll_fd, pool_worker_t * worker,
+				uint32_t index, client_connection_t * client)
+{
+	static const int types[] = {
+		CLONE_NEWNS, CLONE_NEWCGROUP, CLONE_NEWUTS, CLONE_NEWIPC,
+		CLONE_NEWNET, 0
+	};
+	char buf[CLIENT_MESSAGE_SIZE], path[MAX_PATH];
+	struct iovec iov;
+	struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	const char *name;
+	size_t len = 1;
+	int fds[sizeof(types) / sizeof(types[0])];
+	int sock = -1, err = 0, i, count = 0, size;
+
+	LOG("lend namespaces from %s to pool client %d\n", worker->path,
+	    client->fd);
+	buf[0] = '\0';
+
+	sock = connect_socket(worker->path);
+	if (sock == -1) {
+		send_client_error(client->fd,
+				  "failed to connect to pool container");
+		return 1;
+	}
+
+	/* the slot socket is listening in the container process */
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1) {
+		PERROR("getsockopt");
+		send_client_error(client->fd,
+				  "failed to get the pool container's PID");
+		err = 1;
+		goto retire;
+	}
+
+	for (i = 0; types[i]; i++) {
+		if (!(config_plan->clone_flags & types[i])) {
+			continue;
+		}
+		name = get_namespace_name(types[i]);
+		size =
+		    snprintf(path, MAX_PATH, "/proc/%lu/ns/%s",
+			     (unsigned long int)cred.pid, name);
+		if (size < 0 || size >= MAX_PATH) {
+			LOG("failed to format /proc/%lu/ns/%s\n",
+			    (unsigned long int)cred.pid, name);
+			send_client_error(client->fd,
+					  "failed to format namespace path");
+			err = 1;
+			goto retire;
+		}
+		fds[count] = open(path, O_RDONLY | O_CLOEXEC);
+		if (fds[count] == -1) {
+			PERROR("open");
+			send_client_error(client->fd,
+					  "failed to open pool container namespace");
+			err = 1;
+			goto retire;
+		}
+		count++;
+		size =
+		    snprintf(buf + len, sizeof(buf) - len, "%s%s",
+			     len > 1 ? " " : "", name);
+		len += (size_t) size;	/* short names always fit */
+	}
+	if (!count) {
+		send_client_error(client->fd,
+				  "pool containers have no namespaces to lend");
+		err = 1;
+		goto retire;
+	}
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	if (sendmsg(client->fd, &msg, 0) == -1) {
+		PERROR("sendmsg");
+		err = 1;
+		goto retire;
+	}
+	for (i = 0; i < count; i++) {
+		if (sendfd(client->fd, &fds[i], 0)) {
+			err = 1;
+			goto retire;
+		}
+	}
+
+ retire:
+	/* a process without args exits once it has replied */
+	iov.iov_base = "{}";
+	iov.iov_len = strlen("{}") + 1;
+	if (sendmsg(sock, &msg, 0) == -1) {
+		PERROR("sendmsg");
+		err = 1;
+	} else if (pool_watch_relay(epoll_fd, worker, index, sock)) {
+		err = 1;
+	} else {
+		sock = -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (close(fds[i]) == -1) {
+			PERROR("close namespace file descriptor");
+			err = 1;
+		}
+	}
+	if (sock >= 0 && close(sock) == -1) {
+		PERROR("close pool container socket");
+		err = 1;
+	}
+	return err;
+}
+
+/*
+ * Launch a container for each config received on socket_path.  Each
+ * container runs the usual lifecycle in a ccon worker forked from
+ * this process, so the container state in ccon's globals (child_pid,
+ * hook_pids, config_plan, ...) is private to its worker, while the
+ * daemon only tracks workers and their clients.
+ */
+static int run_daemon(const char *socket_path, const char *plan_cache)
+{
+	struct epoll_event event;
+	struct epoll_event events[EVENT_BATCH_SIZE];
+	struct signalfd_siginfo ssi;
+	daemon_container_t *containers = NULL, *container;
+	siginfo_t siginfo;
+	sigset_t mask;
+	size_t n_containers = 0, i;
+	ssize_t n;
+	uint32_t tag, index;
+	int connection_socket = -1, epoll_fd = -1, signal_fd = -1,
+	    data_socket, err = 0, flags, j, m, signum = 0;
+
+	if (sigemptyset(&mask) || sigaddset(&mask, SIGCHLD)
+	    || sigaddset(&mask, SIGHUP) || sigaddset(&mask, SIGINT)
+	    || sigaddset(&mask, SIGTERM)) {
+		PERROR("sigaddset");
+		return 1;
+	}
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+		PERROR("sigprocmask");
+		return 1;
+	}
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd == -1) {
+		PERROR("signalfd");
+		err = 1;
+		goto cleanup;
+	}
+
+	connection_socket = bind_socket(socket_path);
+	if (connection_socket == -1) {
+		err = 1;
+		goto cleanup;
+	}
+	LOG("listen on %s (backlog %d)\n", socket_path, socket_backlog);
+	if (listen(connection_socket, socket_backlog) == -1) {
+		PERROR("listen");
+		err = 1;
+		goto cleanup;
+	}
+	flags = fcntl(connection_socket, F_GETFL);
+	if (flags == -1
+	    || fcntl(connection_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+		PERROR("fcntl");
+		err = 1;
+		goto cleanup;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		PERROR("epoll_create1");
+		err = 1;
+		goto cleanup;
+	}
+
+	event.events = EPOLLIN;
+	event.data.u32 = POOL_EVENT_CONNECTION;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection_socket, &event) == -1) {
+		PERROR("epoll_ctl");
+		err = 1;
+		goto cleanup;
+	}
+	event.data.u32 = POOL_EVENT_SIGNAL;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == -1) {
+		PERROR("epoll_ctl");
+		err = 1;
+		goto cleanup;
+	}
+
+	while (!signum) {
+		m = epoll_wait(epoll_fd, events, EVENT_BATCH_SIZE, -1);
+		if (m == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			PERROR("epoll_wait");
+			err = 1;
+			goto cleanup;
+		}
+
+		for (j = 0; j < m; j++) {
+			tag = events[j].data.u32 & POOL_EVENT_MASK;
+			index = events[j].data.u32 & ~POOL_EVENT_MASK;
+			if (events[j].data.u32 == POOL_EVENT_SIGNAL) {
+				while ((n =
+					read(signal_fd, &ssi,
+					     sizeof(ssi))) == sizeof(ssi)) {
+					if (ssi.ssi_signo != SIGCHLD) {
+						signum = (int)ssi.ssi_signo;
+					}
+				}
+				if (n == -1 && errno != EAGAIN) {
+					PERROR("read signal file descriptor");
+					err = 1;
+					goto cleanup;
+				}
+
+				/* SIGCHLD coalesces, so reap everything that exited */
+				while (1) {
+					siginfo.si_pid = 0;
+					if (waitid
+					    (P_ALL, 0, &siginfo,
+					     WEXITED | WNOHANG) == -1) {
+						if (errno != ECHILD) {
+							PERROR("waitid");
+						}
+						break;
+					}
+					if (siginfo.si_pid == 0) {
+						break;
+					}
+					for (i = 0; i < n_containers; i++) {
+						if (containers[i].pid ==
+						    siginfo.si_pid) {
+							daemon_exited(epoll_fd,
+								      &containers
+								      [i],
+								      &siginfo);
+							break;
+						}
+					}
+				}
+			} else if (events[j].data.u32 == POOL_EVENT_CONNECTION) {
+				while (1) {
+					data_socket =
+					    accept4(connection_socket, NULL,
+						    NULL,
+						    SOCK_NONBLOCK |
+						    SOCK_CLOEXEC);
+					if (data_socket == -1) {
+						if (errno != EAGAIN
+						    && errno != EWOULDBLOCK
+						    && errno != EINTR) {
+							PERROR("accept4");
+						}
+						break;
+					}
+					LOG("accepted daemon connection on %d\n", data_socket);
+					if (daemon_add
+					    (epoll_fd, &containers,
+					     &n_containers, data_socket)) {
+						if (close(data_socket) == -1) {
+							PERROR
+							    ("close data socket");
+						}
+					}
+				}
+			} else if (tag == POOL_EVENT_CLIENT) {
+				if (index >= n_containers
+				    || containers[index].fd < 0) {
+					continue;
+				}
+				container = &containers[index];
+				if (container->state == DAEMON_RUNNING) {
+					/* the client hung up (or misbehaved) */
+					LOG("lost daemon client %d, stopping worker %d\n", container->fd, (int)container->pid);
+					if (kill(container->pid, SIGTERM)) {
+						PERROR("kill");
+					}
+					daemon_remove(epoll_fd, container);
+					continue;
+				}
+				if (daemon_handle_client(container)) {
+					daemon_remove(epoll_fd, container);
+				} else if (container->state == DAEMON_RUNNING
+					   && daemon_spawn(container,
+							   containers,
+							   n_containers,
+							   plan_cache,
+							   connection_socket,
+							   epoll_fd,
+							   signal_fd)) {
+					daemon_remove(epoll_fd, container);
+				}
+			}
+		}
+	}
+
+	LOG("daemon received %s, shutting down\n", strsignal(signum));
+	for (i = 0; i < n_containers; i++) {
+		if (containers[i].pid > 0) {
+			if (kill(containers[i].pid, signum)) {
+				PERROR("kill");
+			}
+		}
+	}
+	for (i = 0; i < n_containers; i++) {
+		if (containers[i].pid > 0) {
+			while (waitid
+			       (P_PID, containers[i].pid, &siginfo,
+				WEXITED) == -1) {
+				if (errno != EINTR) {
+					PERROR("waitid");
+					containers[i].pid = -1;
+					break;
+				}
+			}
+			if (containers[i].pid > 0) {
+				daemon_exited(epoll_fd, &containers[i],
+					      &siginfo);
+			}
+		}
+	}
+
+ cleanup:
+	for (i = 0; i < n_containers; i++) {
+		daemon_remove(-1, &containers[i]);
+	}
+	if (containers) {
+		free(containers);
+	}
+	if (epoll_fd >= 0) {
+		if (close(epoll_fd) == -1) {
+			PERROR("close epoll file descriptor");
+			err = 1;
+		}
+	}
+	if (signal_fd >= 0) {
+		if (close(signal_fd) == -1) {
+			PERROR("close signal file descriptor");
+			err = 1;
+		}
+	}
+	if (connection_socket >= 0) {
+		if (close(connection_socket) == -1) {
+			PERROR("close connection socket");
+			err = 1;
+		}
+		LOG("unlink connection socket at %s\n", socket_path);
+		if (unlink(socket_path) == -1) {
+			PERROR("unlink");
+			err = 1;
+		}
+	}
+	return err;
+}
+
+static int daemon_add(int epoll_fd, daemon_container_t ** containers,
+		      size_t * n_containers, int data_socket)
+{
+	struct epoll_event event;
+	daemon_container_t *new_containers, *container = NULL;
+	size_t i;
+
+	for (i = 0; i < *n_containers; i++) {
+		if ((*containers)[i].fd < 0 && (*containers)[i].pid <= 0) {
+			container = &(*containers)[i];
+			break;
+		}
+	}
+
+	if (!container) {
+		new_containers =
+		    realloc(*containers,
+			    sizeof(daemon_container_t) * (*n_containers + 10));
+		if (!new_containers) {
+			PERROR("realloc");
+			return 1;
+		}
+		for (i = *n_containers; i < *n_containers + 10; i++) {
+			new_containers[i].fd = -1;
+			new_containers[i].pid = -1;
+			memset(&new_containers[i].config, 0,
+			       sizeof(message_buffer_t));
+		}
+		container = &new_containers[*n_containers];
+		*containers = new_containers;
+		*n_containers += 10;
+	}
+
+	container->fd = data_socket;
+	container->stdio[0] = container->stdio[1] = container->stdio[2] = -1;
+	container->state = DAEMON_READ_CONFIG;
+	container->pid = -1;
+	memset(&container->config, 0, sizeof(message_buffer_t));
+
+	event.events = EPOLLIN;
+	event.data.u32 = POOL_EVENT_CLIENT | (uint32_t) (container - *containers);
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data_socket, &event) == -1) {
+		PERROR("epoll_ctl");
+		container->fd = -1;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* drop the client side of a container (the worker is reaped separately) */
+static void daemon_remove(int epoll_fd, daemon_container_t * container)
+{
+	int i;
+
+	if (container->fd >= 0) {
+		if (epoll_fd >= 0
+		    && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, container->fd,
+				 NULL) == -1) {
+			PERROR("epoll_ctl");
+		}
+		if (close(container->fd) == -1) {
+			PERROR("close data socket");
+		}
+		container->fd = -1;
+	}
+	for (i = 0; i < 3; i++) {
+		if (container->stdio[i] >= 0) {
+			if (close(container->stdio[i]) == -1) {
+				PERROR("close client stdio");
+			}
+			container->stdio[i] = -1;
+		}
+	}
+	free_message(&container->config);
+}
+
+/*
+ * Read the config message and the three stdio descriptors that follow
+ * it.  Returns nonzero if the connection should be closed.  Sets
+ * container->state to DAEMON_RUNNING once the request is complete.
+ */
+static int daemon_handle_client(daemon_container_t * container)
+{
+	int i;
+
+	if (container->state == DAEMON_READ_CONFIG) {
+		switch (recv_message(container->fd, &container->config)) {
+		case 0:
+			return 0;	/* would block, or a frame is still arriving */
+		case 1:
+			break;
+		default:
+			return 1;
+		}
+		container->config.len =
+		    strnlen(container->config.data, container->config.len);
+		LOG("received config (%d bytes) on %d\n",
+		    (int)container->config.len, container->fd);
+		container->state = DAEMON_READ_STDIO;
+		return 0;
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (container->stdio[i] >= 0) {
+			continue;
+		}
+		if (recvfd(container->fd, &container->stdio[i]) == -1) {
+			container->stdio[i] = -1;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			LOG("failed to receive stdio file descriptor\n");
+			send_client_error(container->fd,
+					  "failed to receive stdio file descriptor");
+			return 1;
+		}
+	}
+	container->state = DAEMON_RUNNING;
+	return 0;
+}
+
+/* fork a worker for a complete request and confirm the launch */
+static int daemon_spawn(daemon_container_t * container,
+			daemon_container_t * containers, size_t n_containers,
+			const char *plan_cache, int connection_socket,
+			int epoll_fd, int signal_fd)
+{
+	struct iovec iov = { "\0", 1 };
+	struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
+	sigset_t mask;
+	size_t i;
+	pid_t pid;
+	int k;
+
+	pid = fork();
+	if (pid == -1) {
+		PERROR("fork");
+		send_client_error(container->fd, "failed to fork daemon worker");
+		return 1;
+	}
+
+	if (pid == 0) {		/* worker */
+		if (prctl(PR_SET_PDEATHSIG, SIGTERM)) {
+			PERROR("prctl");
+			_exit(1);
+		}
+		if (close(connection_socket) || close(epoll_fd)
+		    || close(signal_fd)) {
+			PERROR("close daemon file descriptor in worker");
+			_exit(1);
+		}
+		for (k = 0; k < 3; k++) {
+			if (dup2(container->stdio[k], k) == -1) {
+				PERROR("dup2");
+				_exit(1);
+			}
+		}
+		for (k = 0; k < 3; k++) {
+			if (container->stdio[k] > 2
+			    && close(container->stdio[k]) == -1) {
+				PERROR("close client stdio in worker");
+				_exit(1);
+			}
+			container->stdio[k] = -1;
+		}
+		for (i = 0; i < n_containers; i++) {
+			if (&containers[i] != container) {
+				daemon_remove(-1, &containers[i]);
+			}
+		}
+		if (close(container->fd) == -1) {
+			PERROR("close data socket in worker");
+			_exit(1);
+		}
+		container->fd = -1;
+		if (sigemptyset(&mask) == -1
+		    || sigprocmask(SIG_SETMASK, &mask, NULL) == -1) {
+			PERROR("sigprocmask");
+			_exit(1);
+		}
+		exit(daemon_launch(container, plan_cache));
+	}
+
+	container->pid = pid;
+	LOG("launched daemon worker %d for client %d\n", (int)pid,
+	    container->fd);
+	for (k = 0; k < 3; k++) {
+		if (close(container->stdio[k]) == -1) {
+			PERROR("close client stdio");
+		}
+		container->stdio[k] = -1;
+	}
+	free_message(&container->config);
+
+	if (sendmsg(container->fd, &msg, 0) == -1) {
+		PERROR("sendmsg");
+	}
+	return 0;
+}
+
+/* parse and run a daemon request's config in its worker */
+static int daemon_launch(daemon_container_t * container,
+			 const char *plan_cache)
+{
+	json_t *config;
+	json_error_t error;
+	uint64_t hash;
+	int err;
+
+	hash = hash_config(container->config.data, container->config.len);
+	if (plan_cache
+	    && load_plan(plan_cache, container->config.data,
+			 container->config.len, hash)) {
+		return 1;
+	}
+
+	config =
+	    json_loadb(container->config.data, container->config.len,
+		       JSON_REJECT_DUPLICATES, &error);
+	if (!config) {
+		LOG("error on daemon request:%d:%d: %s\n", error.line,
+		    error.column, error.text);
+		return 1;
+	}
+
+	err =
+	    prepare_config(config, "daemon request",
+			   plan_cache ? container->config.data : NULL,
+			   plan_cache ? container->config.len : 0, hash,
+			   plan_cache);
+	if (!err) {
+		err = run_container(config, NULL);
+	}
+
+	json_decref(config);
+	free_plan();
+	return err;
+}
+
+/* report a reaped worker's exit code to its client */
+static void daemon_exited(int epoll_fd, daemon_container_t * container,
+			  siginfo_t * siginfo)
+{
+	char buf[16];
+	int code, size;
+
+	code = wait_status(container->pid, "daemon worker", siginfo);
+	container->pid = -1;
+	if (container->fd < 0) {
+		return;
+	}
+
+	size = snprintf(buf, sizeof(buf), "%d", code);
+	if (size > 0 && (size_t) size < sizeof(buf)) {
+		send_client_error(container->fd, buf);
+	}
+	daemon_remove(epoll_fd, container);
+}
+
+/* create a SOCK_SEQPACKET socket bound to path */
+static int bind_socket(const char *path)
+{
+	struct sockaddr_un name;
+	int sock;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		PERROR("socket");
+		return -1;
+	}
+
+	memset(&name, 0, sizeof(struct sockaddr_un));
+	name.sun_family = AF_UNIX;
+	strncpy(name.sun_path, path, sizeof(name.sun_path) - 1);
+	LOG("bind connection socket to %s\n", path);
+	if (bind(sock, (const struct sockaddr *)&name,
+		 sizeof(struct sockaddr_un)) == -1) {
+		PERROR("bind");
+		if (close(sock) == -1) {
+			PERROR("close connection socket");
+		}
+		return -1;
+	}
+
+	return sock;
+}
+
+/* connect a SOCK_SEQPACKET socket to path */
+static int connect_socket(const char *path)
+{
+	struct sockaddr_un name;
+	int sock;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		PERROR("socket");
+		return -1;
+	}
+
+	memset(&name, 0, sizeof(struct sockaddr_un));
+	name.sun_family = AF_UNIX;
+	strncpy(name.sun_path, path, sizeof(name.sun_path) - 1);
+	if (connect(sock, (const struct sockaddr *)&name,
+		    sizeof(struct sockaddr_un)) == -1) {
+		PERROR("connect");
+		if (close(sock) == -1) {
+			PERROR("close socket");
+		}
+		return -1;
+	}
+
+	return sock;
+}
+
+static int get_namespace_type(const char *name, int *nstype)
+{
+	if (strncmp("mount", name, strlen("mount") + 1) == 0) {
+		*nstype = CLONE_NEWNS;
+	} else if (strncmp("cgroup", name, strlen("cgroup") + 1) == 0) {
+		*nstype = CLONE_NEWCGROUP;
+	} else if (strncmp("uts", name, strlen("uts") + 1) == 0) {
+		*nstype = CLONE_NEWUTS;
+	} else if (strncmp("ipc", name, strlen("ipc") + 1) == 0) {
+		*nstype = CLONE_NEWIPC;
+	} else if (strncmp("net", name, strlen("net") + 1) == 0) {
+		*nstype = CLONE_NEWNET;
+	} else if (strncmp("pid", name, strlen("pid") + 1) == 0) {
+		*nstype = CLONE_NEWPID;
+	} else if (strncmp("user", name, strlen("user") + 1) == 0) {
+		*nstype = CLONE_NEWUSER;
+	} else {
+		LOG("unrecognized namespace '%s'\n", name);
+		return 1;
+	}
+
+	return 0;
+}
+
+static const char *get_namespace_name(int nstype)
+{
+	switch (nstype) {
+	case CLONE_NEWNS:
+		return "mount";
+	case CLONE_NEWCGROUP:
+		return "cgroup";
+	case CLONE_NEWUTS:
+		return "uts";
+	case CLONE_NEWIPC:
+		return "ipc";
+	case CLONE_NEWNET:
+		return "net";
+	case CLONE_NEWPID:
+		return "pid";
+	case CLONE_NEWUSER:
+		return "user";
+	}
+	return "unknown";
+}
+
+static int get_clone_flags(json_t * config, int *flags)
+{
+	json_t *namespace, *value, *path;
+	const char *key;
+	int nstype;
+
+	namespace = json_object_get(config, "namespaces");
+	if (!namespace) {
+		return 0;
+	}
+
+	json_object_foreach(namespace, key, value) {
+		path = json_object_get(value, "path");
+		if (path) {
+			continue;
+		}
+		if (get_namespace_type(key, &nstype)) {
+			return 1;
+		}
+		*flags |= nstype;
+	}
+
+	return 0;
+}
+
+/* join the user namespace first, so it covers the other setns(2) calls */
+static int join_namespaces(namespace_fd_t * namespace_fds)
+{
+	int i;
+
+	if (!namespace_fds) {
+		return 0;
+	}
+
+	for (i = 0; namespace_fds[i].type; i++) {
+		if (namespace_fds[i].type == CLONE_NEWUSER) {
+			if (join_namespace(&namespace_fds[i])) {
+				return 1;
+			}
+		}
+	}
+
+	for (i = 0; namespace_fds[i].type; i++) {
+		if (namespace_fds[i].type == CLONE_NEWUSER) {
+			continue;	/* already handled */
+		}
+		if (join_namespace(&namespace_fds[i])) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int join_namespace(namespace_fd_t * namespace_fd)
+{
+	LOG("join %s namespace\n", get_namespace_name(namespace_fd->type));
+	if (setns(namespace_fd->fd, namespace_fd->type) == -1) {
+		PERROR("setns");
+		return 1;
+	}
+	if (close(namespace_fd->fd) == -1) {
+		PERROR("close");
+		namespace_fd->fd = -1;
+		return 1;
+	}
+	namespace_fd->fd = -1;
+
+	return 0;
+}
+
+static int get_user_mappings(json_t * config, user_mappings_t * mappings)
+{
+	json_t *namespaces, *user, *value;
+	const char *uid_helper = NULL, *gid_helper = NULL;
+
+	namespaces = json_object_get(config, "namespaces");
+	if (!namespaces) {
+		return 0;
+	}
+
+	user = json_object_get(namespaces, "user");
+	if (!user) {
+		return 0;
+	}
+
+	value = json_object_get(user, "setgroups");
+	if (value) {
+		if (json_boolean_value(value)) {
+			mappings->setgroups = "allow";
+		} else {
+			mappings->setgroups = "deny";
+		}
+	}
+
+	value = json_object_get(user, "mappingHelpers");
+	if (value && json_boolean_value(value)) {
+		uid_helper = "newuidmap";
+		gid_helper = "newgidmap";
+	}
+
+	if (get_user_map
+	    (user, "uidMappings", uid_helper, &mappings->uid, mappings->pid)) {
+		return 1;
+	}
+
+	if (get_user_map
+	    (user, "gidMappings", gid_helper, &mappings->gid, mappings->pid)) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static int get_user_map(json_t * user, const char *key, const char *helper,
+			user_map_t * map, char *pid)
+{
+	json_t *mappings, *mapping, *value;
+	FILE *stream;
+	char *token, *saveptr = NULL;
+	size_t i;
+	uid_t host, container;
+	int err = 0, size;
+
+	mappings = json_object_get(user, key);
+	if (!mappings) {
+		return 0;
+	}
+
+	stream = open_memstream(&map->buf, &map->len);
+	if (!stream) {
+		PERROR("open_memstream");
+		return 1;
+	}
+
+	json_array_foreach(mappings, i, mapping) {
+		value = json_object_get(mapping, "containerID");
+		if (!value) {
+			LOG("failed to get namespaces.user.%s[%d].containerID\n", key, (int)i);
+			err = 1;
+			goto cleanup;
+		}
+		container = (uid_t) json_integer_value(value);
+
+		value = json_object_get(mapping, "hostID");
+		if (!value) {
+			LOG("failed to get namespaces.user.%s[%d].hostID\n",
+			    key, (int)i);
+			err = 1;
+			goto cleanup;
+		}
+		host = (uid_t) json_integer_value(value);
+
+		value = json_object_get(mapping, "size");
+		if (!value) {
+			LOG("failed to get namespaces.user.%s[%d].size\n", key,
+			    (int)i);
+			err = 1;
+			goto cleanup;
+		}
+		size = (int)json_integer_value(value);
+
+		if (fprintf
+		    (stream, "%u %u %d\n", (unsigned int)container,
+		     (unsigned int)host, size) < 0) {
+			LOG("failed to format namespaces.user.%s[%d]\n", key,
+			    (int)i);
+			err = 1;
+			goto cleanup;
+		}
+	}
+
+ cleanup:
+	if (fclose(stream)) {
+		PERROR("fclose");
+		err = 1;
+	}
+	if (err || !helper || !map->len) {
+		return err;
+	}
+
+	/* helper, pid, and three arguments per mapping */
+	map->argv = calloc(3 * json_array_size(mappings) + 3, sizeof(char *));
+	if (!map->argv) {
+		PERROR("calloc");
+		return 1;
+	}
+	map->argv[0] = (char *)helper;
+	map->argv[1] = pid;
+	i = 2;
+	for (token = strtok_r(map->buf, " \n", &saveptr); token;
+	     token = strtok_r(NULL, " \n", &saveptr)) {
+		map->argv[i++] = token;
+	}
+
+	return 0;
+}
+
+static void free_user_mappings(user_mappings_t * mappings)
+{
+	user_map_t *maps[] = { &mappings->uid, &mappings->gid, NULL };
+	int i;
+
+	for (i = 0; maps[i]; i++) {
+		if (maps[i]->argv) {
+			free(maps[i]->argv);
+			maps[i]->argv = NULL;
+		}
+		if (maps[i]->buf) {
+			free(maps[i]->buf);
+			maps[i]->buf = NULL;
+		}
+	}
+	return;
+}
+
+static int set_user_namespace_mappings(user_mappings_t * mappings, pid_t cpid)
+{
+	int size;
+
+	size =
+	    snprintf(mappings->pid, sizeof(mappings->pid), "%lu",
+		     (unsigned long int)cpid);
+	if (size < 0 || (size_t) size >= sizeof(mappings->pid)) {
+		LOG("failed to format container PID %lu\n",
+		    (unsigned long int)cpid);
+		return 1;
+	}
+
+	if (mappings->uid.argv) {
+		if (run_user_map_helper(&mappings->uid)) {
+			return 1;
+		}
+	} else if (set_user_map(&mappings->uid, cpid, "uid_map")) {
+		return 1;
+	}
+
+	if (set_user_setgroups(mappings->setgroups, cpid)) {
+		return 1;
+	}
+
+	if (mappings->gid.argv) {
+		if (run_user_map_helper(&mappings->gid)) {
+			return 1;
+		}
+	} else if (set_user_map(&mappings->gid, cpid, "gid_map")) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static int set_user_map(user_map_t * map, pid_t cpid, const char *filename)
+{
+	char path[MAX_PATH];
+	ssize_t n;
+	int err = 0, fd = -1, size;
+
+	if (!map->buf || !map->len) {
+		return 0;
+	}
+
+	size =
+	    snprintf(path, MAX_PATH, "/proc/%lu/%s", (unsigned long int)cpid,
+		     filename);
+	if (size < 0) {
+		LOG("failed to format /proc/%lu/%s\n", (unsigned long int)cpid,
+		    filename);
+		return 1;
+	}
+	if (size >= MAX_PATH) {
+		LOG("failed to format /proc/%lu/%s (needed a buffer with %d bytes)\n", (unsigned long int)cpid, filename, size);
+		return 1;
+	}
+
+	if (child_pid < 0) {
+		return 1;
+	}
+
+	fd = open(path, O_WRONLY);
+	if (fd == -1) {
+		PERROR("open");
+		return 1;
+	}
+
+	/* the kernel only accepts a single write(2) to uid_map and gid_map */
+	log_user_map("write", map, path);
+	n = write(fd, map->buf, map->len);
+	if (n == -1 || (size_t) n != map->len) {
+		log_user_map("failed to write", map, path);
+		err = 1;
+		goto cleanup;
+	}
+
+ cleanup:
+	if (fd >= 0) {
+		if (close(fd) == -1) {
+			PERROR("close");
+			err = 1;
+		}
+	}
+	return err;
+}
+
+static void log_user_map(const char *action, user_map_t * map,
+			 const char *path)
+{
+	char *line, *end, *next;
+
+	end = map->buf + map->len;
+	for (line = map->buf; line < end; line = next + 1) {
+		next = memchr(line, '\n', end - line);
+		if (!next) {
+			next = end;
+		}
+		LOG("%s '%.*s' to %s\n", action, (int)(next - line), line,
+		    path);
+	}
+	return;
+}
+
+static int run_user_map_helper(user_map_t * map)
+{
+	if (child_pid < 0) {
+		return 1;
+	}
+
+	return run_helper(map->argv);
+}
+
+/*
+ * Fork and wait for a helper executable (a mapping helper or criu),
+ * restoring the caller's signal mask afterwards.
+ */
+static int run_helper(char **argv)
+{
+	sigset_t orig_mask;
+	pid_t hpid;
+	int i, err = 0;
+
+	LOG("run");
+	for (i = 0; argv[i]; i++) {
+		LOG(" %s", argv[i]);
+	}
+	LOG("\n");
+
+	if (sigprocmask(SIG_SETMASK, NULL, &orig_mask) == -1) {
+		PERROR("sigprocmask");
+		return 1;
+	}
+
+	if (block_signals() == -1) {
+		return 1;
+	}
+
+	hpid = fork();
+	if (hpid == -1) {
+		PERROR("fork");
+		(void)sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+		return 1;
+	}
+
+	if (hpid == 0) {	/* child */
+		if (prctl(PR_SET_PDEATHSIG, SIGKILL)) {
+			PERROR("prctl");
+			_exit(1);
+		}
+		if (uninstall_signal_handlers() || unblock_signals()) {
+			_exit(1);
+		}
+		execvp(argv[0], argv);
+		PERROR("execvp");
+		_exit(1);
+	}
+
+	hook_pids[0] = hpid;
+	if (sigprocmask(SIG_SETMASK, &orig_mask, NULL) == -1) {
+		PERROR("sigprocmask");
+		err = 1;
+	}
+	if (_wait(hpid, argv[0])) {
+		err = 1;
+	}
+	hook_pids[0] = -1;
+	return err;
+}
+
+static int set_user_setgroups(const char *value, pid_t cpid)
+{
+	char path[MAX_PATH];
+	int err = 0, fd = -1, size;
+
+	if (!value) {
+		return 0;
+	}
+
+	size =
+	    snprintf(path, MAX_PATH, "/proc/%lu/setgroups",
+		     (unsigned long int)cpid);
+	if (size < 0) {
+		LOG("failed to format /proc/%lu/setgroups\n",
+		    (unsigned long int)cpid);
+		return 1;
+	}
+	if (size >= MAX_PATH) {
+		LOG("failed to format /proc/%lu/setgroups (needed a buffer with %d bytes)\n", (unsigned long int)cpid, size);
+		return 1;
+	}
+
+	if (child_pid < 0) {
+		return 1;
+	}
+
+	LOG("write '%s' to %s\n", value, path);
+	fd = open(path, O_WRONLY);
+	if (fd == -1) {
+		PERROR("open");
+		return 1;
+	}
+
+	if (write(fd, value, strlen(value)) == -1) {
+		PERROR("write");
+		err = 1;
+		goto cleanup;
+	}
+
+ cleanup:
+	if (fd >= 0) {
+		if (close(fd) == -1) {
+			PERROR("close");
+			err = 1;
+		}
+	}
+	return err;
+}
+
+static int get_mount_flag(const char *name, unsigned long *flag)
+{
+	if (strncmp("MS_BIND", name, strlen("MS_BIND") + 1) == 0) {
+		*flag = MS_BIND;
+	} else if (strncmp("MS_DIRSYNC", name, strlen("MS_DIRSYNC") + 1) == 0) {
+		*flag = MS_DIRSYNC;
+	} else if (strncmp("MS_I_VERSION", name, strlen("MS_I_VERSION") + 1) ==
+		   0) {
+		*flag = MS_I_VERSION;
+#ifdef MS_LAZYTIME
+	} else if (strncmp("MS_LAZYTIME", name, strlen("MS_LAZYTIME") + 1) == 0) {
+		*flag = MS_LAZYTIME;
+#endif
+	} else if (strncmp("MS_MANDLOCK", name, strlen("MS_MANDLOCK") + 1) == 0) {
+		*flag = MS_MANDLOCK;
+	} else if (strncmp("MS_MOVE", name, strlen("MS_MOVE") + 1) == 0) {
+		*flag = MS_MOVE;
+	} else if (strncmp("MS_NOATIME", name, strlen("MS_NOATIME") + 1) == 0) {
+		*flag = MS_NOATIME;
+	} else if (strncmp("MS_NODEV", name, strlen("MS_NODEV") + 1) == 0) {
+		*flag = MS_NODEV;
+	} else if (strncmp("MS_NODIRATIME", name, strlen("MS_NODIRATIME") + 1)
+		   == 0) {
+		*flag = MS_NODIRATIME;
+	} else if (strncmp("MS_NOEXEC", name, strlen("MS_NOEXEC") + 1) == 0) {
+		*flag = MS_NOEXEC;
+	} else if (strncmp("MS_NOSUID", name, strlen("MS_NOSUID") + 1) == 0) {
+		*flag = MS_NOSUID;
+	} else if (strncmp("MS_PRIVATE", name, strlen("MS_PRIVATE") + 1) == 0) {
+		*flag = MS_PRIVATE;
+	} else if (strncmp("MS_RDONLY", name, strlen("MS_RDONLY") + 1) == 0) {
+		*flag = MS_RDONLY;
+	} else if (strncmp("MS_REC", name, strlen("MS_REC") + 1) == 0) {
+		*flag = MS_REC;
+	} else if (strncmp("MS_RELATIME", name, strlen("MS_RELATIME") + 1) == 0) {
+		*flag = MS_RELATIME;
+	} else if (strncmp("MS_REMOUNT", name, strlen("MS_REMOUNT") + 1) == 0) {
+		*flag = MS_REMOUNT;
+	} else if (strncmp("MS_SHARED", name, strlen("MS_SHARED") + 1) == 0) {
+		*flag = MS_SHARED;
+	} else if (strncmp("MS_SILENT", name, strlen("MS_SILENT") + 1) == 0) {
+		*flag = MS_SILENT;
+	} else if (strncmp("MS_SLAVE", name, strlen("MS_SLAVE") + 1) == 0) {
+		*flag = MS_SLAVE;
+	} else if (strncmp("MS_STRICTATIME", name, strlen("MS_STRICTATIME") + 1)
+		   == 0) {
+		*flag = MS_STRICTATIME;
+#ifdef MS_SYNC
+	} else if (strncmp("MS_SYNC", name, strlen("MS_SYNC") + 1) == 0) {
+		*flag = MS_SYNC;
+#endif
+	} else if (strncmp("MS_SYNCHRONOUS", name, strlen("MS_SYNCHRONOUS") + 1)
+		   == 0) {
+		*flag = MS_SYNCHRONOUS;
+	} else if (strncmp("MS_UNBINDABLE", name, strlen("MS_UNBINDABLE") + 1)
+		   == 0) {
+		*flag = MS_UNBINDABLE;
+#ifdef MS_VERBOSE
+	} else if (strncmp("MS_VERBOSE", name, strlen("MS_VERBOSE") + 1) == 0) {
+		*flag = MS_VERBOSE;
+#endif
+	} else {
+		LOG("unrecognized mount flag '%s'\n", name);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int handle_mounts(json_t * config)
+{
+	struct stat buf;
+	json_t *namespaces, *mt_ns, *mounts, *mt, *v1;
+	const char *source, *target, *type, *data;
+	char cwd[MAX_PATH], full_source[MAX_PATH], full_target[MAX_PATH];
+	char overlay_data[OVERLAY_DATA_SIZE];
+	dir_cache_t dir_cache;
+	unsigned long flags;
+	size_t i;
+	int size, mkdir, optional, status, err = 0;
+
+	namespaces = json_object_get(config, "namespaces");
+	if (!namespaces) {
+		return 0;
+	}
+
+	mt_ns = json_object_get(namespaces, "mount");
+	if (!mt_ns) {
+		return 0;
+	}
+
+	mounts = json_object_get(mt_ns, "mounts");
+	if (!mounts) {
+		return 0;
+	}
+
+	if (json_array_size(mounts) != config_plan->mount_count) {
+		LOG("namespaces.mount.mounts does not match the config plan\n");
+		return 1;
+	}
+
+	if (!getcwd(cwd, MAX_PATH)) {
+		PERROR("getcwd");
+		return 1;
+	}
+	if (cwd[0] != '/') {
+		LOG("current working directory is unreachable: %s\n", cwd);
+		return 1;
+	}
+
+	memset(&dir_cache, 0, sizeof(dir_cache));
+
+	json_array_foreach(mounts, i, mt) {
+		source = target = type = data = NULL;
+		v1 = json_object_get(mt, "source");
+		if (v1) {
+			source = json_string_value(v1);
+			if (source[0] == '/') {
+				if (strlen(source) >= MAX_PATH) {
+					LOG("mount path %s is too long (%d >= %d)\n", source, (int)strlen(source), MAX_PATH);
+					err = 1;
+					goto cleanup;
+				}
+				memcpy(full_source, source, strlen(source));
+			} else {
+				size =
+				    snprintf(full_source, MAX_PATH, "%s/%s",
+					     cwd, source);
+				if (size < 0) {
+					LOG("failed to format %s/%s\n", cwd,
+					    source);
+					err = 1;
+					goto cleanup;
+				}
+				if (size >= MAX_PATH) {
+					LOG("failed to format %s/%s (needed a buffer with %d bytes)\n", cwd, source, size);
+					err = 1;
+					goto cleanup;
+				}
+				source = full_source;
+			}
+		}
+
+		v1 = json_object_get(mt, "target");
+		if (v1) {
+			target = json_string_value(v1);
+			if (target[0] == '/') {
+				if (strlen(target) >= MAX_PATH) {
+					LOG("mount path %s is too long (%d >= %d)\n", target, (int)strlen(target), MAX_PATH);
+					err = 1;
+					goto cleanup;
+				}
+			} else {
+				size =
+				    snprintf(full_target, MAX_PATH, "%s/%s",
+					     cwd, target);
+				if (size < 0) {
+					LOG("failed to format %s/%s\n", cwd,
+					    target);
+					err = 1;
+					goto cleanup;
+				}
+				if (size >= MAX_PATH) {
+					LOG("failed to format %s/%s (needed a buffer with %d bytes)\n", cwd, target, size);
+					err = 1;
+					goto cleanup;
+				}
+				target = full_target;
+			}
+		}
+
+		v1 = json_object_get(mt, "type");
+		if (v1) {
+			type = json_string_value(v1);
+		}
+
+		v1 = json_object_get(mt, "data");
+		if (v1) {
+			data = json_string_value(v1);
+		}
+
+		if (json_object_get(mt, "layers")) {
+			if (get_overlay_data
+			    (mt, i, cwd, &dir_cache, overlay_data,
+			     sizeof(overlay_data))) {
+				err = 1;
+				goto cleanup;
+			}
+			data = overlay_data;
+			if (!type) {
+				type = "overlay";
+			}
+		}
+
+		flags = (unsigned long)config_plan->data[i];
+		optional = json_is_true(json_object_get(mt, "optional"));
+
+		if (type && strcmp(type, "minimal-dev") == 0) {
+			if (!target) {
+				LOG("failed to get namespaces.mount.mounts[%d].target\n", (int)i);
+				err = 1;
+				goto cleanup;
+			}
+			if (source || json_object_get(mt, "flags") || data) {
+				LOG("ignore source, flags, and data for minimal-dev mount %lu\n", (unsigned long int)i);
+			}
+			trace_event('B', "minimal-dev %lu", (unsigned long int)i);
+			if (mount_minimal_dev(&dir_cache, target)) {
+				if (!optional) {
+					err = 1;
+					goto cleanup;
+				}
+				LOG("skip optional mount %lu\n",
+				    (unsigned long int)i);
+			}
+			trace_event('E', "minimal-dev %lu", (unsigned long int)i);
+		} else if (type
+			   && strncmp("pivot-root", type,
+				      strlen("pivot-root")) == 0) {
+			trace_event('B', "pivot-root %lu", (unsigned long int)i);
+			/* every cached directory is under the old root */
+			dir_cache_flush(&dir_cache);
+			if (pivot_root_remove_old(source)) {
+				err = 1;
+				goto cleanup;
+			}
+			trace_event('E', "pivot-root %lu", (unsigned long int)i);
+		} else {
+			trace_event('B', "mount %lu", (unsigned long int)i);
+			mkdir = 1;
+			if (source) {
+				if (stat(source, &buf) == -1) {
+					PERROR("stat");
+					if (optional) {
+						LOG("skip optional mount %lu\n",
+						    (unsigned long int)i);
+						trace_event('E', "mount %lu",
+							    (unsigned long int)i);
+						continue;
+					}
+					err = 1;
+					goto cleanup;
+				}
+				if (flags | MS_BIND && !S_ISDIR(buf.st_mode)) {
+					mkdir = 0;
+				}
+			}
+			if (mkdir) {
+				if (mkdir_all(&dir_cache, target, 0777) == -1) {
+					err = 1;
+					goto cleanup;
+				}
+			} else if (mkfile_all(&dir_cache, target, 0777, 0666) ==
+				   -1) {
+				err = 1;
+				goto cleanup;
+			}
+
+			LOG("mount %lu: %s to %s (type: %s, flags: %lu, data %s)\n", (unsigned long int)i, source, target, type, flags, data);
+			status = mount_attach(source, target, type, flags, data);
+			if (status && !optional) {
+				err = 1;
+				goto cleanup;
+			} else if (status) {
+				LOG("skip optional mount %lu\n",
+				    (unsigned long int)i);
+			}
+			/* directories at and below target are now covered */
+			dir_cache_invalidate(&dir_cache, target);
+			trace_event('E', "mount %lu", (unsigned long int)i);
+		}
+	}
+
+ cleanup:
+	dir_cache_flush(&dir_cache);
+	return err;
+}
+
+/*
+ * Build overlayfs options for a mount entry with "layers".  Each
+ * layer is a directory, or an ALGORITHM:HEX digest naming
+ * {layer-cache}/ALGORITHM/HEX, so any number of containers can share
+ * one unpacked copy of an image (and its page cache) with only their
+ * upper directories to themselves.
+ */
+static int get_overlay_data(json_t * mt, size_t index, const char *cwd,
+			    dir_cache_t * dir_cache, char *data, size_t size)
+{
+	json_t *layers, *layer, *value;
+	const char *upper = NULL, *work = NULL, *extra = NULL;
+	char path[MAX_PATH];
+	size_t i, len = 0;
+	int n;
+
+	layers = json_object_get(mt, "layers");
+	if (!json_is_array(layers) || !json_array_size(layers)) {
+		LOG("namespaces.mount.mounts[%d].layers is not a non-empty array\n", (int)index);
+		return 1;
+	}
+
+	value = json_object_get(mt, "upper");
+	if (value) {
+		upper = json_string_value(value);
+	}
+	value = json_object_get(mt, "work");
+	if (value) {
+		work = json_string_value(value);
+	}
+	if (!upper != !work) {
+		LOG("namespaces.mount.mounts[%d] needs both upper and work, or neither\n", (int)index);
+		return 1;
+	}
+	value = json_object_get(mt, "data");
+	if (value) {
+		extra = json_string_value(value);
+	}
+
+	json_array_foreach(layers, i, layer) {
+		if (!json_string_value(layer)) {
+			LOG("failed to extract namespaces.mount.mounts[%d].layers[%d]\n", (int)index, (int)i);
+			return 1;
+		}
+		if (get_layer_path(json_string_value(layer), cwd, path)) {
+			return 1;
+		}
+		n = snprintf(data + len, size - len, "%s%s",
+			     i ? ":" : "lowerdir=", path);
+		if (n < 0 || (size_t) n >= size - len) {
+			goto overflow;
+		}
+		len += (size_t) n;
+	}
+
+	if (upper) {
+		if (get_overlay_path(upper, cwd, path)
+		    || mkdir_all(dir_cache, path, 0755) == -1) {
+			return 1;
+		}
+		n = snprintf(data + len, size - len, ",upperdir=%s", path);
+		if (n < 0 || (size_t) n >= size - len) {
+			goto overflow;
+		}
+		len += (size_t) n;
+
+		if (get_overlay_path(work, cwd, path)
+		    || mkdir_all(dir_cache, path, 0755) == -1) {
+			return 1;
+		}
+		n = snprintf(data + len, size - len, ",workdir=%s", path);
+		if (n < 0 || (size_t) n >= size - len) {
+			goto overflow;
+		}
+		len += (size_t) n;
+	}
+
+	if (extra) {
+		n = snprintf(data + len, size - len, ",%s", extra);
+		if (n < 0 || (size_t) n >= size - len) {
+			goto overflow;
+		}
+	}
+
+	return 0;
+
+ overflow:
+	LOG("namespaces.mount.mounts[%d] overlay options are longer than %d bytes\n", (int)index, (int)size - 1);
+	return 1;
+}
+
+static int get_layer_path(const char *layer, const char *cwd, char *path)
+{
+	const char *colon;
+	struct stat buf;
+	int size;
+
+	colon = strchr(layer, ':');
+	if (!colon || layer[0] == '/' || layer[0] == '.') {
+		return get_overlay_path(layer, cwd, path);
+	}
+
+	if (!layer_cache) {
+		LOG("layer %s needs --layer-cache\n", layer);
+		return 1;
+	}
+	if (colon == layer || !colon[1] || memchr(layer, '/', colon - layer)
+	    || strchr(colon + 1, '/')) {
+		LOG("invalid layer digest %s\n", layer);
+		return 1;
+	}
+
+	size = snprintf(path, MAX_PATH, "%s%s%s/%.*s/%s",
+			layer_cache[0] == '/' ? "" : cwd,
+			layer_cache[0] == '/' ? "" : "/", layer_cache,
+			(int)(colon - layer), layer, colon + 1);
+	if (size < 0 || size >= MAX_PATH) {
+		LOG("failed to format the cache path for layer %s\n", layer);
+		return 1;
+	}
+	if (strpbrk(path, ":,\\")) {
+		LOG("layer cache path %s contains ':', ',', or '\\'\n", path);
+		return 1;
+	}
+
+	if (stat(path, &buf) == -1 || !S_ISDIR(buf.st_mode)) {
+		LOG("layer %s is not in the layer cache (%s)\n", layer, path);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* absolute path for an overlay directory, which can't hold separators */
+static int get_overlay_path(const char *path, const char *cwd, char *full)
+{
+	int size;
+
+	if (strpbrk(path, ":,\\")) {
+		LOG("overlay directory %s contains ':', ',', or '\\'\n", path);
+		return 1;
+	}
+
+	if (path[0] == '/') {
+		size = snprintf(full, MAX_PATH, "%s", path);
+	} else {
+		size = snprintf(full, MAX_PATH, "%s/%s", cwd, path);
+	}
+	if (size < 0 || size >= MAX_PATH) {
+		LOG("failed to format the overlay path for %s\n", path);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int _wait(pid_t pid, const char *name)
+{
+	siginfo_t siginfo;
+	int err;
+
+	for (;;) {
+		err = waitid(P_PID, pid, &siginfo, WEXITED);
+		if (err == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			PERROR("waitid");
+			return 1;
+		}
+		break;
+	}
+
+	return wait_status(pid, name, &siginfo);
+}
+
+/*
+ * _wait for the container process, emitting --stats lines while it
+ * runs and servicing --checkpoint requests.  Like wait_hooks, SIGCHLD
+ * and SIGUSR1 are only unblocked inside ppoll(2), so the exit can't
+ * slip in before we sleep.  The last line is emitted before reaping,
+ * while /proc/{pid} still has the totals.
+ */
+static int wait_container(pid_t cpid)
+{
+	sigset_t mask, orig_mask, wait_mask;
+	struct timespec timeout;
+	int ms;
+
+	if (child_pidfd >= 0) {
+		return wait_container_pidfd(cpid);
+	}
+
+	if (stats_interval <= 0 && !checkpoint_dir) {
+		return _wait(cpid, "container");
+	}
+
+	if (sigemptyset(&mask) || sigaddset(&mask, SIGCHLD)
+	    || sigaddset(&mask, SIGUSR1)) {
+		PERROR("sigaddset");
+		return _wait(cpid, "container");
+	}
+	if (sigprocmask(SIG_BLOCK, &mask, &orig_mask) == -1) {
+		PERROR("sigprocmask");
+		return _wait(cpid, "container");
+	}
+	wait_mask = orig_mask;
+	if (sigdelset(&wait_mask, SIGCHLD) || sigdelset(&wait_mask, SIGUSR1)) {
+		PERROR("sigdelset");
+	} else {
+		while (1) {
+			/* reap_child must see criu's SIGCHLD while it's in hook_pids */
+			if (checkpoint_requested) {
+				(void)sigprocmask(SIG_SETMASK, &orig_mask,
+						  NULL);
+				checkpoint_tick();
+				(void)sigprocmask(SIG_BLOCK, &mask, NULL);
+			}
+			if (child_pid < 0) {
+				break;
+			}
+			ms = stats_timeout_ms();
+			timeout.tv_sec = ms / 1000;
+			timeout.tv_nsec = (long)(ms % 1000) * 1000000;
+			if (ppoll(NULL, 0, ms < 0 ? NULL : &timeout, &wait_mask)
+			    == -1 && errno != EINTR) {
+				PERROR("ppoll");
+				break;
+			}
+			stats_tick();
+		}
+	}
+	if (sigprocmask(SIG_SETMASK, &orig_mask, NULL) == -1) {
+		PERROR("sigprocmask");
+	}
+
+	if (stats_interval > 0) {
+		emit_stats(cpid);
+	}
+	return _wait(cpid, "container");
+}
+
+/*
+ * wait_container with the pidfd from clone3.  One poll(2) loop
+ * watches the pidfd for the exit and a signalfd for SIGHUP, SIGINT,
+ * and SIGTERM (and SIGUSR1 with --checkpoint), which it forwards (or
+ * services) synchronously, between --stats ticks.  Those signals stay
+ * blocked until the container is reaped with waitid(P_PIDFD), so none
+ * of them land in a handler halfway through the loop.  The handlers
+ * are still installed because setup, hooks, and the relays block
+ * outside this loop.
+ */
+static int wait_container_pidfd(pid_t cpid)
+{
+	struct pollfd fds[2];
+	struct signalfd_siginfo ssi;
+	sigset_t mask, orig_mask;
+	siginfo_t siginfo;
+	nfds_t nfds = 2;
+	ssize_t n;
+	int signal_fd = -1, err;
+
+	if (sigemptyset(&mask) || sigaddset(&mask, SIGHUP)
+	    || sigaddset(&mask, SIGINT) || sigaddset(&mask, SIGTERM)
+	    || (checkpoint_dir && sigaddset(&mask, SIGUSR1))) {
+		PERROR("sigaddset");
+		return _wait(cpid, "container");
+	}
+	if (sigprocmask(SIG_BLOCK, &mask, &orig_mask) == -1) {
+		PERROR("sigprocmask");
+		return _wait(cpid, "container");
+	}
+	signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (signal_fd == -1) {
+		PERROR("signalfd");
+		(void)sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+		nfds = 1;	/* the handlers forward signals instead */
+	}
+
+	fds[0].fd = child_pidfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = signal_fd;
+	fds[1].events = POLLIN;
+	checkpoint_tick();	/* a SIGUSR1 during setup */
+	while (1) {
+		if (poll(fds, nfds, stats_timeout_ms()) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			PERROR("poll");
+			break;
+		}
+		if (fds[0].revents) {
+			break;
+		}
+		if (nfds > 1 && (fds[1].revents & POLLIN)) {
+			n = read(signal_fd, &ssi, sizeof(ssi));
+			if (n != sizeof(ssi)) {
+				PERROR("read signal file descriptor");
+			} else if (ssi.ssi_signo == SIGUSR1) {
+				(void)checkpoint_container(cpid);
+			} else {
+				LOG("forward %s to the container process\n",
+				    strsignal((int)ssi.ssi_signo));
+				kill_children((int)ssi.ssi_signo, NULL, NULL);
+			}
+		}
+		stats_tick();
+	}
+
+	if (stats_interval > 0) {
+		emit_stats(cpid);
+	}
+	while ((err = waitid(P_PIDFD, (id_t) child_pidfd, &siginfo, WEXITED))
+	       == -1 && errno == EINTR) ;
+	if (err == -1) {
+		PERROR("waitid");
+		err = 1;
+	} else {
+		err = wait_status(cpid, "container", &siginfo);
+	}
+	child_pid = -1;
+
+	if (signal_fd >= 0) {
+		if (close(signal_fd) == -1) {
+			PERROR("close signal file descriptor");
+		}
+		if (sigprocmask(SIG_SETMASK, &orig_mask, NULL) == -1) {
+			PERROR("sigprocmask");
+		}
+	}
+	return err;
+}
+
+/* milliseconds until the next --stats line, or -1 without --stats */
+static int stats_timeout_ms()
+{
+	struct timespec now;
+	long ms;
+
+	if (stats_interval <= 0) {
+		return -1;
+	}
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	if (stats_next.tv_sec == 0 && stats_next.tv_nsec == 0) {
+		stats_next = now;
+		add_seconds(&stats_next, stats_interval);
+	}
+	if (!timespec_before(&now, &stats_next)) {
+		return 0;
+	}
+	ms = elapsed_ms(&now, &stats_next) + 1;
+	return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+static void stats_tick()
+{
+	struct timespec now;
+
+	if (stats_interval <= 0 || child_pid < 0) {
+		return;
+	}
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_before(&now, &stats_next)) {
+		return;
+	}
+	emit_stats(child_pid);
+	add_seconds(&stats_next, stats_interval);
+	if (timespec_before(&stats_next, &now)) {	/* don't burst after a stall */
+		stats_next = now;
+		add_seconds(&stats_next, stats_interval);
+	}
+}
+
+/*
+ * Write one JSON line of resource usage to the log file descriptor.
+ * Process counters describe the container process itself, and cgroup
+ * counters (with a configured cgroup) cover everything inside it.
+ */
+static void emit_stats(pid_t cpid)
+{
+	json_t *stats, *line;
+	struct timespec now;
+	char buf[4096], path[MAX_PATH], *p;
+	unsigned long long utime, stime, value;
+	long rss, threads, ticks, page;
+	char *string;
+	int i;
+
+	stats = json_object();
+	line = json_object();
+	if (!stats || !line || json_object_set_new(line, "stats", stats)) {
+		LOG("failed to allocate stats JSON\n");
+		json_decref(line);
+		return;
+	}
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	json_object_set_new(stats, "pid", json_integer(cpid));
+	json_object_set_new(stats, "monotonic-ns",
+			    json_integer((json_int_t) now.tv_sec * 1000000000 +
+					 now.tv_nsec));
+
+	/* fields after the parenthesized comm, see proc(5) */
+	(void)snprintf(path, sizeof(path), "/proc/%d/stat", (int)cpid);
+	if (read_stats_file(AT_FDCWD, path, buf, sizeof(buf)) > 0
+	    && (p = strrchr(buf, ')'))
+	    && sscanf(p + 2,
+		      "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu "
+		      "%*d %*d %*d %*d %ld %*d %*u %*u %ld", &utime, &stime,
+		      &threads, &rss) == 4) {
+		ticks = sysconf(_SC_CLK_TCK);
+		page = sysconf(_SC_PAGESIZE);
+		if (ticks > 0) {
+			json_object_set_new(stats, "cpu-usec",
+					    json_integer((json_int_t)
+							 ((utime + stime) *
+							  1000000 / ticks)));
+		}
+		json_object_set_new(stats, "threads", json_integer(threads));
+		json_object_set_new(stats, "rss-bytes",
+				    json_integer((json_int_t) rss * page));
+	}
+
+	(void)snprintf(path, sizeof(path), "/proc/%d/io", (int)cpid);
+	if (read_stats_file(AT_FDCWD, path, buf, sizeof(buf)) > 0) {
+		p = strstr(buf, "read_bytes: ");
+		if (p && sscanf(p, "read_bytes: %llu", &value) == 1) {
+			json_object_set_new(stats, "io-read-bytes",
+					    json_integer((json_int_t) value));
+		}
+		p = strstr(buf, "\nwrite_bytes: ");
+		if (p && sscanf(p, "\nwrite_bytes: %llu", &value) == 1) {
+			json_object_set_new(stats, "io-write-bytes",
+					    json_integer((json_int_t) value));
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		json_object_set_new(stats,
+				    i ? "relay-out-bytes" : "relay-in-bytes",
+				    json_integer((json_int_t) relay_bytes[i]));
+	}
+
+	add_cgroup_stats(stats);
+
+	string = json_dumps(line, JSON_COMPACT);
+	if (!string) {
+		LOG("failed to serialize stats JSON\n");
+	} else {
+		log_flush();	/* keep the stats line in order */
+		if (log_fd >= 0 && dprintf(log_fd, "%s\n", string) < 0) {
+			PERROR("dprintf");
+		}
+		free(string);
+	}
+	json_decref(line);
+}
+
+/* read a small /proc or cgroup file into a null-terminated buffer */
+static ssize_t read_stats_file(int dir_fd, const char *path, char *buf,
+			       size_t size)
+{
+	ssize_t n, len = 0;
+	int fd;
+
+	fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;	/* e.g. a disabled cgroup controller */
+	}
+	while ((size_t) len < size - 1) {
+		n = read(fd, buf + len, size - 1 - (size_t) len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		len += n;
+	}
+	buf[len] = '\0';
+	if (close(fd) == -1) {
+		PERROR("close stats file");
+	}
+	return len;
+}
+
+static void add_cgroup_stats(json_t * stats)
+{
+	json_t *cgroup;
+	char buf[4096], *line, *p, *saveptr = NULL;
+	unsigned long long value, rbytes = 0, wbytes = 0;
+	int io = 0;
+
+	if (stats_cgroup_fd < 0) {
+		return;
+	}
+
+	cgroup = json_object();
+	if (!cgroup) {
+		return;
+	}
+	json_object_set_new(stats, "cgroup", cgroup);
+
+	if (read_stats_file(stats_cgroup_fd, "cpu.stat", buf, sizeof(buf)) > 0
+	    && sscanf(buf, "usage_usec %llu", &value) == 1) {
+		json_object_set_new(cgroup, "cpu-usec",
+				    json_integer((json_int_t) value));
+	}
+
+	if (read_stats_file
+	    (stats_cgroup_fd, "memory.current", buf, sizeof(buf)) > 0
+	    && sscanf(buf, "%llu", &value) == 1) {
+		json_object_set_new(cgroup, "memory-bytes",
+				    json_integer((json_int_t) value));
+	}
+
+	if (read_stats_file(stats_cgroup_fd, "pids.current", buf, sizeof(buf))
+	    > 0 && sscanf(buf, "%llu", &value) == 1) {
+		json_object_set_new(cgroup, "pids",
+				    json_integer((json_int_t) value));
+	}
+
+	/* one "MAJ:MIN rbytes=N wbytes=N ..." line per device */
+	if (read_stats_file(stats_cgroup_fd, "io.stat", buf, sizeof(buf)) >= 0) {
+		io = 1;
+		for (line = strtok_r(buf, "\n", &saveptr); line;
+		     line = strtok_r(NULL, "\n", &saveptr)) {
+			p = strstr(line, " rbytes=");
+			if (p && sscanf(p, " rbytes=%llu", &value) == 1) {
+				rbytes += value;
+			}
+			p = strstr(line, " wbytes=");
+			if (p && sscanf(p, " wbytes=%llu", &value) == 1) {
+				wbytes += value;
+			}
+		}
+	}
+	if (io) {
+		json_object_set_new(cgroup, "io-read-bytes",
+				    json_integer((json_int_t) rbytes));
+		json_object_set_new(cgroup, "io-write-bytes",
+				    json_integer((json_int_t) wbytes));
+	}
+}
+
+static int wait_status(pid_t pid, const char *name, siginfo_t * siginfo)
+{
+	int err = 1;
+
+	switch (siginfo->si_code) {
+	case CLD_EXITED:
+		err = siginfo->si_status;
+		LOG("%s process %d exited with %d\n", name, (int)pid, err);
+		break;
+	case CLD_KILLED:
+		LOG("%s killed (%s, %d)\n", name,
+		    strsignal(siginfo->si_status), siginfo->si_status);
+		break;
+	case CLD_DUMPED:
+		LOG("%s killed by signal %d and dumped core\n",
+		    name, siginfo->si_status);
+		break;
+	default:
+		LOG("unrecognized %s exit condition: %d\n", name,
+		    siginfo->si_code);
+	}
+
+	return err;
+}
+
+/*
+ * Attach a mount with the file-descriptor-based mount API: open_tree(2)
+ * for binds, fsopen(2) and fsmount(2) for new filesystems, and
+ * mount_setattr(2) for attribute and propagation changes, which covers
+ * a whole subtree in one call with MS_REC.  Nothing is attached until
+ * the final move_mount(2), so on any failure (including kernels older
+ * than 5.12) we return MOUNT_FALLBACK and handle_mounts retries with
+ * mount(2).
+ */
+static int mount_fd(const char *source, const char *target, const char *type,
+		    unsigned long flags, const char *data)
+{
+	mount_attr_t attr;
+	unsigned int at_recursive = 0;
+	int fs_fd = -1, mnt_fd = -1, err = MOUNT_FALLBACK;
+
+	memset(&attr, 0, sizeof(attr));
+	if (flags & MS_REC) {
+		at_recursive = AT_RECURSIVE;
+	}
+
+	if (flags & MS_MOVE) {
+		return MOUNT_FALLBACK;
+	}
+
+	if (flags & MS_REMOUNT) {
+		/* superblock remounts still need mount(2) */
+		if (!(flags & MS_BIND)
+		    || flags & ~(MS_REMOUNT | MS_BIND | MS_REC |
+				 MOUNT_ATTR_FLAGS)) {
+			return MOUNT_FALLBACK;
+		}
+		get_mount_attr(flags, &attr, 1);
+		if (syscall
+		    (__NR_mount_setattr, AT_FDCWD, target, at_recursive, &attr,
+		     sizeof(attr)) == -1) {
+			PERROR("mount_setattr");
+			goto cleanup;
+		}
+		err = 0;
+		goto cleanup;
+	}
+
+	if (flags & MOUNT_PROPAGATION_FLAGS) {
+		if (flags & ~(MOUNT_PROPAGATION_FLAGS | MS_REC)) {
+			return MOUNT_FALLBACK;
+		}
+		attr.propagation = flags & MOUNT_PROPAGATION_FLAGS;
+		if (syscall
+		    (__NR_mount_setattr, AT_FDCWD, target, at_recursive, &attr,
+		     sizeof(attr)) == -1) {
+			PERROR("mount_setattr");
+			goto cleanup;
+		}
+		err = 0;
+		goto cleanup;
+	}
+
+	if (flags & MS_BIND) {
+		if (!source || flags & ~(MS_BIND | MS_REC | MOUNT_ATTR_FLAGS)) {
+			return MOUNT_FALLBACK;
+		}
+		mnt_fd =
+		    (int)syscall(__NR_open_tree, AT_FDCWD, source,
+				 OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC |
+				 at_recursive);
+		if (mnt_fd == -1) {
+			PERROR("open_tree");
+			goto cleanup;
+		}
+		get_mount_attr(flags, &attr, 0);
+		if ((attr.attr_set || attr.attr_clr)
+		    && syscall(__NR_mount_setattr, mnt_fd, "",
+			       AT_EMPTY_PATH | at_recursive, &attr,
+			       sizeof(attr)) == -1) {
+			PERROR("mount_setattr");
+			goto cleanup;
+		}
+	} else if (type) {
+		if (flags & ~MOUNT_ATTR_FLAGS) {
+			return MOUNT_FALLBACK;
+		}
+		fs_fd = (int)syscall(__NR_fsopen, type, FSOPEN_CLOEXEC);
+		if (fs_fd == -1) {
+			PERROR("fsopen");
+			goto cleanup;
+		}
+		if (source
+		    && syscall(__NR_fsconfig, fs_fd, FSCONFIG_SET_STRING,
+			       "source", source, 0) == -1) {
+			PERROR("fsconfig");
+			goto cleanup;
+		}
+		if ((flags & MS_RDONLY)
+		    && syscall(__NR_fsconfig, fs_fd, FSCONFIG_SET_FLAG, "ro",
+			       NULL, 0) == -1) {
+			PERROR("fsconfig");
+			goto cleanup;
+		}
+		if (data && set_fs_options(fs_fd, data)) {
+			goto cleanup;
+		}
+		if (syscall(__NR_fsconfig, fs_fd, FSCONFIG_CMD_CREATE, NULL, NULL, 0)
+		    == -1) {
+			PERROR("fsconfig");
+			goto cleanup;
+		}
+		get_mount_attr(flags, &attr, 0);
+		mnt_fd =
+		    (int)syscall(__NR_fsmount, fs_fd, FSMOUNT_CLOEXEC,
+				 (unsigned int)attr.attr_set);
+		if (mnt_fd == -1) {
+			PERROR("fsmount");
+			goto cleanup;
+		}
+	} else {
+		return MOUNT_FALLBACK;
+	}
+
+	if (syscall
+	    (__NR_move_mount, mnt_fd, "", AT_FDCWD, target,
+	     MOVE_MOUNT_F_EMPTY_PATH) == -1) {
+		PERROR("move_mount");
+		goto cleanup;
+	}
+	err = 0;
+
+ cleanup:
+	if (err) {
+		LOG("fall back to mount(2) for %s\n", target);
+	}
+	if (mnt_fd >= 0) {
+		if (close(mnt_fd) == -1) {
+			PERROR("close mount file descriptor");
+		}
+	}
+	if (fs_fd >= 0) {
+		if (close(fs_fd) == -1) {
+			PERROR("close filesystem context");
+		}
+	}
+	return err;
+}
+
+/*
+ * Translate MS_* attribute flags.  Like mount(2) with MS_REMOUNT, a
+ * remount clears the attributes it doesn't set, and only touches the
+ * access-time setting if a flag asks for one.
+ */
+static void get_mount_attr(unsigned long flags, mount_attr_t * attr,
+			   int remount)
+{
+	attr->attr_set = 0;
+	attr->attr_clr = 0;
+	if (flags & MS_RDONLY) {
+		attr->attr_set |= MOUNT_ATTR_RDONLY;
+	}
+	if (flags & MS_NOSUID) {
+		attr->attr_set |= MOUNT_ATTR_NOSUID;
+	}
+	if (flags & MS_NODEV) {
+		attr->attr_set |= MOUNT_ATTR_NODEV;
+	}
+	if (flags & MS_NOEXEC) {
+		attr->attr_set |= MOUNT_ATTR_NOEXEC;
+	}
+	if (flags & MS_NODIRATIME) {
+		attr->attr_set |= MOUNT_ATTR_NODIRATIME;
+	}
+	if (flags & MS_STRICTATIME) {	/* wins, as with mount(2) */
+		attr->attr_set |= MOUNT_ATTR_STRICTATIME;
+	} else if (flags & MS_NOATIME) {
+		attr->attr_set |= MOUNT_ATTR_NOATIME;
+	}
+
+	/* changing the access-time setting requires clearing the old one */
+	if (flags & (MS_NOATIME | MS_RELATIME | MS_STRICTATIME)) {
+		attr->attr_clr |= MOUNT_ATTR__ATIME;
+	}
+
+	if (remount) {
+		attr->attr_clr |=
+		    (MOUNT_ATTR_RDONLY | MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV |
+		     MOUNT_ATTR_NOEXEC) & ~attr->attr_set;
+		if (flags & (MS_NOATIME | MS_NODIRATIME | MS_RELATIME |
+			     MS_STRICTATIME)) {
+			attr->attr_clr |= MOUNT_ATTR__ATIME |
+			    (MOUNT_ATTR_NODIRATIME & ~attr->attr_set);
+		}
+	}
+	return;
+}
+
+/* pass comma-separated mount(2) data to fsconfig(2) */
+static int set_fs_options(int fs_fd, const char *data)
+{
+	char *options, *option, *value, *saveptr = NULL;
+	int err = 0;
+
+	options = strdup(data);
+	if (!options) {
+		PERROR("strdup");
+		return 1;
+	}
+
+	for (option = strtok_r(options, ",", &saveptr); option;
+	     option = strtok_r(NULL, ",", &saveptr)) {
+		value = strchr(option, '=');
+		if (value) {
+			*value++ = '\0';
+			err =
+			    syscall(__NR_fsconfig, fs_fd, FSCONFIG_SET_STRING,
+				    option, value, 0) == -1;
+		} else {
+			err =
+			    syscall(__NR_fsconfig, fs_fd, FSCONFIG_SET_FLAG,
+				    option, NULL, 0) == -1;
+		}
+		if (err) {
+			PERROR("fsconfig");
+			LOG("failed to set mount option %s\n", option);
+			break;
+		}
+	}
+
+	free(options);
+	return err;
+}
+
+/*
+ * mount_fd, falling back to mount(2).  mount(2) ignores attribute
+ * flags like MS_RDONLY on a new bind, while mount_fd applies them, so
+ * the fallback follows a bind with an MS_REMOUNT to get the same mount
+ * on either path.
+ */
+static int mount_attach(const char *source, const char *target,
+			const char *type, unsigned long flags,
+			const char *data)
+{
+	int status;
+
+	status = mount_fd(source, target, type, flags, data);
+	if (status == MOUNT_FALLBACK) {
+		if (mount(source, target, type, flags, data) == -1) {
+			PERROR("mount");
+			return 1;
+		}
+		if ((flags & MS_BIND) && !(flags & MS_REMOUNT)
+		    && (flags & MOUNT_ATTR_FLAGS)) {
+			LOG("remount %s with bind attributes\n", target);
+			if (mount(NULL, target, NULL,
+				  MS_REMOUNT | MS_BIND |
+				  (flags & MOUNT_ATTR_FLAGS), NULL) == -1) {
+				PERROR("mount");
+				return 1;
+			}
+		}
+		return 0;
+	}
+	return status;
+}
+
+/*
+ * Build the /dev most programs need on a fresh tmpfs at target, instead
+ * of binding the host's whole /dev or mounting each node from the
+ * config: null, zero, full, random, urandom, and tty, the fd and stdio
+ * symlinks, and a private devpts instance with its ptmx.  The nodes
+ * are created with mknodat(2) relative to one directory descriptor.
+ * Inside a user namespace, where the kernel refuses mknod(2), they are
+ * bind-mounted from the host's /dev instead.
+ */
+static int mount_minimal_dev(dir_cache_t * dir_cache, const char *target)
+{
+	static const dev_node_t nodes[] = {
+		{"null", 1, 3},
+		{"zero", 1, 5},
+		{"full", 1, 7},
+		{"random", 1, 8},
+		{"urandom", 1, 9},
+		{"tty", 5, 0},
+		{NULL},
+	};
+	static const char *links[][2] = {
+		{"fd", "/proc/self/fd"},
+		{"stdin", "/proc/self/fd/0"},
+		{"stdout", "/proc/self/fd/1"},
+		{"stderr", "/proc/self/fd/2"},
+		{"ptmx", "pts/ptmx"},
+		{NULL},
+	};
+	char pts[MAX_PATH];
+	mode_t mask;
+	int i, size, bind = 0, dev_fd = -1, err = 0;
+
+	size = snprintf(pts, MAX_PATH, "%s/pts", target);
+	if (size < 0 || size >= MAX_PATH) {
+		LOG("failed to format %s/pts\n", target);
+		return 1;
+	}
+
+	if (mkdir_all(dir_cache, target, 0777) == -1) {
+		return 1;
+	}
+
+	LOG("mount minimal /dev on %s\n", target);
+	if (mount_attach
+	    ("tmpfs", target, "tmpfs", MS_NOSUID | MS_NOEXEC,
+	     MINIMAL_DEV_DATA)) {
+		return 1;
+	}
+	dir_cache_invalidate(dir_cache, target);
+
+	mask = umask(0);
+	dev_fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dev_fd == -1) {
+		PERROR("open");
+		err = 1;
+		goto cleanup;
+	}
+
+	for (i = 0; nodes[i].name; i++) {
+		if (!bind) {
+			if (mknodat
+			    (dev_fd, nodes[i].name, S_IFCHR | 0666,
+			     makedev(nodes[i].major, nodes[i].minor)) == 0) {
+				continue;
+			}
+			if (errno != EPERM) {
+				PERROR("mknodat");
+				err = 1;
+				goto cleanup;
+			}
+			LOG("cannot create device nodes, bind them from /dev\n");
+			bind = 1;
+		}
+		if (bind_dev_node(dev_fd, target, nodes[i].name)) {
+			err = 1;
+			goto cleanup;
+		}
+	}
+
+	for (i = 0; links[i][0]; i++) {
+		if (symlinkat(links[i][1], dev_fd, links[i][0]) == -1) {
+			PERROR("symlinkat");
+			err = 1;
+			goto cleanup;
+		}
+	}
+
+	if (mkdirat(dev_fd, "pts", 0755) == -1) {
+		PERROR("mkdirat");
+		err = 1;
+		goto cleanup;
+	}
+	if (mount_attach
+	    ("devpts", pts, "devpts", MS_NOSUID | MS_NOEXEC,
+	     MINIMAL_DEV_PTS_DATA)) {
+		err = 1;
+		goto cleanup;
 	}
 
-	size =
-	    snprintf(path, MAX_PATH, "/proc/%lu/setgroups",
-		     (unsigned long int)cpid);
+ cleanup:
+	(void)umask(mask);
+	if (dev_fd >= 0 && close(dev_fd) == -1) {
+		PERROR("close");
+		err = 1;
+	}
+	if (err) {
+		/* don't leave a half-built /dev over target */
+		LOG("unmount minimal /dev from %s\n", target);
+		if (umount2(target, MNT_DETACH) == -1) {
+			PERROR("umount2");
+		}
+		dir_cache_invalidate(dir_cache, target);
+	}
+	return err;
+}
+
+/* bind the host's /dev/{name} onto an empty file in the new /dev */
+static int bind_dev_node(int dev_fd, const char *target, const char *name)
+{
+	char host[MAX_PATH], path[MAX_PATH];
+	int fd, tree_fd, moved = -1, size;
+
+	fd = openat(dev_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		    0666);
+	if (fd == -1) {
+		PERROR("openat");
+		return 1;
+	}
+	if (close(fd) == -1) {
+		PERROR("close");
+		return 1;
+	}
+
+	(void)snprintf(host, MAX_PATH, "/dev/%s", name);
+	tree_fd =
+	    (int)syscall(__NR_open_tree, AT_FDCWD, host,
+			 OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+	if (tree_fd == -1) {
+		PERROR("open_tree");
+	} else {
+		moved =
+		    (int)syscall(__NR_move_mount, tree_fd, "", dev_fd, name,
+				 MOVE_MOUNT_F_EMPTY_PATH);
+		if (moved == -1) {
+			PERROR("move_mount");
+		}
+		if (close(tree_fd) == -1) {
+			PERROR("close mount file descriptor");
+		}
+		if (moved == 0) {
+			return 0;
+		}
+	}
+	LOG("fall back to mount(2) for %s\n", host);
+
+	size = snprintf(path, MAX_PATH, "%s/%s", target, name);
+	if (size < 0 || size >= MAX_PATH) {
+		LOG("failed to format %s/%s\n", target, name);
+		return 1;
+	}
+	if (mount(host, path, NULL, MS_BIND, NULL) == -1) {
+		PERROR("mount");
+		return 1;
+	}
+	return 0;
+}
+
+static int pivot_root_remove_old(const char *new_root)
+{
+	char put_old[MAX_PATH];
+	char *old_basename;
+	int err = 0, size;
+
+	size = snprintf(put_old, MAX_PATH, "%s/pivot-root.XXXXXX", new_root);
 	if (size < 0) {
-		LOG("failed to format /proc/%lu/setgroups\n",
-		    (unsigned long int)cpid);
+		LOG("failed to format %s/pivot-root.XXXXXX", new_root);
 		return 1;
 	}
 	if (size >= MAX_PATH) {
-		LOG("failed to format /proc/%lu/setgroups (needed a buffer with %d bytes)\n", (unsigned long int)cpid, size);
+		LOG("failed to format %s/.pivot-root.XXXXXX (needed a buffer with %d bytes)\n", new_root, size);
 		return 1;
 	}
 
-	if (child_pid < 0) {
+	if (!mkdtemp(put_old)) {
+		PERROR("mkdtemp");
 		return 1;
 	}
 
-	LOG("write '%s' to %s\n", value, path);
-	fd = open(path, O_WRONLY);
-	if (fd == -1) {
-		PERROR("open");
+	if (chdir(new_root)) {
+		PERROR("chdir");
+		err = 1;
+		goto cleanup;
+	}
+
+	LOG("pivot root to %s\n", new_root);
+	if (syscall(SYS_pivot_root, new_root, put_old)) {
+		PERROR("pivot_root");
+		if (rmdir(put_old)) {
+			PERROR("rmdir");
+		}
 		return 1;
 	}
 
-	if (write(fd, value, strlen(value)) == -1) {
-		PERROR("write");
+	old_basename = basename(put_old);
+
+	if (chdir("/")) {
+		PERROR("chdir");
+		err = 1;
+		goto cleanup;
+	}
+
+	LOG("unmount old root from %s\n", old_basename);
+	if (umount2(old_basename, MNT_DETACH)) {
+		PERROR("umount");
 		err = 1;
 		goto cleanup;
 	}
 
  cleanup:
-	if (fd >= 0) {
-		if (close(fd) == -1) {
-			PERROR("close");
-			err = 1;
-		}
+	if (rmdir(old_basename)) {
+		PERROR("rmdir");
+		err = 1;
 	}
+
 	return err;
 }
 
-static int get_mount_flag(const char *name, unsigned long *flag)
+// Allocate a null-terminated array of strings from a JSON array.
+static char **json_array_of_strings_value(json_t * array)
 {
-	if (strncmp("MS_BIND", name, strlen("MS_BIND") + 1) == 0) {
-		*flag = MS_BIND;
-	} else if (strncmp("MS_DIRSYNC", name, strlen("MS_DIRSYNC") + 1) == 0) {
-		*flag = MS_DIRSYNC;
-	} else if (strncmp("MS_I_VERSION", name, strlen("MS_I_VERSION") + 1) ==
-		   0) {
-		*flag = MS_I_VERSION;
-#ifdef MS_LAZYTIME
-	} else if (strncmp("MS_LAZYTIME", name, strlen("MS_LAZYTIME") + 1) == 0) {
-		*flag = MS_LAZYTIME;
-#endif
-	} else if (strncmp("MS_MANDLOCK", name, strlen("MS_MANDLOCK") + 1) == 0) {
-		*flag = MS_MANDLOCK;
-	} else if (strncmp("MS_MOVE", name, strlen("MS_MOVE") + 1) == 0) {
-		*flag = MS_MOVE;
-	} else if (strncmp("MS_NOATIME", name, strlen("MS_NOATIME") + 1) == 0) {
-		*flag = MS_NOATIME;
-	} else if (strncmp("MS_NODEV", name, strlen("MS_NODEV") + 1) == 0) {
-		*flag = MS_NODEV;
-	} else if (strncmp("MS_NODIRATIME", name, strlen("MS_NODIRATIME") + 1)
-		   == 0) {
-		*flag = MS_NODIRATIME;
-	} else if (strncmp("MS_NOEXEC", name, strlen("MS_NOEXEC") + 1) == 0) {
-		*flag = MS_NOEXEC;
-	} else if (strncmp("MS_NOSUID", name, strlen("MS_NOSUID") + 1) == 0) {
-		*flag = MS_NOSUID;
-	} else if (strncmp("MS_PRIVATE", name, strlen("MS_PRIVATE") + 1) == 0) {
-		*flag = MS_PRIVATE;
-	} else if (strncmp("MS_RDONLY", name, strlen("MS_RDONLY") + 1) == 0) {
-		*flag = MS_RDONLY;
-	} else if (strncmp("MS_REC", name, strlen("MS_REC") + 1) == 0) {
-		*flag = MS_REC;
-	} else if (strncmp("MS_RELATIME", name, strlen("MS_RELATIME") + 1) == 0) {
-		*flag = MS_RELATIME;
-	} else if (strncmp("MS_REMOUNT", name, strlen("MS_REMOUNT") + 1) == 0) {
-		*flag = MS_REMOUNT;
-	} else if (strncmp("MS_SHARED", name, strlen("MS_SHARED") + 1) == 0) {
-		*flag = MS_SHARED;
-	} else if (strncmp("MS_SILENT", name, strlen("MS_SILENT") + 1) == 0) {
-		*flag = MS_SILENT;
-	} else if (strncmp("MS_SLAVE", name, strlen("MS_SLAVE") + 1) == 0) {
-		*flag = MS_SLAVE;
-	} else if (strncmp("MS_STRICTATIME", name, strlen("MS_STRICTATIME") + 1)
-		   == 0) {
-		*flag = MS_STRICTATIME;
-#ifdef MS_SYNC
-	} else if (strncmp("MS_SYNC", name, strlen("MS_SYNC") + 1) == 0) {
-		*flag = MS_SYNC;
-#endif
-	} else if (strncmp("MS_SYNCHRONOUS", name, strlen("MS_SYNCHRONOUS") + 1)
-		   == 0) {
-		*flag = MS_SYNCHRONOUS;
-	} else if (strncmp("MS_UNBINDABLE", name, strlen("MS_UNBINDABLE") + 1)
-		   == 0) {
-		*flag = MS_UNBINDABLE;
-#ifdef MS_VERBOSE
-	} else if (strncmp("MS_VERBOSE", name, strlen("MS_VERBOSE") + 1) == 0) {
-		*flag = MS_VERBOSE;
-#endif
-	} else {
-		LOG("unrecognized mount flag '%s'\n", name);
-		return 1;
+	const char **strings;
+	char **a = NULL;
+	json_t *value;
+	size_t i;
+
+	strings = malloc(sizeof(const char *) * (json_array_size(array) + 1));
+	if (!strings) {
+		PERROR("malloc");
+		return NULL;
+	}
+	json_array_foreach(array, i, value) {
+		strings[i] = json_string_value(value);
+		if (!strings[i]) {
+			goto cleanup;
+		}
 	}
+	a = pack_strings(strings, json_array_size(array));
 
-	return 0;
+ cleanup:
+	free(strings);
+	return a;
 }
 
-static int handle_mounts(json_t * config)
+/*
+ * Copy strings into a single allocation holding the null-terminated
+ * pointer array followed by the characters, so exec_process pays one
+ * malloc(3) per vector and a single free(3) releases it.
+ */
+static char **pack_strings(const char **strings, size_t count)
 {
-	struct stat buf;
-	json_t *namespaces, *mt_ns, *mounts, *mt, *v1, *v2;
-	const char *source, *target, *type, *data, *flag;
-	char cwd[MAX_PATH], full_source[MAX_PATH], full_target[MAX_PATH];
-	unsigned long flags, f;
-	size_t i, j;
-	int size, mkdir;
+	char **a, *next;
+	size_t i, len, size;
 
-	namespaces = json_object_get(config, "namespaces");
-	if (!namespaces) {
-		return 0;
+	size = sizeof(char *) * (count + 1);
+	for (i = 0; i < count; i++) {
+		size += strlen(strings[i]) + 1;
 	}
 
-	mt_ns = json_object_get(namespaces, "mount");
-	if (!mt_ns) {
-		return 0;
+	a = malloc(size);
+	if (!a) {
+		PERROR("malloc");
+		return NULL;
+	}
+	next = (char *)&a[count + 1];
+	for (i = 0; i < count; i++) {
+		len = strlen(strings[i]) + 1;
+		memcpy(next, strings[i], len);
+		a[i] = next;
+		next += len;
 	}
+	a[count] = NULL;
+	return a;
+}
 
-	mounts = json_object_get(mt_ns, "mounts");
-	if (!mounts) {
-		return 0;
+static int close_pipe(int pipe_fd[])
+{
+	int err = 0;
+
+	if (pipe_fd[0] >= 0) {
+		if (close(pipe_fd[0]) == -1) {
+			PERROR("close pipe read-end");
+			err = 1;
+		}
+		pipe_fd[0] = -1;
 	}
 
-	if (!getcwd(cwd, MAX_PATH)) {
-		PERROR("getcwd");
-		return 1;
+	if (pipe_fd[1] >= 0) {
+		if (close(pipe_fd[1]) == -1) {
+			PERROR("close pipe write-end");
+			err = 1;
+		}
+		pipe_fd[1] = -1;
 	}
-	if (cwd[0] != '/') {
-		LOG("current working directory is unreachable: %s\n", cwd);
-		return 1;
+
+	return err;
+}
+
+static int splice_pseudoterminal_master(int *master, int *slave)
+{
+	int err = RELAY_FALLBACK;
+
+	if (io_uring_relay) {
+		err = splice_pseudoterminal_master_uring(master, slave);
+	}
+	if (err == RELAY_FALLBACK) {
+		err = splice_pseudoterminal_master_epoll(master, slave);
+	}
+	if (err == RELAY_FALLBACK) {	/* don't LOG, it would interleave with relayed output */
+		err = splice_pseudoterminal_master_select(master, slave);
 	}
 
-	json_array_foreach(mounts, i, mt) {
-		source = target = type = data = NULL;
-		v1 = json_object_get(mt, "source");
-		if (v1) {
-			source = json_string_value(v1);
-			if (source[0] == '/') {
-				if (strlen(source) >= MAX_PATH) {
-					LOG("mount path %s is too long (%d >= %d)\n", source, (int)strlen(source), MAX_PATH);
-					return 1;
-				}
-				memcpy(full_source, source, strlen(source));
-			} else {
-				size =
-				    snprintf(full_source, MAX_PATH, "%s/%s",
-					     cwd, source);
-				if (size < 0) {
-					LOG("failed to format %s/%s\n", cwd,
-					    source);
-					return 1;
-				}
-				if (size >= MAX_PATH) {
-					LOG("failed to format %s/%s (needed a buffer with %d bytes)\n", cwd, source, size);
-					return 1;
+	if (*master >= 0) {
+		if (close(*master)) {
+			PERROR("close pseudoterminal master");
+		}
+		*master = -1;
+	}
+
+	if (slave && *slave >= 0) {
+		if (close(*slave)) {
+			PERROR("close pseudoterminal slave");
+		}
+		*slave = -1;
+	}
+
+	return err;
+}
+
+/*
+ * Relay through the same splice(2) pipes as the epoll relay, but
+ * queue each splice on an io_uring(7) instance instead of waiting for
+ * readiness and issuing it ourselves.  Each pass submits the next
+ * splice for every idle channel, the pidfd poll, and any --stats
+ * timeout, and waits for a completion, all with a single
+ * io_uring_enter(2).  Returns RELAY_FALLBACK (after flushing any data
+ * already in the pipes) if the kernel lacks io_uring or splice support
+ * for a file descriptor.
+ */
+static int splice_pseudoterminal_master_uring(int *master, int *slave)
+{
+	relay_channel_t channels[2], *channel;
+	io_ring_t ring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct __kernel_timespec timeout;
+	uint64_t tag;
+	int fds[3], busy[2] = { 0, 0 }, wait[2] = { 0, 0 };
+	int err = 0, exited = 0, watching = 0, timing = 0, i, n, res;
+
+	fds[0] = STDIN_FILENO;
+	fds[1] = *master;
+	fds[2] = STDOUT_FILENO;
+
+	memset(channels, 0, sizeof(channels));
+	for (i = 0; i < 2; i++) {
+		channels[i].pipe_fd[0] = channels[i].pipe_fd[1] = -1;
+		channels[i].open = 1;
+	}
+	channels[0].src = 0;	/* stdin -> master */
+	channels[0].dst = 1;
+	channels[1].src = 1;	/* master -> stdout */
+	channels[1].dst = 2;
+
+	if (io_ring_setup(&ring, RING_ENTRIES)) {
+		return RELAY_FALLBACK;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (pipe2(channels[i].pipe_fd, O_CLOEXEC) == -1) {
+			PERROR("pipe2");
+			err = RELAY_FALLBACK;
+			goto cleanup;
+		}
+		n = fcntl(channels[i].pipe_fd[1], F_GETPIPE_SZ);
+		channels[i].capacity = n > 0 ? (size_t) n : PIPE_BUF;
+	}
+
+	while (1) {
+		if (child_pid < 0 || exited) {	/* don't bother piping to a dead process */
+			channels[0].open = 0;
+			channels[0].pending = 0;
+			if (slave && *slave >= 0) {	/* don't hold the slave open either */
+				if (close(*slave)) {
+					PERROR("close pseudoterminal slave");
 				}
-				source = full_source;
+				*slave = -1;
 			}
 		}
 
-		v1 = json_object_get(mt, "target");
-		if (v1) {
-			target = json_string_value(v1);
-			if (target[0] == '/') {
-				if (strlen(target) >= MAX_PATH) {
-					LOG("mount path %s is too long (%d >= %d)\n", target, (int)strlen(target), MAX_PATH);
-					return 1;
-				}
-			} else {
-				size =
-				    snprintf(full_target, MAX_PATH, "%s/%s",
-					     cwd, target);
-				if (size < 0) {
-					LOG("failed to format %s/%s\n", cwd,
-					    target);
-					return 1;
+		if (!channels[0].open && !channels[0].pending
+		    && !channels[1].open && !channels[1].pending) {
+			break;
+		}
+
+		/* busy is 1 while filling a pipe and 2 while flushing it */
+		for (i = 0; i < 2; i++) {
+			channel = &channels[i];
+			if (busy[i] || !(channel->open || channel->pending)) {
+				continue;
+			}
+			if (wait[i]) {	/* the last splice hit EAGAIN */
+				sqe = io_ring_get_sqe(&ring);
+				if (!sqe) {
+					err = 1;
+					goto cleanup;
 				}
-				if (size >= MAX_PATH) {
-					LOG("failed to format %s/%s (needed a buffer with %d bytes)\n", cwd, target, size);
-					return 1;
+				sqe->opcode = IORING_OP_POLL_ADD;
+				sqe->flags = IOSQE_IO_LINK;
+				if (channel->pending) {
+					sqe->fd = fds[channel->dst];
+					sqe->poll32_events = POLLOUT;
+				} else {
+					sqe->fd = fds[channel->src];
+					sqe->poll32_events = POLLIN;
 				}
-				target = full_target;
+				sqe->user_data = RING_POLL + i;
+			}
+			sqe = io_ring_get_sqe(&ring);
+			if (!sqe) {
+				err = 1;
+				goto cleanup;
+			}
+			sqe->opcode = IORING_OP_SPLICE;
+			sqe->off = (uint64_t) - 1;
+			sqe->splice_off_in = (uint64_t) - 1;
+			sqe->splice_flags = SPLICE_F_MOVE;
+			sqe->user_data = (uint64_t) i;
+			if (channel->pending) {	/* flush pipe */
+				sqe->splice_fd_in = channel->pipe_fd[0];
+				sqe->fd = fds[channel->dst];
+				sqe->len = (unsigned int)channel->pending;
+				busy[i] = 2;
+			} else {	/* get new data */
+				sqe->splice_fd_in = fds[channel->src];
+				sqe->fd = channel->pipe_fd[1];
+				sqe->len = (unsigned int)channel->capacity;
+				busy[i] = 1;
 			}
 		}
 
-		v1 = json_object_get(mt, "type");
-		if (v1) {
-			type = json_string_value(v1);
+		/* the pidfd becomes readable when the container exits */
+		if (child_pidfd >= 0 && !exited && !watching) {
+			sqe = io_ring_get_sqe(&ring);
+			if (!sqe) {
+				err = 1;
+				goto cleanup;
+			}
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = child_pidfd;
+			sqe->poll32_events = POLLIN;
+			sqe->user_data = RING_EXIT;
+			watching = 1;
 		}
 
-		v1 = json_object_get(mt, "data");
-		if (v1) {
-			data = json_string_value(v1);
+		n = stats_timeout_ms();
+		if (n >= 0 && !timing) {
+			timeout.tv_sec = n / 1000;
+			timeout.tv_nsec = (long long)(n % 1000) * 1000000;
+			sqe = io_ring_get_sqe(&ring);
+			if (!sqe) {
+				err = 1;
+				goto cleanup;
+			}
+			sqe->opcode = IORING_OP_TIMEOUT;
+			sqe->addr = (uint64_t) (uintptr_t) & timeout;
+			sqe->len = 1;
+			sqe->user_data = RING_TIMEOUT;
+			timing = 1;
 		}
 
-		flags = 0;
-		v1 = json_object_get(mt, "flags");
-		if (v1) {
-			json_array_foreach(v1, j, v2) {
-				flag = json_string_value(v2);
-				if (!flag) {
-					LOG("failed to extract namespaces.mount.mounts[%d].flags[%d]\n", (int)i, (int)j);
-					return 1;
-				}
-				if (get_mount_flag(flag, &f)) {
-					return 1;
-				}
-				flags |= f;
+		n = io_ring_enter(&ring, 1);
+		stats_tick();
+		checkpoint_tick();
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
 			}
+			PERROR("io_uring_enter");
+			err = 1;
+			goto cleanup;
 		}
 
-		if (type
-		    && strncmp("pivot-root", type, strlen("pivot-root")) == 0) {
-			if (pivot_root_remove_old(source)) {
-				return 1;
+		while ((cqe = io_ring_peek(&ring))) {
+			tag = cqe->user_data;
+			res = cqe->res;
+			io_ring_advance(&ring);
+			if (tag == RING_EXIT) {
+				if (res < 0) {
+					errno = -res;
+					PERROR("poll container pidfd");
+					err = 1;
+					goto cleanup;
+				}
+				exited = 1;
+				continue;
 			}
-		} else {
-			mkdir = 1;
-			if (source) {
-				if (stat(source, &buf) == -1) {
-					PERROR("stat");
-					return 1;
+			if (tag == RING_TIMEOUT) {
+				timing = 0;
+				continue;
+			}
+			if (tag > 1) {
+				continue;	/* the linked splice reports for its poll */
+			}
+
+			i = (int)tag;
+			channel = &channels[i];
+			n = busy[i];
+			busy[i] = wait[i] = 0;
+			if (res == -EAGAIN) {
+				wait[i] = 1;
+				continue;
+			}
+			if (res == -EINTR || res == -ECANCELED) {
+				continue;
+			}
+			if (n == 1) {
+				if (!channel->open) {
+					continue;	/* the container exited */
 				}
-				if (flags | MS_BIND && !S_ISDIR(buf.st_mode)) {
-					mkdir = 0;
+				if (res == -EIO && fds[channel->src] == *master) {
+					channel->open = 0;
+				} else if (res == -EINVAL || res == -ENOSYS) {
+					err = RELAY_FALLBACK;
+					goto cleanup;
+				} else if (res < 0) {
+					errno = -res;
+					PERROR("splice into relay pipe");
+					err = 1;
+					goto cleanup;
+				} else if (res == 0) {	/* EOF */
+					channel->open = 0;
+				} else {
+					channel->pending = (size_t) res;
 				}
-			}
-			if (mkdir) {
-				if (mkdir_all(target, 0777) == -1) {
-					return 1;
+			} else {
+				if (!channel->pending) {
+					continue;	/* the container exited */
+				}
+				if (res == -EIO && fds[channel->dst] == *master) {
+					channel->open = 0;
+					channel->pending = 0;
+				} else if (res == -EINVAL || res == -ENOSYS) {
+					err = RELAY_FALLBACK;
+					goto cleanup;
+				} else if (res < 0) {
+					errno = -res;
+					PERROR("splice out of relay pipe");
+					err = 1;
+					goto cleanup;
+				} else if (res == 0) {
+					LOG("splice zero out of relay pipe\n");
+					err = 1;
+					goto cleanup;
+				} else {
+					channel->pending -= (size_t) res;
+					relay_bytes[channel->src] += (uint64_t) res;
 				}
-			} else if (mkfile_all(target, 0777, 0666) == -1) {
-				return 1;
 			}
+		}
+	}
 
-			LOG("mount %lu: %s to %s (type: %s, flags: %lu, data %s)\n", (unsigned long int)i, source, target, type, flags, data);
-			if (mount(source, target, type, flags, data) == -1) {
-				PERROR("mount");
-				return 1;
+ cleanup:
+	/* cancel in-flight splices, so nothing reads stdin after we return */
+	for (i = 0; i < 2; i++) {
+		if (!busy[i]) {
+			continue;
+		}
+		for (tag = (uint64_t) i; tag <= RING_POLL + (uint64_t) i;
+		     tag += RING_POLL) {
+			sqe = io_ring_get_sqe(&ring);
+			if (!sqe) {
+				err = 1;
+				busy[0] = busy[1] = 0;	/* don't wait */
+				break;
 			}
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = tag;
+			sqe->user_data = RING_CANCEL;
 		}
 	}
-
-	return 0;
-}
-
-static int _wait(pid_t pid, const char *name)
-{
-	siginfo_t siginfo;
-	int err;
-
-	for (;;) {
-		err = waitid(P_PID, pid, &siginfo, WEXITED);
-		if (err == -1) {
+	while (busy[0] || busy[1]) {
+		if (io_ring_enter(&ring, 1) == -1) {
 			if (errno == EINTR) {
 				continue;
 			}
-			PERROR("waitid");
-			return 1;
+			PERROR("io_uring_enter");
+			err = 1;
+			break;
+		}
+		while ((cqe = io_ring_peek(&ring))) {
+			tag = cqe->user_data;
+			res = cqe->res;
+			io_ring_advance(&ring);
+			if (tag > 1) {
+				continue;
+			}
+			i = (int)tag;
+			if (busy[i] == 1 && res > 0 && channels[i].open) {
+				channels[i].pending = (size_t) res;	/* for relay_drain */
+			} else if (busy[i] == 2 && res > 0) {
+				channels[i].pending -= (size_t) res;
+				relay_bytes[channels[i].src] += (uint64_t) res;
+			}
+			busy[i] = 0;
 		}
-		break;
 	}
-
-	err = 1;
-	switch (siginfo.si_code) {
-	case CLD_EXITED:
-		err = siginfo.si_status;
-		LOG("%s process %d exited with %d\n", name, (int)pid, err);
-		break;
-	case CLD_KILLED:
-		LOG("%s killed (%s, %d)\n", name,
-		    strsignal(siginfo.si_status), siginfo.si_status);
-		break;
-	case CLD_DUMPED:
-		LOG("%s killed by signal %d and dumped core\n",
-		    name, siginfo.si_status);
-		break;
-	default:
-		LOG("unrecognized %s exit condition: %d\n", name,
-		    siginfo.si_code);
+	for (i = 0; i < 2; i++) {
+		if (err == RELAY_FALLBACK && channels[i].pending) {
+			if (relay_drain(&channels[i], fds, *master)) {
+				err = 1;
+			}
+		}
+		if (close_pipe(channels[i].pipe_fd)) {
+			err = 1;
+		}
+	}
+	if (io_ring_close(&ring)) {
+		err = 1;
 	}
-
 	return err;
 }
 
-static int pivot_root_remove_old(const char *new_root)
+/*
+ * Set up an io_uring(7) instance and map its rings.  Fails quietly if
+ * the kernel doesn't provide io_uring (or a seccomp profile or the
+ * kernel.io_uring_disabled sysctl denies it), since callers fall back.
+ */
+static int io_ring_setup(io_ring_t * ring, unsigned int entries)
 {
-	char put_old[MAX_PATH];
-	char *old_basename;
-	int err = 0, size;
-
-	size = snprintf(put_old, MAX_PATH, "%s/pivot-root.XXXXXX", new_root);
-	if (size < 0) {
-		LOG("failed to format %s/pivot-root.XXXXXX", new_root);
-		return 1;
-	}
-	if (size >= MAX_PATH) {
-		LOG("failed to format %s/.pivot-root.XXXXXX (needed a buffer with %d bytes)\n", new_root, size);
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+	memset(&params, 0, sizeof(params));
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd == -1) {
+		if (errno != ENOSYS && errno != EPERM && errno != EINVAL) {
+			PERROR("io_uring_setup");
+		}
 		return 1;
 	}
 
-	if (!mkdtemp(put_old)) {
-		PERROR("mkdtemp");
-		return 1;
+	ring->sq_ring_size =
+	    params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size =
+	    params.cq_off.cqes +
+	    params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
 	}
 
-	if (chdir(new_root)) {
-		PERROR("chdir");
-		err = 1;
+	ring->sq_ring =
+	    mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		PERROR("mmap io_uring submission queue");
 		goto cleanup;
 	}
 
-	LOG("pivot root to %s\n", new_root);
-	if (syscall(SYS_pivot_root, new_root, put_old)) {
-		PERROR("pivot_root");
-		if (rmdir(put_old)) {
-			PERROR("rmdir");
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring =
+		    mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd,
+			 IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			PERROR("mmap io_uring completion queue");
+			goto cleanup;
 		}
-		return 1;
 	}
 
-	old_basename = basename(put_old);
-
-	if (chdir("/")) {
-		PERROR("chdir");
-		err = 1;
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes =
+	    mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		PERROR("mmap io_uring submission queue entries");
 		goto cleanup;
 	}
 
-	LOG("unmount old root from %s\n", old_basename);
-	if (umount2(old_basename, MNT_DETACH)) {
-		PERROR("umount");
-		err = 1;
-		goto cleanup;
-	}
+	ring->sq_head = (unsigned int *)((char *)ring->sq_ring +
+					  params.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_ring +
+					  params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)ring->sq_ring +
+					  params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_ring +
+					   params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+	ring->cq_head = (unsigned int *)((char *)ring->cq_ring +
+					  params.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_ring +
+					  params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)ring->cq_ring +
+					  params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring +
+					     params.cq_off.cqes);
+	ring->tail = *ring->sq_tail;
+	return 0;
 
  cleanup:
-	if (rmdir(old_basename)) {
-		PERROR("rmdir");
-		err = 1;
+	(void)io_ring_close(ring);
+	return 1;
+}
+
+/* queue a zeroed submission for the next io_ring_enter */
+static struct io_uring_sqe *io_ring_get_sqe(io_ring_t * ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int index;
+
+	if (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+	    ring->sq_entries) {
+		LOG("io_uring submission queue is full\n");
+		return NULL;
+	}
+	index = ring->tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->tail++;
+	return sqe;
+}
+
+/* submit queued entries and wait for at least min_complete completions */
+static int io_ring_enter(io_ring_t * ring, unsigned int min_complete)
+{
+	unsigned int submit;
+
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+	submit = ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (syscall(__NR_io_uring_enter, ring->fd, submit, min_complete,
+		    IORING_ENTER_GETEVENTS, NULL, 0) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/* the oldest unconsumed completion, or NULL */
+static struct io_uring_cqe *io_ring_peek(io_ring_t * ring)
+{
+	unsigned int head;
+
+	head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+/* hand the io_ring_peek completion back to the kernel */
+static void io_ring_advance(io_ring_t * ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+	return;
+}
+
+static int io_ring_close(io_ring_t * ring)
+{
+	int err = 0;
+
+	if (ring->sqes != MAP_FAILED) {
+		if (munmap(ring->sqes, ring->sqes_size) == -1) {
+			PERROR("munmap io_uring submission queue entries");
+			err = 1;
+		}
+		ring->sqes = MAP_FAILED;
+	}
+	if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+		if (munmap(ring->cq_ring, ring->cq_ring_size) == -1) {
+			PERROR("munmap io_uring completion queue");
+			err = 1;
+		}
+	}
+	ring->cq_ring = MAP_FAILED;
+	if (ring->sq_ring != MAP_FAILED) {
+		if (munmap(ring->sq_ring, ring->sq_ring_size) == -1) {
+			PERROR("munmap io_uring submission queue");
+			err = 1;
+		}
+		ring->sq_ring = MAP_FAILED;
+	}
+	if (ring->fd >= 0) {
+		if (close(ring->fd) == -1) {
+			PERROR("close io_uring file descriptor");
+			err = 1;
+		}
+		ring->fd = -1;
+	}
+	return err;
+}
+
+/*
+ * Relay standard streams and the pseudoterminal master through
+ * intermediate pipes with splice(2), so the data never passes through
+ * userspace.  Returns RELAY_FALLBACK (after flushing any data already
+ * in the pipes) if a file descriptor turns out not to support splice.
+ */
+static int splice_pseudoterminal_master_epoll(int *master, int *slave)
+{
+	relay_channel_t channels[2], *channel;
+	struct epoll_event events[4];
+	uint32_t watched[3] = { 0, 0, 0 }, wanted[3];
+	int fds[3], pollable[3], ready_read[3], ready_write[3];
+	int epoll_fd = -1, err = 0, exited = 0, i, j, n, op, timeout;
+	ssize_t size;
+
+	fds[0] = STDIN_FILENO;
+	fds[1] = *master;
+	fds[2] = STDOUT_FILENO;
+
+	memset(channels, 0, sizeof(channels));
+	for (i = 0; i < 2; i++) {
+		channels[i].pipe_fd[0] = channels[i].pipe_fd[1] = -1;
+		channels[i].open = 1;
+	}
+	channels[0].src = 0;	/* stdin -> master */
+	channels[0].dst = 1;
+	channels[1].src = 1;	/* master -> stdout */
+	channels[1].dst = 2;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		PERROR("epoll_create1");
+		return RELAY_FALLBACK;
+	}
+
+	/* file descriptors without poll support (e.g. regular files) are always ready */
+	for (i = 0; i < 3; i++) {
+		events[0].events = EPOLLIN;
+		events[0].data.u32 = i;
+		pollable[i] = 1;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &events[0]) == -1) {
+			if (errno != EPERM) {
+				PERROR("epoll_ctl");
+				err = RELAY_FALLBACK;
+				goto cleanup;
+			}
+			pollable[i] = 0;
+		} else if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fds[i], NULL) ==
+			   -1) {
+			PERROR("epoll_ctl");
+			err = RELAY_FALLBACK;
+			goto cleanup;
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (pipe2(channels[i].pipe_fd, O_CLOEXEC) == -1) {
+			PERROR("pipe2");
+			err = RELAY_FALLBACK;
+			goto cleanup;
+		}
+		n = fcntl(channels[i].pipe_fd[1], F_GETPIPE_SZ);
+		channels[i].capacity = n > 0 ? (size_t) n : PIPE_BUF;
+	}
+
+	/* the pidfd becomes readable when the container exits */
+	if (child_pidfd >= 0) {
+		events[0].events = EPOLLIN;
+		events[0].data.u32 = 3;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, child_pidfd, &events[0]) ==
+		    -1) {
+			PERROR("epoll_ctl");
+			err = RELAY_FALLBACK;
+			goto cleanup;
+		}
 	}
 
-	return err;
-}
+	while (1) {
+		if (child_pid < 0 || exited) {	/* don't bother piping to a dead process */
+			channels[0].open = 0;
+			channels[0].pending = 0;
+			if (slave && *slave >= 0) {	/* don't hold the slave open either */
+				if (close(*slave)) {
+					PERROR("close pseudoterminal slave");
+				}
+				*slave = -1;
+			}
+		}
 
-// Allocate a null-terminated array of strings from a JSON array.
-static char **json_array_of_strings_value(json_t * array)
-{
-	char **a = NULL;
-	json_t *value;
-	size_t i;
+		timeout = -1;
+		wanted[0] = wanted[1] = wanted[2] = 0;
+		for (i = 0; i < 2; i++) {
+			if (channels[i].pending) {	/* wait to flush pipe */
+				wanted[channels[i].dst] |= EPOLLOUT;
+			} else if (channels[i].open) {	/* wait for new data */
+				wanted[channels[i].src] |= EPOLLIN;
+			}
+		}
 
-	i = json_array_size(array);
-	a = malloc(sizeof(char *) * (i + 1));
-	if (!a) {
-		PERROR("malloc");
-		goto cleanup;
-	}
-	memset(a, 0, sizeof(char *) * (i + 1));
-	json_array_foreach(array, i, value) {
-		a[i] = strdup(json_string_value(value));
-		if (!a[i]) {
-			PERROR("strdup");
+		n = 0;
+		for (i = 0; i < 3; i++) {
+			ready_read[i] = ready_write[i] = 0;
+			if (wanted[i]) {
+				n++;
+			}
+			if (!pollable[i]) {
+				if (wanted[i]) {
+					timeout = 0;
+					ready_read[i] = wanted[i] & EPOLLIN;
+					ready_write[i] = wanted[i] & EPOLLOUT;
+				}
+				continue;
+			}
+			if (wanted[i] == watched[i]) {
+				continue;
+			}
+			if (!watched[i]) {
+				op = EPOLL_CTL_ADD;
+			} else if (wanted[i]) {
+				op = EPOLL_CTL_MOD;
+			} else {
+				op = EPOLL_CTL_DEL;
+			}
+			events[0].events = wanted[i];
+			events[0].data.u32 = i;
+			if (epoll_ctl(epoll_fd, op, fds[i], &events[0]) == -1) {
+				PERROR("epoll_ctl");
+				err = 1;
+				goto cleanup;
+			}
+			watched[i] = wanted[i];
+		}
+
+		if (n == 0) {
+			break;
+		}
+
+		i = stats_timeout_ms();
+		if (i >= 0 && (timeout < 0 || i < timeout)) {
+			timeout = i;
+		}
+		n = epoll_wait(epoll_fd, events, 4, timeout);
+		stats_tick();
+		checkpoint_tick();
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			PERROR("epoll_wait");
+			err = 1;
 			goto cleanup;
 		}
+		for (j = 0; j < n; j++) {
+			i = (int)events[j].data.u32;
+			if (i == 3) {
+				exited = 1;
+				if (epoll_ctl
+				    (epoll_fd, EPOLL_CTL_DEL, child_pidfd,
+				     NULL) == -1) {
+					PERROR("epoll_ctl");
+					err = 1;
+					goto cleanup;
+				}
+				continue;
+			}
+			if (events[j].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				ready_read[i] = wanted[i] & EPOLLIN;
+			}
+			if (events[j].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+				ready_write[i] = wanted[i] & EPOLLOUT;
+			}
+		}
+
+		for (i = 0; i < 2; i++) {
+			channel = &channels[i];
+			if (channel->open && !channel->pending
+			    && ready_read[channel->src]) {
+				/* get new data */
+				size =
+				    splice(fds[channel->src], NULL,
+					   channel->pipe_fd[1], NULL,
+					   channel->capacity,
+					   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (size == -1) {
+					if (errno == EIO
+					    && fds[channel->src] == *master) {
+						channel->open = 0;
+					} else if (errno == EINVAL
+						   || errno == ENOSYS) {
+						err = RELAY_FALLBACK;
+						goto cleanup;
+					} else if (errno != EINTR
+						   && errno != EAGAIN) {
+						PERROR("splice into relay pipe");
+						err = 1;
+						goto cleanup;
+					}
+				} else if (size == 0) {	/* EOF */
+					channel->open = 0;
+				} else {
+					channel->pending = (size_t) size;
+				}
+			} else if (channel->pending
+				   && ready_write[channel->dst]) {
+				/* flush pipe */
+				size =
+				    splice(channel->pipe_fd[0], NULL,
+					   fds[channel->dst], NULL,
+					   channel->pending,
+					   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (size == -1) {
+					if (errno == EIO
+					    && fds[channel->dst] == *master) {
+						channel->open = 0;
+						channel->pending = 0;
+					} else if (errno == EINVAL
+						   || errno == ENOSYS) {
+						err = RELAY_FALLBACK;
+						goto cleanup;
+					} else if (errno != EINTR
+						   && errno != EAGAIN) {
+						PERROR("splice out of relay pipe");
+						err = 1;
+						goto cleanup;
+					}
+				} else if (size == 0) {
+					LOG("splice zero out of relay pipe\n");
+					err = 1;
+					goto cleanup;
+				} else {
+					channel->pending -= (size_t) size;
+					relay_bytes[channel->src] += (uint64_t) size;
+				}
+			}
+		}
 	}
-	return a;
 
  cleanup:
-	if (a) {
-		for (i = 0; a[i] != NULL; i++) {
-			free(a[i]);
+	for (i = 0; i < 2; i++) {
+		if (err == RELAY_FALLBACK && channels[i].pending) {
+			if (relay_drain(&channels[i], fds, *master)) {
+				err = 1;
+			}
+		}
+		if (close_pipe(channels[i].pipe_fd)) {
+			err = 1;
 		}
-		free(a);
-		a = NULL;
 	}
-	return a;
+	if (epoll_fd >= 0) {
+		if (close(epoll_fd) == -1) {
+			PERROR("close epoll file descriptor");
+			err = 1;
+		}
+	}
+	return err;
 }
 
-static int close_pipe(int pipe_fd[])
+/* copy data stranded in a relay pipe to its destination before falling back */
+static int relay_drain(relay_channel_t * channel, int *fds, int master)
 {
-	int err = 0;
+	char buf[1024];
+	ssize_t n, m, i;
 
-	if (pipe_fd[0] >= 0) {
-		if (close(pipe_fd[0]) == -1) {
-			PERROR("close pipe read-end");
-			err = 1;
+	while (channel->pending) {
+		n = read(channel->pipe_fd[0], buf,
+			 channel->pending <
+			 sizeof(buf) ? channel->pending : sizeof(buf));
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			PERROR("read from relay pipe");
+			return 1;
+		} else if (n == 0) {
+			LOG("unexpected EOF on relay pipe\n");
+			return 1;
 		}
-		pipe_fd[0] = -1;
-	}
-
-	if (pipe_fd[1] >= 0) {
-		if (close(pipe_fd[1]) == -1) {
-			PERROR("close pipe write-end");
-			err = 1;
+		channel->pending -= (size_t) n;
+		for (i = 0; i < n; i += m) {
+			m = write(fds[channel->dst], &buf[i], n - i);
+			if (m == -1) {
+				if (errno == EINTR) {
+					m = 0;
+					continue;
+				}
+				if (errno == EIO && fds[channel->dst] == master) {
+					channel->pending = 0;
+					return 0;
+				}
+				PERROR("write relay pipe data");
+				return 1;
+			} else if (m == 0) {
+				LOG("write zero relay pipe data\n");
+				return 1;
+			}
+			relay_bytes[channel->src] += (uint64_t) m;
 		}
-		pipe_fd[1] = -1;
 	}
 
-	return err;
+	return 0;
 }
 
-static int splice_pseudoterminal_master(int *master, int *slave)
+static int splice_pseudoterminal_master_select(int *master, int *slave)
 {
 	fd_set rfds, wfds, efds;
+	struct timeval tv;
 	char in_buf[1024];
 	char out_buf[1024];
 	ssize_t n;
-	int nfds, err = 0;
+	int nfds, err = 0, exited = 0, ms;
 	int in_i = 0, in_len = 0, out_i = 0, out_len = 0, in_open =
 	    1, out_open = 1;
 
@@ -2581,7 +9205,7 @@ static int splice_pseudoterminal_master(int *master, int *slave)
 		FD_ZERO(&wfds);
 		FD_ZERO(&efds);
 
-		if (child_pid < 0) {	/* don't bother piping to a dead process */
+		if (child_pid < 0 || exited) {	/* don't bother piping to a dead process */
 			in_open = in_len = 0;
 			if (slave && *slave >= 0) {	/* don't hold the slave open either */
 				if (close(*slave)) {
@@ -2624,7 +9248,20 @@ static int splice_pseudoterminal_master(int *master, int *slave)
 			break;
 		}
 
-		if (select(nfds, &rfds, &wfds, &efds, NULL) == -1) {
+		if (child_pidfd >= 0 && !exited) {	/* readable when the container exits */
+			FD_SET(child_pidfd, &rfds);
+			if (child_pidfd + 1 > nfds) {
+				nfds = child_pidfd + 1;
+			}
+		}
+
+		ms = stats_timeout_ms();
+		tv.tv_sec = ms / 1000;
+		tv.tv_usec = (ms % 1000) * 1000;
+		n = select(nfds, &rfds, &wfds, &efds, ms >= 0 ? &tv : NULL);
+		stats_tick();
+		checkpoint_tick();
+		if (n == -1) {
 			if (errno == EINTR) {
 				continue;
 			}
@@ -2633,6 +9270,10 @@ static int splice_pseudoterminal_master(int *master, int *slave)
 			goto cleanup;
 		}
 
+		if (child_pidfd >= 0 && FD_ISSET(child_pidfd, &rfds)) {
+			exited = 1;
+		}
+
 		if (FD_ISSET(STDIN_FILENO, &efds)) {
 			LOG("select error for stdin\n");
 			err = 1;
@@ -2681,6 +9322,7 @@ static int splice_pseudoterminal_master(int *master, int *slave)
 				goto cleanup;
 			} else {
 				in_i += n;
+				relay_bytes[0] += (uint64_t) n;
 				if (in_i == in_len) {
 					in_i = in_len = 0;
 				}
@@ -2717,6 +9359,7 @@ static int splice_pseudoterminal_master(int *master, int *slave)
 				goto cleanup;
 			} else {
 				out_i += n;
+				relay_bytes[1] += (uint64_t) n;
 				if (out_i == out_len) {
 					out_i = out_len = 0;
 				}
@@ -2725,92 +9368,341 @@ static int splice_pseudoterminal_master(int *master, int *slave)
 	}
 
  cleanup:
-	if (*master >= 0) {
-		if (close(*master)) {
-			PERROR("close pseudoterminal master");
+	return err;
+}
+
+/* length of path without trailing slashes (but keep "/") */
+static size_t path_length(const char *path)
+{
+	size_t len = strlen(path);
+
+	while (len > 1 && path[len - 1] == '/') {
+		len--;
+	}
+	return len;
+}
+
+/*
+ * Return a cached O_PATH descriptor for the directory at path,
+ * creating any missing directories with mkdirat(2).  The walk starts
+ * from the longest cached prefix, and every directory it opens is
+ * cached, so sibling mount targets only pay for the components they
+ * don't share.  The cache owns every descriptor, so the caller must
+ * not close the returned one.
+ */
+static int open_dir_all(dir_cache_t * cache, const char *path, mode_t mode)
+{
+	dir_cache_entry_t *entry, *best = NULL;
+	char name[MAX_PATH];
+	size_t len, pos, end, i;
+	int fd, next;
+
+	if (!path || path[0] != '/') {
+		LOG("cannot create relative directory %s\n", path);
+		return -1;
+	}
+
+	len = path_length(path);
+	if (len >= MAX_PATH) {
+		LOG("mount path %s is too long (%d >= %d)\n", path, (int)len,
+		    MAX_PATH);
+		return -1;
+	}
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		entry = &cache->entries[i];
+		if (!entry->len || entry->len > len
+		    || (best && entry->len <= best->len)
+		    || strncmp(entry->path, path, entry->len) != 0) {
+			continue;
+		}
+		if (entry->len == 1 || entry->len == len
+		    || path[entry->len] == '/') {
+			best = entry;
 		}
-		*master = -1;
 	}
 
-	if (slave && *slave >= 0) {
-		if (close(*slave)) {
-			PERROR("close pseudoterminal slave");
+	if (best && best->len == len) {
+		return best->fd;
+	}
+
+	if (best) {
+		fd = best->fd;
+		pos = best->len;
+	} else {
+		fd = open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (fd == -1) {
+			PERROR("open");
+			return -1;
 		}
-		*slave = -1;
+		dir_cache_insert(cache, "/", 1, fd);
+		pos = 1;
 	}
 
-	return err;
+	while (pos < len) {
+		while (path[pos] == '/') {
+			pos++;
+		}
+		for (end = pos; end < len && path[end] != '/'; end++) ;
+		memcpy(name, path + pos, end - pos);
+		name[end - pos] = '\0';
+
+		next = openat(fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (next == -1 && errno == ENOENT) {
+			LOG("create directory %.*s\n", (int)end, path);
+			if (mkdirat(fd, name, mode) == -1 && errno != EEXIST) {
+				PERROR("mkdirat");
+			} else {
+				next =
+				    openat(fd, name,
+					   O_PATH | O_DIRECTORY | O_CLOEXEC);
+				if (next == -1) {
+					PERROR("openat");
+				}
+			}
+		} else if (next == -1) {
+			PERROR("openat");
+		}
+
+		if (next == -1) {
+			return -1;
+		}
+		/* may evict fd, which the walk no longer needs */
+		dir_cache_insert(cache, path, end, next);
+		fd = next;
+		pos = end;
+	}
+
+	return fd;
 }
 
-static int mkdir_all(const char *path, mode_t mode)
+/* cache fd (which the cache now owns) for the first len bytes of path */
+static void dir_cache_insert(dir_cache_t * cache, const char *path,
+			     size_t len, int fd)
 {
-	struct stat buf;
-	char *path_copy = NULL, *dir = NULL;
-	int err = 0;
+	dir_cache_entry_t *entry;
+	size_t i;
 
-	if (stat(path, &buf) == -1) {
-		if (errno == ENOENT) {
-			path_copy = strdup(path);
-			if (path_copy == NULL) {
-				PERROR("strdup");
-				err = -1;
-				goto cleanup;
-			}
-			dir = dirname(path_copy);
-			if (mkdir_all(dir, mode) == -1) {
-				err = -1;
-				goto cleanup;
-			}
-			LOG("create directory %s\n", path);
-			if (mkdir(path, mode) == -1) {
-				PERROR("mkdir");
-				err = -1;
-				goto cleanup;
+	entry = &cache->entries[cache->next];
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		if (!cache->entries[i].len) {
+			entry = &cache->entries[i];
+			break;
+		}
+	}
+	if (entry == &cache->entries[cache->next]) {
+		cache->next = (cache->next + 1) % DIR_CACHE_SIZE;
+	}
+
+	if (entry->len && close(entry->fd) == -1) {
+		PERROR("close directory descriptor");
+	}
+
+	memcpy(entry->path, path, len);
+	entry->path[len] = '\0';
+	entry->len = len;
+	entry->fd = fd;
+	return;
+}
+
+/* drop cached directories at or below path, which a mount now covers */
+static void dir_cache_invalidate(dir_cache_t * cache, const char *path)
+{
+	dir_cache_entry_t *entry;
+	size_t i, len;
+
+	if (!path) {
+		return;
+	}
+
+	len = path_length(path);
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		entry = &cache->entries[i];
+		if (!entry->len || entry->len < len
+		    || strncmp(entry->path, path, len) != 0) {
+			continue;
+		}
+		if (len == 1 || entry->len == len || entry->path[len] == '/') {
+			if (close(entry->fd) == -1) {
+				PERROR("close directory descriptor");
 			}
-		} else {
-			PERROR("stat");
-			err = -1;
-			goto cleanup;
+			entry->len = 0;
 		}
 	}
+	return;
+}
 
- cleanup:
-	if (path_copy != NULL) {
-		free(path_copy);
+static void dir_cache_flush(dir_cache_t * cache)
+{
+	dir_cache_invalidate(cache, "/");
+	return;
+}
+
+static int mkdir_all(dir_cache_t * cache, const char *path, mode_t mode)
+{
+	return open_dir_all(cache, path, mode) == -1 ? -1 : 0;
+}
+
+static int mkfile_all(dir_cache_t * cache, const char *path,
+		      mode_t dir_mode, mode_t file_mode)
+{
+	char dir[MAX_PATH];
+	const char *name;
+	size_t len;
+	int dir_fd, fd;
+
+	len = path_length(path);
+	name = memrchr(path, '/', len);
+	if (!name || len >= MAX_PATH) {
+		LOG("cannot create file %s\n", path);
+		return -1;
 	}
-	return err;
+	if (name == path) {
+		strcpy(dir, "/");
+	} else {
+		memcpy(dir, path, (size_t) (name - path));
+		dir[name - path] = '\0';
+	}
+	name++;
+
+	dir_fd = open_dir_all(cache, dir, dir_mode);
+	if (dir_fd == -1) {
+		return -1;
+	}
+
+	LOG("create file %s\n", path);
+	fd = openat(dir_fd, name, O_CREAT | O_RDONLY | O_CLOEXEC, file_mode);
+	if (fd == -1) {
+		PERROR("mkfile_all openat");
+	} else if (close(fd) == -1) {
+		PERROR("close mkfile_all descriptor");
+	}
+	return 0;
 }
 
-static int mkfile_all(const char *path, mode_t dir_mode, mode_t file_mode)
+/* map a timeline which processes forked or cloned from here append to */
+static int trace_open()
 {
-	char *path_copy = NULL, *dir = NULL;
-	int fd = -1, err = 0;
+	if (!trace) {
+		return 0;
+	}
 
-	path_copy = strdup(path);
-	if (path_copy == NULL) {
-		PERROR("strdup");
-		err = -1;
+	trace_timeline =
+	    mmap(NULL, sizeof(trace_timeline_t), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (trace_timeline == MAP_FAILED) {
+		PERROR("mmap");
+		trace_timeline = NULL;
+		return 1;
+	}
+	trace_timeline->count = 0;
+	trace_process = "host";
+
+	return 0;
+}
+
+static void trace_event(char phase, const char *format, ...)
+{
+	trace_event_t *event;
+	va_list ap;
+	unsigned int i;
+
+	if (!trace_timeline) {
+		return;
+	}
+
+	i = __sync_fetch_and_add(&trace_timeline->count, 1);
+	if (i >= TRACE_EVENTS) {
+		return;		/* counted as dropped by trace_close */
+	}
+	event = &trace_timeline->events[i];
+	if (clock_gettime(CLOCK_MONOTONIC, &event->time) == -1) {
+		event->time.tv_sec = event->time.tv_nsec = 0;
+	}
+	event->process = trace_process;
+	event->phase = phase;
+	va_start(ap, format);
+	vsnprintf(event->name, TRACE_NAME_SIZE, format, ap);
+	va_end(ap);
+}
+
+/* write the timeline to the log file descriptor and unmap it */
+static int trace_close()
+{
+	json_t *timeline = NULL, *events, *event;
+	trace_event_t *e;
+	char *string = NULL;
+	char phase[2] = { 0, 0 };
+	unsigned int i, count;
+	int err = 0;
+
+	if (!trace_timeline) {
+		return 0;
+	}
+
+	count = trace_timeline->count;
+	timeline = json_object();
+	if (!timeline) {
+		LOG("failed to allocate the trace timeline\n");
+		err = 1;
 		goto cleanup;
 	}
-	dir = dirname(path_copy);
-	if (mkdir_all(dir, dir_mode) == -1) {
-		err = -1;
+	events = json_array();
+	if (json_object_set_new(timeline, "events", events)) {
+		LOG("failed to allocate the trace timeline\n");
+		err = 1;
 		goto cleanup;
 	}
-	LOG("create file %s\n", path);
-	fd = open(path, O_CREAT | O_RDONLY, file_mode);
-	if (fd == -1) {
-		PERROR("mkdir_all open");
+	for (i = 0; i < count && i < TRACE_EVENTS; i++) {
+		e = &trace_timeline->events[i];
+		phase[0] = e->phase;
+		event = json_object();
+		if (json_array_append_new(events, event)
+		    || json_object_set_new(event, "name", json_string(e->name))
+		    || json_object_set_new(event, "phase", json_string(phase))
+		    || json_object_set_new(event, "process",
+					   json_string(e->process))
+		    || json_object_set_new(event, "monotonic-ns",
+					   json_integer((json_int_t)
+							e->time.tv_sec *
+							1000000000 +
+							e->time.tv_nsec))) {
+			LOG("failed to add trace event %u\n", i);
+			err = 1;
+			goto cleanup;
+		}
+	}
+	if (count > TRACE_EVENTS) {
+		if (json_object_set_new
+		    (timeline, "dropped", json_integer(count - TRACE_EVENTS))) {
+			LOG("failed to count dropped trace events\n");
+			err = 1;
+			goto cleanup;
+		}
+	}
+
+	string = json_dumps(timeline, JSON_COMPACT);
+	if (!string) {
+		LOG("failed to serialize the trace timeline\n");
+		err = 1;
+		goto cleanup;
+	}
+	log_flush();		/* keep the timeline in order */
+	if (log_fd >= 0 && dprintf(log_fd, "%s\n", string) < 0) {
+		err = 1;
 	}
 
  cleanup:
-	if (fd >= 0) {
-		if (close(fd) == -1) {
-			PERROR("close mkdir_all descriptor");
-		}
+	if (string) {
+		free(string);
 	}
-	if (path_copy != NULL) {
-		free(path_copy);
+	if (timeline) {
+		json_decref(timeline);
+	}
+	if (munmap(trace_timeline, sizeof(trace_timeline_t)) == -1) {
+		PERROR("munmap");
+		err = 1;
 	}
+	trace_timeline = NULL;
 	return err;
 }
@@ -17,12 +17,17 @@
  */
 
 #define _GNU_SOURCE
+#include <stdarg.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 
 #include <jansson.h>
@@ -30,8 +35,25 @@
 
 int verbose = 0;
 int log_fd = STDERR_FILENO;
-#define LOG(...) do {if (verbose && log_fd >= 0) {dprintf(log_fd, __VA_ARGS__);}} while(0)
-#define PERROR(s) do {LOG("%s: %s\n", s, strerror(errno));} while(0)
+
+static char log_buffer[LOG_BUFFER_SIZE];
+static size_t log_len = 0;
+static int log_buffered = 0;
+
+static void log_fork_child();
+static void log_crash(int signum);
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
 
 int get_host_exec_fd(json_t * process, int *exec_fd)
 {
@@ -79,11 +101,13 @@ int get_host_exec_fd(json_t * process, int *exec_fd)
 
 int open_in_path(const char *name, int flags)
 {
-	const char *p;
-	char *paths = NULL, *paths2, *path;
-	size_t i;
+	const char *p, *end;
+	char path[MAX_PATH];
+	size_t i, len;
 	int fd;
 
+	len = strlen(name);
+
 	if (name[0] == '/') {
 		LOG("open container-process executable from host %s\n", name);
 		fd = open(name, flags);
@@ -94,75 +118,136 @@ int open_in_path(const char *name, int flags)
 		return fd;
 	}
 
-	path = malloc(sizeof(char) * MAX_PATH);
-	if (!path) {
-		PERROR("malloc");
-		return -1;
-	}
-	memset(path, 0, sizeof(char) * MAX_PATH);
-
-	p = strchr(name, '/');
-	if (p) {
+	if (strchr(name, '/')) {
 		if (!getcwd(path, MAX_PATH)) {
 			PERROR("getcwd");
-			goto cleanup;
+			return -1;
 		}
 		i = strlen(path);
-		if (i + strlen(name) + 2 > MAX_PATH) {
-			LOG("failed to format relative path (needed a buffer with %d byes)\n", (int)(i + strlen(name) + 2));
-			goto cleanup;
+		if (i + len + 2 > MAX_PATH) {
+			LOG("failed to format relative path (needed a buffer with %d byes)\n", (int)(i + len + 2));
+			return -1;
 		}
 		path[i++] = '/';
-		strcpy(path + i, name);
+		memcpy(path + i, name, len + 1);
 		LOG("open container-process executable from host %s\n", path);
 		fd = open(path, flags);
 		if (fd == -1) {
 			PERROR("open");
 			return -1;
 		}
-		free(path);
 		return fd;
 	}
 
-	paths = getenv("PATH");
-	if (!paths) {
+	p = getenv("PATH");
+	if (!p) {
 		LOG("failed to get host PATH\n");
-		goto cleanup;
-	}
-	paths = strdup(paths);
-	if (!paths) {
-		PERROR("strdup");
-		goto cleanup;
+		return -1;
 	}
 
-	paths2 = paths;
-	while ((p = strtok(paths2, ":"))) {
-		paths2 = NULL;
-		i = strlen(p);
-		if (i + strlen(name) + 2 > MAX_PATH) {
-			LOG("failed to format relative path (needed a buffer with %d byes)\n", (int)(i + strlen(name) + 2));
-			goto cleanup;
+	/* walk the PATH entries in place, skipping empty ones like strtok(3) */
+	for (; *p; p = *end ? end + 1 : end) {
+		end = strchrnul(p, ':');
+		i = (size_t) (end - p);
+		if (!i) {
+			continue;
+		}
+		if (i + len + 2 > MAX_PATH) {
+			LOG("failed to format relative path (needed a buffer with %d byes)\n", (int)(i + len + 2));
+			return -1;
 		}
-		strcpy(path, p);
+		memcpy(path, p, i);
 		path[i++] = '/';
-		strcpy(path + i, name);
+		memcpy(path + i, name, len + 1);
 		fd = open(path, flags);
 		if (fd >= 0) {
 			LOG("open container-process executable from host %s\n",
 			    path);
-			free(path);
 			return fd;
 		}
 	}
 
 	LOG("failed to find %s in the host PATH\n", name);
+	return -1;
+}
+
+/*
+ * Replace *exec_fd (usually an O_PATH descriptor from
+ * get_host_exec_fd) with a read-only descriptor for a sealed memfd
+ * copy of the executable, so later changes to the host file can't
+ * reach the container.
+ */
+int seal_exec_fd(int *exec_fd)
+{
+	struct stat st;
+	char path[64];
+	off_t offset = 0;
+	ssize_t n;
+	int src = -1, memfd = -1, fd = -1;
+
+	(void)snprintf(path, sizeof(path), "/proc/self/fd/%d", *exec_fd);
+	src = open(path, O_RDONLY | O_CLOEXEC);
+	if (src == -1) {
+		PERROR("open");
+		goto cleanup;
+	}
+	if (fstat(src, &st) == -1) {
+		PERROR("fstat");
+		goto cleanup;
+	}
+
+	memfd =
+	    (int)syscall(__NR_memfd_create, "ccon-exec",
+			 MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd == -1) {
+		PERROR("memfd_create");
+		goto cleanup;
+	}
+	while (offset < st.st_size) {
+		n = sendfile(memfd, src, &offset, (size_t) (st.st_size - offset));
+		if (n == -1) {
+			PERROR("sendfile");
+			goto cleanup;
+		} else if (n == 0) {
+			LOG("executable shrank while sealing it\n");
+			goto cleanup;
+		}
+	}
+	if (fcntl
+	    (memfd, F_ADD_SEALS,
+	     F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) == -1) {
+		PERROR("fcntl");
+		goto cleanup;
+	}
+
+	/* execve(2) refuses files open for writing, so reopen read-only */
+	(void)snprintf(path, sizeof(path), "/proc/self/fd/%d", memfd);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		PERROR("open");
+		goto cleanup;
+	}
+	LOG("sealed %ld-byte executable copy\n", (long)st.st_size);
 
  cleanup:
-	if (paths) {
-		free(paths);
+	if (memfd >= 0) {
+		if (close(memfd) == -1) {
+			PERROR("close memfd");
+		}
 	}
-	free(path);
-	return -1;
+	if (src >= 0) {
+		if (close(src) == -1) {
+			PERROR("close executable");
+		}
+	}
+	if (fd == -1) {
+		return -1;
+	}
+	if (close(*exec_fd) == -1) {
+		PERROR("close executable");
+	}
+	*exec_fd = fd;
+	return 0;
 }
 
 int sendfd(int socket, int *fd, int close_fd)
@@ -225,3 +310,261 @@ int recvfd(int socket, int *fd)
 
 	return 0;
 }
+
+/*
+ * Send a payload as a single message if it fits in
+ * CLIENT_MESSAGE_SIZE, otherwise as a frame header and
+ * FRAME_CHUNK_SIZE chunks.  SOCK_SEQPACKET keeps the messages in
+ * order, so callers can queue more messages (e.g. file descriptors)
+ * behind the frame without waiting for the peer.
+ */
+int send_message(int socket, const char *data, size_t len)
+{
+	char header[32];
+	size_t offset, chunk;
+	int size;
+
+	if (len <= CLIENT_MESSAGE_SIZE) {
+		if (send(socket, data, len, 0) == -1) {
+			PERROR("send");
+			return -1;
+		}
+		return 0;
+	}
+
+	if (len > FRAME_MAX_SIZE) {
+		LOG("message is too long for a ccon frame (%lu > %d)\n",
+		    (unsigned long int)len, FRAME_MAX_SIZE);
+		return -1;
+	}
+
+	size = snprintf(header, sizeof(header), "%s %lu", FRAME_REQUEST,
+			(unsigned long int)len);
+	if (size < 0 || (size_t) size >= sizeof(header)) {
+		LOG("failed to format frame header\n");
+		return -1;
+	}
+	if (send(socket, header, (size_t) size, 0) == -1) {
+		PERROR("send");
+		return -1;
+	}
+
+	for (offset = 0; offset < len; offset += chunk) {
+		chunk = len - offset;
+		if (chunk > FRAME_CHUNK_SIZE) {
+			chunk = FRAME_CHUNK_SIZE;
+		}
+		if (send(socket, data + offset, chunk, 0) == -1) {
+			PERROR("send");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Read the next message into a growable buffer, peeking at its length
+ * first so long messages are not truncated, and reassembling framed
+ * payloads.  Returns 1 when message->data holds a complete payload, 0
+ * if more messages are needed (or the socket would block), and -1 if
+ * the connection should be closed.
+ */
+int recv_message(int socket, message_buffer_t * message)
+{
+	char *data, *end;
+	unsigned long int expected;
+	size_t size;
+	ssize_t n;
+
+	n = recv(socket, NULL, 0, MSG_PEEK | MSG_TRUNC);
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return 0;
+		}
+		PERROR("recv");
+		return -1;
+	} else if (n == 0) {
+		LOG("lost connection on %d\n", socket);
+		return -1;
+	}
+
+	if (!message->expected) {
+		message->len = 0;
+	} else if ((size_t) n > message->expected - message->len) {
+		LOG("frame chunk on %d overruns its %lu-byte header\n", socket,
+		    (unsigned long int)message->expected);
+		return -1;
+	}
+
+	size = message->len + (size_t) n + 1;
+	if (size > message->size) {
+		data = realloc(message->data, size);
+		if (!data) {
+			PERROR("realloc");
+			return -1;
+		}
+		message->data = data;
+		message->size = size;
+	}
+
+	n = recv(socket, message->data + message->len, (size_t) n, 0);
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return 0;
+		}
+		PERROR("recv");
+		return -1;
+	}
+	message->len += (size_t) n;
+	message->data[message->len] = '\0';
+
+	if (message->expected) {
+		if (message->len < message->expected) {
+			return 0;
+		}
+		message->expected = 0;
+		return 1;
+	}
+
+	if (message->len > strlen(FRAME_REQUEST) + 1
+	    && strncmp(message->data, FRAME_REQUEST " ",
+		       strlen(FRAME_REQUEST) + 1) == 0) {
+		errno = 0;
+		expected =
+		    strtoul(message->data + strlen(FRAME_REQUEST) + 1, &end,
+			    10);
+		if (errno || *end != '\0' || expected == 0
+		    || expected > FRAME_MAX_SIZE) {
+			LOG("invalid frame header on %d: %s\n", socket,
+			    message->data);
+			return -1;
+		}
+		message->expected = (size_t) expected;
+		message->len = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+void free_message(message_buffer_t * message)
+{
+	if (message->data) {
+		free(message->data);
+		message->data = NULL;
+	}
+	message->len = message->size = message->expected = 0;
+}
+
+/*
+ * Format a LOG line.  Without log_buffer_start that's a write(2) per
+ * call, as before; with it, lines collect in log_buffer until it
+ * fills or log_flush is called.
+ */
+void log_printf(const char *format, ...)
+{
+	va_list ap;
+	size_t space;
+	int n, saved_errno = errno;
+
+	va_start(ap, format);
+	if (!log_buffered) {
+		(void)vdprintf(log_fd, format, ap);
+		va_end(ap);
+		errno = saved_errno;
+		return;
+	}
+	space = sizeof(log_buffer) - log_len;
+	n = vsnprintf(log_buffer + log_len, space, format, ap);
+	va_end(ap);
+	if (n >= 0 && (size_t) n >= space) {
+		/* the truncated copy is past log_len, so flush drops it */
+		log_flush();
+		va_start(ap, format);
+		if ((size_t) n >= sizeof(log_buffer)) {
+			(void)vdprintf(log_fd, format, ap);
+			n = 0;
+		} else {
+			(void)vsnprintf(log_buffer, sizeof(log_buffer), format,
+					ap);
+		}
+		va_end(ap);
+	}
+	if (n > 0) {
+		log_len += (size_t) n;
+	}
+	errno = saved_errno;
+}
+
+/* write out buffered lines; async-signal-safe, for log_crash */
+void log_flush()
+{
+	size_t i = 0;
+	ssize_t n;
+	int saved_errno = errno;
+
+	while (i < log_len && log_fd >= 0) {
+		n = write(log_fd, log_buffer + i, log_len - i);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		i += (size_t) n;
+	}
+	log_len = 0;
+	errno = saved_errno;
+}
+
+/*
+ * Buffer LOG lines for the rest of this process's life.  The buffer
+ * is flushed on exit(3) and fatal signals, and before fork(2) so the
+ * child doesn't inherit (and repeat) pending lines.  Forked children
+ * go back to unbuffered writes, because most of them only log on the
+ * way to an _exit(2) that would skip the flush.  Callers which clone
+ * or exec themselves should log_flush first.
+ */
+int log_buffer_start()
+{
+	struct sigaction act;
+	int signals[] = { SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV, 0 };
+	int i;
+
+	if (atexit(log_flush)) {
+		LOG("failed to register the log flush at exit\n");
+		return 1;
+	}
+
+	errno = pthread_atfork(log_flush, NULL, log_fork_child);
+	if (errno) {
+		PERROR("pthread_atfork");
+		return 1;
+	}
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = log_crash;
+	act.sa_flags = SA_RESETHAND | SA_NODEFER;
+	for (i = 0; signals[i]; i++) {
+		if (sigaction(signals[i], &act, NULL) == -1) {
+			PERROR("sigaction");
+			return 1;
+		}
+	}
+
+	log_buffered = 1;
+	return 0;
+}
+
+static void log_fork_child()
+{
+	log_buffered = 0;
+}
+
+/* flush, then die of the same signal with the default action */
+static void log_crash(int signum)
+{
+	log_flush();
+	(void)raise(signum);
+}
@@ -29,16 +29,43 @@
 
 /* client messages passed through the --socket */
 #define CLIENT_MESSAGE_SIZE 1024
+#define EXEC_REQUEST "exec"
 
-/* logging */
+/*
+ * Payloads longer than CLIENT_MESSAGE_SIZE are framed: a "frame N"
+ * header message followed by N bytes split over chunk messages.
+ */
+#define FRAME_REQUEST "frame"
+#define FRAME_CHUNK_SIZE 65536
+#define FRAME_MAX_SIZE (16 * 1024 * 1024)
+
+/* a growable buffer for received (possibly framed) messages */
+typedef struct message_buffer {
+	char *data;		/* null-terminated payload */
+	size_t len;
+	size_t size;		/* allocated bytes */
+	size_t expected;	/* payload length of a partial frame, or 0 */
+} message_buffer_t;
+
+/* logging, held in a per-process buffer after log_buffer_start */
+#define LOG_BUFFER_SIZE 65536
 extern int verbose;
 extern int log_fd;
-#define LOG(...) do {if (verbose && log_fd >= 0) {dprintf(log_fd, __VA_ARGS__);}} while(0)
+#define LOG(...) do {if (verbose && log_fd >= 0) {log_printf(__VA_ARGS__);}} while(0)
 #define PERROR(s) do {LOG("%s: %s\n", s, strerror(errno));} while(0)
 
+extern void log_printf(const char *format, ...)
+    __attribute__ ((format(printf, 1, 2)));
+extern void log_flush();
+extern int log_buffer_start();
+
 extern int get_host_exec_fd(json_t * process, int *exec_fd);
 extern int open_in_path(const char *name, int flags);
+extern int seal_exec_fd(int *exec_fd);
 extern int sendfd(int socket, int *fd, int close_fd);
 extern int recvfd(int socket, int *fd);
+extern int send_message(int socket, const char *data, size_t len);
+extern int recv_message(int socket, message_buffer_t * message);
+extern void free_message(message_buffer_t * message);
 
 #endif				/* _libccon_h */
@@ -14,18 +14,22 @@
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 command -v cat >/dev/null 2>/dev/null && test_set_prereq CAT
+command -v chmod >/dev/null 2>/dev/null && test_set_prereq CHMOD
 command -v echo >/dev/null 2>/dev/null && test_set_prereq ECHO
 command -v env >/dev/null 2>/dev/null && test_set_prereq ENV
 command -v grep >/dev/null 2>/dev/null && test_set_prereq GREP
 command -v head >/dev/null 2>/dev/null && test_set_prereq HEAD
 command -v id >/dev/null 2>/dev/null && test_set_prereq ID
 command -v kill >/dev/null 2>/dev/null && test_set_prereq KILL
+command -v ls >/dev/null 2>/dev/null && test_set_prereq LS
+command -v mkdir >/dev/null 2>/dev/null && test_set_prereq MKDIR
 command -v printf >/dev/null 2>/dev/null && test_set_prereq PRINTF
 command -v ps >/dev/null 2>/dev/null && test_set_prereq PS
 command -v pwd >/dev/null 2>/dev/null && test_set_prereq PWD
 command -v sed >/dev/null 2>/dev/null && test_set_prereq SED
 command -v sh >/dev/null 2>/dev/null && test_set_prereq SHELL
 command -v sleep >/dev/null 2>/dev/null && test_set_prereq SLEEP
+command -v sort >/dev/null 2>/dev/null && test_set_prereq SORT
 command -v test >/dev/null 2>/dev/null && test_set_prereq TEST
 command -v touch >/dev/null 2>/dev/null && test_set_prereq TOUCH
 command -v tty >/dev/null 2>/dev/null && test_set_prereq TTY
@@ -65,17 +65,99 @@ test_expect_success CAT,SED 'Test --verbose' "
 	ccon --verbose --config-string '{\"version\": \"0.1.0\"}' 2>actual &&
 	sed 's/[0-9][0-9]*/###/g' actual >actual-no-PID &&
 	cat <<-EOF >expected &&
-		block SIGHUP, SIGINT, and SIGTERM
+		block SIGCHLD, SIGHUP, SIGINT, and SIGTERM
 		install ccon's SIGCHLD handler
 		install ccon's SIGHUP, SIGINT, and SIGTERM handlers
 		launched container process with PID ###
-		unblock SIGHUP, SIGINT, and SIGTERM
+		unblock SIGCHLD, SIGHUP, SIGINT, and SIGTERM
 		restore default SIGHUP, SIGINT, and SIGTERM handlers
-		unblock SIGHUP, SIGINT, and SIGTERM
+		unblock SIGCHLD, SIGHUP, SIGINT, and SIGTERM
 		process not defined, exiting
 		container process ### exited with ###
 	EOF
 	test_cmp expected actual-no-PID
 "
 
+test_expect_success CAT,ECHO,SED,SORT 'Test --log-buffer' "
+	ccon --verbose --log-buffer --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {\"args\": [\"echo\", \"buffered\"]}
+		}' >output 2>actual &&
+	echo buffered >expected &&
+	test_cmp expected output &&
+	sed 's/[0-9][0-9]*/###/g' actual | sort >actual-no-PID &&
+	sort <<-EOF >expected &&
+		block SIGCHLD, SIGHUP, SIGINT, and SIGTERM
+		install ccon's SIGCHLD handler
+		install ccon's SIGHUP, SIGINT, and SIGTERM handlers
+		launched container process with PID ###
+		unblock SIGCHLD, SIGHUP, SIGINT, and SIGTERM
+		restore default SIGHUP, SIGINT, and SIGTERM handlers
+		unblock SIGCHLD, SIGHUP, SIGINT, and SIGTERM
+		execute: echo buffered
+		container process ### exited with ###
+	EOF
+	test_cmp expected actual-no-PID
+"
+
+test_expect_success 'Test invalid --socket-backlog' "
+	test_expect_code 1 ccon --socket-backlog 0 --config-string '{\"version\": \"0.5.0\"}'
+"
+
+test_expect_success ECHO,GREP 'Test --trace' "
+	ccon --trace --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"hooks\": {
+		    \"post-stop\": [
+		      {\"args\": [\"echo\", \"test\", \"--trace\"]}
+		    ]
+		  }
+		}' >output 2>actual &&
+	echo 'test --trace' >expected &&
+	test_cmp expected output &&
+	grep '^{\"events\": *\\[' actual &&
+	grep '\"name\": *\"clone\"' actual &&
+	grep '\"name\": *\"container-start\"' actual &&
+	grep '\"name\": *\"post-stop hook 0\"' actual
+"
+
+test_expect_success GREP,SHELL,SLEEP,TEST 'Test --stats' "
+	ccon --stats 0.1 --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {\"args\": [\"sh\", \"-c\", \"sleep 0.5\"]}
+		}' 2>actual &&
+	test \$(grep -c '^{\"stats\": *{\"pid\": *[0-9]' actual) -ge 3 &&
+	grep '\"relay-out-bytes\": *0' actual &&
+	test_must_fail grep -v '^{\"stats\"' actual
+"
+
+test_expect_success CAT,ECHO,GREP,MKDIR 'Test --plan-cache' "
+	mkdir plans &&
+	ccon --verbose --plan-cache plans --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {\"args\": [\"echo\", \"first\"]}
+		}' >output 2>actual &&
+	grep 'write config plan to plans/' actual &&
+	ccon --verbose --plan-cache plans --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {\"args\": [\"echo\", \"first\"]}
+		}' >>output 2>actual &&
+	grep 'load config plan from plans/' actual &&
+	test_must_fail grep 'write config plan' actual &&
+	cat <<-EOF >expected &&
+		first
+		first
+	EOF
+	test_cmp expected output
+"
+
+test_expect_success ECHO,GREP,MKDIR 'Test --plan-cache ignores corrupt plans' "
+	mkdir corrupt-plans &&
+	ccon --plan-cache corrupt-plans --config-string '{\"version\": \"0.5.0\"}' &&
+	for plan in corrupt-plans/*.plan; do echo garbage >\"\${plan}\"; done &&
+	ccon --verbose --plan-cache corrupt-plans --config-string '{\"version\": \"0.5.0\"}' 2>actual &&
+	grep 'ignore truncated config plan' actual &&
+	grep 'write config plan to corrupt-plans/' actual
+"
+
 test_done
@@ -33,4 +33,15 @@ test_expect_success ECHO,KILL,SHELL 'Test SIGTERM forwarding to dummy process' "
 	test_cmp expected actual-killed
 "
 
+test_expect_success GREP,SHELL,SLEEP 'Test SIGTERM forwarding while waiting on the container pidfd' "
+	test_expect_code 1 ccon --verbose --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {
+		    \"args\": [\"sh\", \"-c\", \"sleep 1; kill -TERM \$PPID; sleep 10\"]
+		  }
+		}' 2>actual &&
+	grep 'forward Terminated to the container process' actual &&
+	grep 'container killed (Terminated, 15)' actual
+"
+
 test_done
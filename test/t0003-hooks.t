@@ -0,0 +1,167 @@
+#!/bin/sh
+#
+# Copyright (C) 2018 W. Trevor King <wking@tremily.us>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+test_description='Test hook groups'
+
+. ./sharness.sh
+
+test_expect_success SHELL,SLEEP,TEST,TIMEOUT,TOUCH 'Test grouped post-create hooks run concurrently' "
+	timeout 10 ccon --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"hooks\": {
+		    \"post-create\": [
+		      {
+		        \"group\": \"setup\",
+		        \"args\": [\"sh\", \"-c\", \"while ! test -e second; do sleep 0.1; done\"]
+		      },
+		      {
+		        \"group\": \"setup\",
+		        \"args\": [\"touch\", \"second\"]
+		      }
+		    ]
+		  }
+		}'
+"
+
+test_expect_success CAT,ECHO,SHELL,TEST,TOUCH 'Test hook groups run in order' "
+	ccon --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"hooks\": {
+		    \"post-create\": [
+		      {\"group\": \"a\", \"args\": [\"touch\", \"one\"]},
+		      {\"group\": \"a\", \"args\": [\"touch\", \"two\"]},
+		      {
+		        \"group\": \"b\",
+		        \"args\": [\"sh\", \"-c\", \"test -e one && test -e two && echo ordered\"]
+		      }
+		    ],
+		    \"post-stop\": [
+		      {\"args\": [\"echo\", \"stopped\"]}
+		    ]
+		  }
+		}' >actual &&
+	cat <<-EOF >expected &&
+		ordered
+		stopped
+	EOF
+	test_cmp expected actual
+"
+
+test_expect_success ECHO,GREP,SLEEP,TIMEOUT 'Test a failed post-create hook kills its group' "
+	test_expect_code 1 timeout 10 ccon --verbose --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"hooks\": {
+		    \"post-create\": [
+		      {\"group\": \"setup\", \"args\": [\"sleep\", \"30\"]},
+		      {\"group\": \"setup\", \"args\": [\"sh\", \"-c\", \"exit 3\"]},
+		      {\"args\": [\"echo\", \"unreachable\"]}
+		    ]
+		  }
+		}' >output 2>actual &&
+	grep 'hook killed (Killed, 9)' actual &&
+	test_must_fail grep unreachable output
+"
+
+test_expect_success GREP 'Test grouped terminal hooks are rejected' "
+	test_expect_code 1 ccon --verbose --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"hooks\": {
+		    \"post-create\": [
+		      {\"group\": \"setup\", \"terminal\": true, \"args\": [\"true\"]},
+		      {\"group\": \"setup\", \"args\": [\"true\"]}
+		    ]
+		  }
+		}' 2>actual &&
+	grep 'cannot share group setup' actual
+"
+
+test_expect_success ECHO,GREP,SLEEP,TIMEOUT 'Test a post-create hook timeout' "
+	test_expect_code 1 timeout 10 ccon --verbose --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"hooks\": {
+		    \"post-create\": [
+		      {\"timeout\": 0.5, \"args\": [\"sleep\", \"30\"]},
+		      {\"args\": [\"echo\", \"unreachable\"]}
+		    ]
+		  }
+		}' >output 2>actual &&
+	grep 'post-create hook 0 timed out' actual &&
+	grep 'hook killed (Killed, 9)' actual &&
+	test_must_fail grep unreachable output
+"
+
+test_expect_success ECHO,GREP,SLEEP,TIMEOUT 'Test the global hooks timeout' "
+	test_expect_code 1 timeout 10 ccon --verbose --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"hooks\": {
+		    \"timeout\": 0.5,
+		    \"post-create\": [
+		      {\"group\": \"setup\", \"args\": [\"sleep\", \"30\"]},
+		      {\"group\": \"setup\", \"args\": [\"sleep\", \"30\"]},
+		      {\"args\": [\"echo\", \"unreachable\"]}
+		    ]
+		  }
+		}' >output 2>actual &&
+	grep 'post-create hook 0 timed out' actual &&
+	grep 'post-create hook 1 timed out' actual &&
+	test_must_fail grep unreachable output
+"
+
+test_expect_success GREP 'Test invalid hook timeouts are rejected' "
+	test_expect_code 1 ccon --verbose --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"hooks\": {
+		    \"post-create\": [
+		      {\"timeout\": 0, \"args\": [\"true\"]}
+		    ]
+		  }
+		}' 2>actual &&
+	grep 'hooks.post-create\[0\].timeout is not a positive number' actual
+"
+
+test_expect_success CAT,ECHO,SHELL,SLEEP,TEST,TIMEOUT 'Test --async-teardown reports before post-stop hooks' "
+	test_expect_code 7 timeout 10 ccon --async-teardown --status-fd 3 3>status --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {
+		    \"args\": [\"sh\", \"-c\", \"exit 7\"]
+		  },
+		  \"hooks\": {
+		    \"post-stop\": [
+		      {\"args\": [\"sh\", \"-c\", \"test -s status && echo stopped >stopped\"]}
+		    ]
+		  }
+		}' &&
+	echo 7 >expected &&
+	test_cmp expected status &&
+	while ! test -e stopped
+	do
+		sleep 0
+	done &&
+	echo stopped >expected &&
+	test_cmp expected stopped
+"
+
+test_expect_success GREP,SHELL 'Test --async-teardown flushes --log-buffer' "
+	test_expect_code 7 ccon --verbose --log-buffer --async-teardown --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {
+		    \"args\": [\"sh\", \"-c\", \"exit 7\"]
+		  }
+		}' 2>actual &&
+	grep 'continue teardown in PID' actual
+"
+
+test_done
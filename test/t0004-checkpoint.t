@@ -0,0 +1,76 @@
+#!/bin/sh
+#
+# Copyright (C) 2018 W. Trevor King <wking@tremily.us>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+test_description='Test checkpoint and restore'
+
+. ./sharness.sh
+
+test_expect_success CAT,CHMOD,MKDIR 'Create a fake criu' "
+	mkdir -p bin &&
+	cat <<-\EOF >bin/criu &&
+		#!/bin/sh
+		echo \"\$*\" >>criu-args
+		test \"\$1\" = restore || exit 0
+		while test \"\$#\" -gt 1 && test \"\$1\" != --pidfile
+		do
+			shift
+		done
+		(sleep 1; exit 3) &
+		echo \"\$!\" >\"\$2\"
+	EOF
+	chmod +x bin/criu
+"
+
+test_expect_success KILL,PS,SED,SHELL,SLEEP 'Test SIGUSR1 with --checkpoint' "
+	rm -f criu-args &&
+	PATH=\"\$(pwd)/bin:\$PATH\" ccon --checkpoint images --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {
+		    \"args\": [\"sleep\", \"1\"]
+		  },
+		  \"hooks\": {
+		    \"post-create\": [
+		      {\"args\": [\"sh\", \"-c\", \"kill -USR1 \$(ps -o ppid= -p \$(cat))\"]}
+		    ]
+		  }
+		}' &&
+	sed 's/--tree [0-9]*/--tree PID/' criu-args >actual &&
+	echo 'dump --tree PID --images-dir images --leave-running --shell-job' >expected &&
+	test_cmp expected actual
+"
+
+test_expect_success ENV,SED,SLEEP 'Test --restore' "
+	rm -f criu-args &&
+	test_expect_code 3 env PATH=\"\$(pwd)/bin:\$PATH\" ccon --restore images --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {
+		    \"args\": [\"true\"]
+		  }
+		}' &&
+	sed 's|--pidfile .*|--pidfile PIDFILE|' criu-args >actual &&
+	echo 'restore --images-dir images --restore-detached --shell-job --pidfile PIDFILE' >expected &&
+	test_cmp expected actual
+"
+
+test_expect_success GREP 'Test --restore with --pool' "
+	test_expect_code 1 ccon --verbose --restore images --pool 1 --socket pool-sock --config-string '{
+		  \"version\": \"0.5.0\"
+		}' 2>actual &&
+	grep 'can.t be used with --socket, --daemon, or --pool' actual
+"
+
+test_done
@@ -126,4 +126,21 @@ test_expect_success CAPTEST,CAT,ROOT 'Test privileged hook capabilities' "
 	test_cmp expected actual
 "
 
+test_expect_success CAT,GREP,ROOT 'Test process.capabilities sets without captest' "
+	ccon --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {
+		    \"capabilities\": [\"CAP_NET_BIND_SERVICE\", \"CAP_NET_RAW\"],
+		    \"args\": [\"grep\", \"^Cap[BEIP]\", \"/proc/self/status\"]
+		  }
+		}' >actual &&
+	cat <<-EOF >expected &&
+		CapInh:	0000000000002400
+		CapPrm:	0000000000002400
+		CapEff:	0000000000002400
+		CapBnd:	0000000000002400
+	EOF
+	test_cmp expected actual
+"
+
 test_done
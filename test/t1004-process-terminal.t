@@ -43,6 +43,19 @@ test_expect_success ECHO,SED,TTY 'Test process.terminal' "
 	test_cmp expected actual-no-number
 "
 
+test_expect_success ECHO,HEAD,SED 'Test process.terminal with --io-uring' "
+	echo hello | ccon --io-uring --config-string '{
+		  \"version\": \"0.4.0\",
+		  \"process\": {
+		    \"terminal\": true,
+		    \"args\": [\"head\", \"-n\", \"1\"]
+		  }
+		}' >actual &&
+	sed 's/\r$//' actual >actual-no-cr &&
+	printf 'hello\\nhello\\n' >expected &&
+	test_cmp expected actual-no-cr
+"
+
 test_expect_success TTY 'Test pre-start hook terminal unset' "
 	test_expect_code 1 ccon --config-string '{
 		  \"version\": \"0.4.0\",
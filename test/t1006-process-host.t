@@ -114,4 +114,17 @@ test_expect_success BUSYBOX,ECHO,ID 'Test process.host' "
 	test_cmp expected actual
 "
 
+test_expect_success ECHO,GREP 'Test process.host with --seal-exec' "
+	ccon --verbose --seal-exec --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {
+		    \"args\": [\"echo\", \"hello\"],
+		    \"host\": true
+		  }
+		}' >actual 2>log &&
+	grep '^sealed [0-9]*-byte executable copy\$' log &&
+	echo hello >expected &&
+	test_cmp expected actual
+"
+
 test_done
@@ -62,6 +62,30 @@ test_expect_success ENV 'Test process.env empty' "
 	test_cmp expected actual
 "
 
+test_expect_success CAT,ENV,GREP 'Test process.inheritEnv' "
+	CCON_TEST_A=host CCON_TEST_B=host ccon --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {
+		    \"args\": [\"env\"],
+		    \"env\": [
+		      \"CCON_TEST_B=container\",
+		      \"CCON_TEST_C=container\"
+		    ],
+		    \"inheritEnv\": true
+		  }
+		}' >actual &&
+	grep '^CCON_TEST_' actual >actual-test &&
+	cat <<-EOF >expected-test &&
+		CCON_TEST_A=host
+		CCON_TEST_B=container
+		CCON_TEST_C=container
+	EOF
+	test_cmp expected-test actual-test &&
+	grep -v '^_\\|^CCON_TEST_' actual >actual-host &&
+	env | grep -v '^_\\|^CCON_TEST_' >expected-host &&
+	test_cmp expected-host actual-host
+"
+
 test_expect_success ENV,GREP 'Test hook env unset' "
 	ccon --config-string '{
 		  \"version\": \"0.1.0\",
@@ -0,0 +1,107 @@
+#!/bin/sh
+#
+# Copyright (C) 2016 W. Trevor King <wking@tremily.us>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+test_description='Test process seccomp filters'
+
+. ./sharness.sh
+
+test_expect_success ECHO,MKDIR,SHELL 'Test process.seccomp errno rule' "
+	ccon --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {
+		    \"args\": [\"sh\", \"-c\", \"mkdir denied 2>/dev/null || echo \\\$?\"],
+		    \"seccomp\": {
+		      \"defaultAction\": \"SCMP_ACT_ALLOW\",
+		      \"syscalls\": [
+		        {
+		          \"names\": [\"mkdir\", \"mkdirat\", \"not_a_syscall\"],
+		          \"action\": \"SCMP_ACT_ERRNO\"
+		        }
+		      ]
+		    }
+		  }
+		}' >actual &&
+	echo 1 >expected &&
+	test_cmp expected actual &&
+	test_must_fail test -e denied
+"
+
+test_expect_success GREP,MKDIR,SHELL 'Test process.seccomp errnoRet and defaultErrnoRet' "
+	ccon --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {
+		    \"args\": [\"sh\", \"-c\", \"mkdir denied\"],
+		    \"seccomp\": {
+		      \"defaultAction\": \"SCMP_ACT_ALLOW\",
+		      \"defaultErrnoRet\": 1,
+		      \"syscalls\": [
+		        {
+		          \"names\": [\"mkdir\", \"mkdirat\"],
+		          \"action\": \"SCMP_ACT_ERRNO\",
+		          \"errnoRet\": 13
+		        }
+		      ]
+		    }
+		  }
+		}' 2>actual;
+	grep 'Permission denied' actual &&
+	test_must_fail test -e denied
+"
+
+test_expect_success GREP 'Test process.seccomp with an invalid errnoRet' "
+	test_expect_code 1 ccon --verbose --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {
+		    \"args\": [\"true\"],
+		    \"seccomp\": {
+		      \"defaultAction\": \"SCMP_ACT_ERRNO\",
+		      \"defaultErrnoRet\": 4096
+		    }
+		  }
+		}' 2>actual &&
+	grep 'defaultErrnoRet must be an integer from 0 to 4095' actual
+"
+
+test_expect_success GREP,MKDIR,SHELL 'Test process.seccomp with the plan cache' "
+	mkdir plans &&
+	for i in 1 2; do
+		ccon --verbose --plan-cache plans --config-string '{
+			  \"version\": \"0.5.0\",
+			  \"process\": {
+			    \"args\": [\"grep\", \"^Seccomp:\", \"/proc/self/status\"],
+			    \"seccomp\": {\"defaultAction\": \"SCMP_ACT_ALLOW\"}
+			  }
+			}' >\"output-\${i}\" 2>\"log-\${i}\" || return 1
+	done &&
+	grep 'compiled a .*-instruction seccomp filter' log-1 &&
+	test_must_fail grep 'compiled a' log-2 &&
+	grep 'load config plan' log-2 &&
+	grep '2\$' output-2
+"
+
+test_expect_success GREP 'Test process.seccomp with an unknown action' "
+	test_expect_code 1 ccon --verbose --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {
+		    \"args\": [\"true\"],
+		    \"seccomp\": {\"defaultAction\": \"SCMP_ACT_MAYBE\"}
+		  }
+		}' 2>actual &&
+	grep 'unrecognized seccomp action: SCMP_ACT_MAYBE' actual
+"
+
+test_done
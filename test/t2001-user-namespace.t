@@ -69,6 +69,90 @@ test_expect_success CAT,ID,SHELL 'Test user namespace ID mapping' "
 	test_cmp expected actual
 "
 
+test_expect_success ID,ROOT,SHELL 'Test user namespace ID mapping with several ranges' "
+	ccon --config-string '{
+		  \"version\": \"0.1.0\",
+		  \"namespaces\": {
+		    \"user\": {
+		      \"uidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        },
+		        {
+		          \"containerID\": 1,
+		          \"hostID\": 100000,
+		          \"size\": 10
+		        }
+		      ]
+		    }
+		  },
+		  \"process\": {
+		    \"args\": [\"sh\", \"-c\", \"while read c h s; do echo \$c \$h \$s; done </proc/self/uid_map\"]
+		  }
+		}' >actual &&
+	cat <<-EOF >expected &&
+		0 $(id -u) 1
+		1 100000 10
+	EOF
+	test_cmp expected actual
+"
+
+test_expect_success CAT,CHMOD,ID,SHELL 'Test user namespace ID mapping helpers' "
+	mkdir -p helpers &&
+	cat <<-\EOF >helpers/newuidmap &&
+		#!/bin/sh
+		pid=\"\$1\"
+		shift
+		echo \"\${0##*/} \$*\" >>helper-args
+		case \"\$0\" in
+		*newuidmap) map=uid_map ;;
+		*) map=gid_map ;;
+		esac
+		echo \"\$*\" >\"/proc/\$pid/\$map\"
+	EOF
+	chmod +x helpers/newuidmap &&
+	cat helpers/newuidmap >helpers/newgidmap &&
+	chmod +x helpers/newgidmap &&
+	PATH=\"\$(pwd)/helpers:\$PATH\" ccon --config-string '{
+		  \"version\": \"0.1.0\",
+		  \"namespaces\": {
+		    \"user\": {
+		      \"setgroups\": false,
+		      \"mappingHelpers\": true,
+		      \"uidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ],
+		      \"gidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -g),
+		          \"size\": 1
+		        }
+		      ]
+		    }
+		  },
+		  \"process\": {
+		    \"args\": [\"sh\", \"-c\", \"id -u && id -g\"]
+		  }
+		}' >actual &&
+	cat <<-EOF >expected &&
+		0
+		0
+	EOF
+	test_cmp expected actual &&
+	cat <<-EOF >expected-args &&
+		newuidmap 0 $(id -u) 1
+		newgidmap 0 $(id -g) 1
+	EOF
+	test_cmp expected-args helper-args
+"
+
 test_expect_success CAT,ECHO,GREP,ID,!ROOT,SED 'Test unprivileged user must deny setgroups before mapping GIDs' "
 	test_expect_code 1 ccon --verbose --config-string '{
 		  \"version\": \"0.1.0\",
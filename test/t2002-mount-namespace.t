@@ -60,6 +60,34 @@ test_expect_success TOUCH 'Test mount namespace read-only mount' "
 	test_cmp expected actual
 "
 
+test_expect_success TOUCH 'Test mount namespace read-only bind with mount(2)' "
+	mkdir -p ro-bind &&
+	test_expect_code 1 ccon --config-string '{
+		  \"version\": \"0.1.0\",
+		  \"namespaces\": {
+		    \"user\": {},
+		    \"mount\": {
+		      \"mounts\": [
+		        {
+		          \"source\": \"$(pwd)/ro-bind\",
+		          \"target\": \"$(pwd)/ro-bind\",
+		          \"flags\": [
+		            \"MS_BIND\",
+		            \"MS_RDONLY\",
+		            \"MS_SILENT\"
+		          ]
+		        }
+		      ]
+		    }
+		  },
+		  \"process\": {
+		    \"args\": [\"touch\", \"$(pwd)/ro-bind/mount-test\"]
+		  }
+		}' 2>actual &&
+	echo \"touch: cannot touch '$(pwd)/ro-bind/mount-test': Read-only file system\" >expected &&
+	test_cmp expected actual
+"
+
 test_expect_success BUSYBOX,ID 'Test mount namespace pivot root' "
 	mkdir -p rootfs &&
 	ccon --config-string '{
@@ -203,4 +231,387 @@ test_expect_success BUSYBOX,ID 'Test mount namespace creates destination files'
 	test_cmp expected actual
 "
 
+test_expect_success GREP,ID 'Test mount namespace filesystem data' "
+	ccon --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"namespaces\": {
+		    \"user\": {
+		      \"setgroups\": false,
+		      \"uidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ],
+		      \"gidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ]
+		    },
+		    \"mount\": {
+		      \"mounts\": [
+		        {
+		          \"target\": \"data\",
+		          \"type\": \"tmpfs\",
+		          \"flags\": [\"MS_NOSUID\"],
+		          \"data\": \"size=1m,mode=0700\"
+		        }
+		      ]
+		    }
+		  },
+		  \"process\": {
+		    \"args\": [\"grep\", \" - tmpfs \", \"/proc/self/mountinfo\"]
+		  }
+		}' >actual &&
+	grep '/data [^ ]*nosuid.* - tmpfs .*size=1024k,mode=700' actual
+"
+
+test_expect_success CAT,ID,LS,MKDIR 'Test mount namespace creates nested targets inside earlier mounts' "
+	mkdir -p nested &&
+	ccon --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"namespaces\": {
+		    \"user\": {
+		      \"setgroups\": false,
+		      \"uidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ],
+		      \"gidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ]
+		    },
+		    \"mount\": {
+		      \"mounts\": [
+		        {\"target\": \"nested/a/b\", \"type\": \"tmpfs\"},
+		        {\"target\": \"nested/a\", \"type\": \"tmpfs\"},
+		        {\"target\": \"nested/a/b/c\", \"type\": \"tmpfs\"},
+		        {\"target\": \"nested/a/d\", \"type\": \"tmpfs\"}
+		      ]
+		    }
+		  },
+		  \"process\": {
+		    \"args\": [\"ls\", \"nested/a\", \"nested/a/b\"]
+		  }
+		}' >actual &&
+	cat <<-EOF >expected &&
+		nested/a:
+		b
+		d
+
+		nested/a/b:
+		c
+	EOF
+	test_cmp expected actual &&
+	ls nested/a >host &&
+	echo b >expected-host &&
+	test_cmp expected-host host
+"
+
+test_expect_success CAT,ECHO,ID,LS,MKDIR,SHELL 'Test mount namespace nests targets beside a file target' "
+	mkdir -p shared &&
+	echo payload >payload &&
+	ccon --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"namespaces\": {
+		    \"user\": {
+		      \"setgroups\": false,
+		      \"uidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ],
+		      \"gidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ]
+		    },
+		    \"mount\": {
+		      \"mounts\": [
+		        {
+		          \"source\": \"payload\",
+		          \"target\": \"shared/p/file\",
+		          \"flags\": [\"MS_BIND\"]
+		        },
+		        {\"target\": \"shared/p/sub\", \"type\": \"tmpfs\"},
+		        {\"target\": \"shared/p/other\", \"type\": \"tmpfs\"}
+		      ]
+		    }
+		  },
+		  \"process\": {
+		    \"args\": [\"sh\", \"-c\", \"cat shared/p/file && ls shared/p\"]
+		  }
+		}' >actual &&
+	cat <<-EOF >expected &&
+		payload
+		file
+		other
+		sub
+	EOF
+	test_cmp expected actual
+"
+
+test_expect_success CAT,ECHO,ID,MKDIR,SHELL 'Test mount namespace overlay layers' "
+	mkdir -p layers/sha256/1234 base &&
+	echo cached >layers/sha256/1234/a &&
+	echo base >base/b &&
+	ccon --layer-cache layers --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"namespaces\": {
+		    \"user\": {
+		      \"setgroups\": false,
+		      \"uidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ],
+		      \"gidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ]
+		    },
+		    \"mount\": {
+		      \"mounts\": [
+		        {
+		          \"target\": \"overlay\",
+		          \"layers\": [\"sha256:1234\", \"base\"],
+		          \"upper\": \"upper\",
+		          \"work\": \"work\"
+		        }
+		      ]
+		    }
+		  },
+		  \"process\": {
+		    \"args\": [\"sh\", \"-c\", \"cat overlay/a overlay/b && echo changed >overlay/a\"]
+		  }
+		}' >actual &&
+	cat <<-EOF >expected &&
+		cached
+		base
+	EOF
+	test_cmp expected actual &&
+	echo changed >expected &&
+	test_cmp expected upper/a &&
+	echo cached >expected &&
+	test_cmp expected layers/sha256/1234/a
+"
+
+test_expect_success ECHO,GREP,ID,MKDIR 'Test mount namespace overlay layer missing from the cache' "
+	mkdir -p layers &&
+	test_expect_code 1 ccon --verbose --layer-cache layers --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"namespaces\": {
+		    \"user\": {},
+		    \"mount\": {
+		      \"mounts\": [
+		        {\"target\": \"overlay\", \"layers\": [\"sha256:missing\", \"base\"]}
+		      ]
+		    }
+		  },
+		  \"process\": {
+		    \"args\": [\"echo\", \"unreachable\"]
+		  }
+		}' 2>actual &&
+	grep 'layer sha256:missing is not in the layer cache' actual
+"
+
+test_expect_success CAT,ECHO,ID,LS,SHELL 'Test mount namespace minimal-dev' "
+	ccon --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"namespaces\": {
+		    \"user\": {
+		      \"setgroups\": false,
+		      \"uidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ],
+		      \"gidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ]
+		    },
+		    \"mount\": {
+		      \"mounts\": [
+		        {\"target\": \"dev\", \"type\": \"minimal-dev\"}
+		      ]
+		    }
+		  },
+		  \"process\": {
+		    \"args\": [\"sh\", \"-c\", \"ls dev && echo hello >dev/null && test -c dev/pts/ptmx\"]
+		  }
+		}' >actual &&
+	cat <<-EOF >expected &&
+		fd
+		full
+		null
+		ptmx
+		pts
+		random
+		stderr
+		stdin
+		stdout
+		tty
+		urandom
+		zero
+	EOF
+	test_cmp expected actual
+"
+
+test_expect_success ECHO,ID,SHELL 'Test mount namespace optional mounts' "
+	ccon --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"namespaces\": {
+		    \"user\": {
+		      \"setgroups\": false,
+		      \"uidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ],
+		      \"gidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ]
+		    },
+		    \"mount\": {
+		      \"mounts\": [
+		        {
+		          \"source\": \"missing\",
+		          \"target\": \"missing-target\",
+		          \"flags\": [\"MS_BIND\"],
+		          \"optional\": true
+		        }
+		      ]
+		    }
+		  },
+		  \"process\": {
+		    \"args\": [\"echo\", \"hello\"]
+		  }
+		}' >actual &&
+	echo hello >expected &&
+	test_cmp expected actual
+"
+
+test_expect_success ECHO,GREP,ID 'Test mount namespace optional minimal-dev' "
+	echo file >dev-file &&
+	ccon --verbose --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"namespaces\": {
+		    \"user\": {
+		      \"setgroups\": false,
+		      \"uidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ],
+		      \"gidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ]
+		    },
+		    \"mount\": {
+		      \"mounts\": [
+		        {
+		          \"target\": \"dev-file/dev\",
+		          \"type\": \"minimal-dev\",
+		          \"data\": \"mode=755\",
+		          \"optional\": true
+		        }
+		      ]
+		    }
+		  },
+		  \"process\": {
+		    \"args\": [\"echo\", \"hello\"]
+		  }
+		}' >actual 2>log &&
+	echo hello >expected &&
+	test_cmp expected actual &&
+	grep 'ignore source, flags, and data for minimal-dev mount 0' log &&
+	grep 'skip optional mount 0' log
+"
+
+test_expect_success CAT,GREP,ID 'Test mount namespace optional minimal-dev unmounts on failure' "
+	mkdir -p mdev &&
+	echo marker >mdev/marker &&
+	ccon --verbose --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"namespaces\": {
+		    \"user\": {
+		      \"setgroups\": false,
+		      \"uidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ],
+		      \"gidMappings\": [
+		        {
+		          \"containerID\": 0,
+		          \"hostID\": $(id -u),
+		          \"size\": 1
+		        }
+		      ]
+		    },
+		    \"mount\": {
+		      \"mounts\": [
+		        {
+		          \"target\": \"/dev\",
+		          \"type\": \"tmpfs\"
+		        },
+		        {
+		          \"target\": \"mdev\",
+		          \"type\": \"minimal-dev\",
+		          \"optional\": true
+		        }
+		      ]
+		    }
+		  },
+		  \"process\": {
+		    \"args\": [\"cat\", \"mdev/marker\"]
+		  }
+		}' >actual 2>log &&
+	echo marker >expected &&
+	test_cmp expected actual &&
+	grep 'unmount minimal /dev from $(pwd)/mdev' log &&
+	grep 'skip optional mount 1' log
+"
+
 test_done
@@ -55,4 +55,26 @@ test_expect_success HOSTNAME,ID,SHELL 'Test UTS namespace creation' "
 	test_cmp expected actual
 "
 
+test_expect_success CAT,ROOT 'Test joining several namespace paths' "
+	ccon --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"namespaces\": {
+		    \"ipc\": {\"path\": \"/proc/$$/ns/ipc\"},
+		    \"net\": {\"path\": \"/proc/$$/ns/net\"},
+		    \"uts\": {\"path\": \"/proc/$$/ns/uts\"}
+		  },
+		  \"process\": {
+		    \"args\": [
+		      \"readlink\",
+		      \"/proc/self/ns/ipc\",
+		      \"/proc/self/ns/net\",
+		      \"/proc/self/ns/uts\"
+		    ],
+		    \"host\": true
+		  }
+		}' >actual &&
+	readlink /proc/$$/ns/ipc /proc/$$/ns/net /proc/$$/ns/uts >expected &&
+	test_cmp expected actual
+"
+
 test_done
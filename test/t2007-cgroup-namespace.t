@@ -19,6 +19,9 @@ test_description='Test cgroup namespaces'
 
 . ./sharness.sh
 
+CGROUP2=$(grep -m1 ' - cgroup2 ' /proc/self/mountinfo | cut -d ' ' -f 5)
+test -n "${CGROUP2}" && test -w "${CGROUP2}" && test_set_prereq CGROUP2
+
 test_expect_success ID,READLINK 'Test cgroup namespace creation' "
 	ccon --config-string '{
 		  \"version\": \"0.5.0\",
@@ -53,4 +56,19 @@ test_expect_success ID,READLINK 'Test cgroup namespace creation' "
 	test_must_fail test_cmp host container
 "
 
+test_expect_success CAT,CGROUP2,GREP,TEST 'Test cgroup placement at clone time' "
+	ccon --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"cgroup\": {
+		    \"path\": \"${CGROUP2}/ccon-test-$$\",
+		    \"create\": true
+		  },
+		  \"process\": {
+		    \"args\": [\"cat\", \"/proc/self/cgroup\"]
+		  }
+		}' >actual &&
+	grep '^0::.*/ccon-test-$$\$' actual &&
+	test ! -e '${CGROUP2}/ccon-test-$$'
+"
+
 test_done
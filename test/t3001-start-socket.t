@@ -127,6 +127,31 @@ test_expect_success BUSYBOX,ECHO,GREP,ID,INOTIFYWAIT,SLEEP,WAIT 'Test start with
 	test_cmp expected actual
 "
 
+test_expect_success BUSYBOX,ECHO,GREP,INOTIFYWAIT,SLEEP,WAIT 'Test concurrent PID and start requests' "
+	mkdir -p sock &&
+	> wait &&
+	(
+		inotifywait -e create sock 2>>wait &&
+		(
+			ccon-cli --socket sock/sock --pid >pid &
+			ccon-cli --socket sock/sock --config-string '{
+				  \"args\": [\"busybox\", \"echo\", \"goodbye\"]
+				}' &&
+			wait
+		)
+	) &
+	while ! grep '^Watches established.$' wait
+	do
+		sleep 0
+	done &&
+	ccon --socket sock/sock --socket-backlog 2 --config-string '{
+		  \"version\": \"0.5.0\"
+		}' >actual &&
+	wait &&
+	echo 'goodbye' >expected &&
+	test_cmp expected actual
+"
+
 test_expect_success BUSYBOX,ECHO,GREP,INOTIFYWAIT,SLEEP,WAIT 'Test recover container process exit code' "
 	mkdir -p sock &&
 	> wait &&
@@ -146,4 +171,156 @@ test_expect_success BUSYBOX,ECHO,GREP,INOTIFYWAIT,SLEEP,WAIT 'Test recover conta
 	wait
 "
 
+test_expect_success BUSYBOX,ECHO,GREP,INOTIFYWAIT,KILL,SLEEP,TEST,WAIT 'Test start from a --pool' "
+	mkdir -p pool &&
+	> pool-wait &&
+	(
+		inotifywait -e create pool 2>>pool-wait &&
+		ccon-cli --socket pool/sock --config-string '{
+			  \"args\": [\"busybox\", \"echo\", \"goodbye\"]
+			}' &&
+		while ! grep goodbye actual
+		do
+			sleep 0
+		done &&
+		while ! test -s pool-pid
+		do
+			sleep 0
+		done &&
+		kill -TERM \$(cat pool-pid)
+	) &
+	while ! grep '^Watches established.$' pool-wait
+	do
+		sleep 0
+	done &&
+	{
+		ccon --pool 1 --socket pool/sock --config-string '{
+			  \"version\": \"0.5.0\"
+			}' >actual &
+	} &&
+	echo \$! >pool-pid &&
+	wait &&
+	echo 'goodbye' >expected &&
+	test_cmp expected actual &&
+	test ! -e pool/sock
+"
+
+test_expect_success HEAD,KILL,READLINK,ROOT,SHELL,SLEEP,TEST,WAIT 'Test borrow namespaces from a --pool' "
+	mkdir -p ns-pool &&
+	{
+		ccon --pool 1 --socket ns-pool/sock --config-string '{
+			  \"version\": \"0.5.0\",
+			  \"namespaces\": {
+			    \"uts\": {}
+			  },
+			  \"hooks\": {
+			    \"post-create\": [
+			      {
+			        \"args\": [
+			          \"sh\", \"-c\",
+			          \"read PID && readlink /proc/\\\$PID/ns/uts >>donor-uts\"
+			        ]
+			      }
+			    ]
+			  }
+			}' &
+	} &&
+	echo \$! >ns-pool-pid &&
+	while ! test -S ns-pool/sock
+	do
+		sleep 0
+	done &&
+	ccon --namespace-pool ns-pool/sock --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"namespaces\": {
+		    \"uts\": {}
+		  },
+		  \"process\": {
+		    \"args\": [\"readlink\", \"/proc/self/ns/uts\"]
+		  }
+		}' >actual &&
+	kill -TERM \$(cat ns-pool-pid) &&
+	wait &&
+	head -n 1 donor-uts >expected &&
+	test_cmp expected actual &&
+	readlink /proc/self/ns/uts >host &&
+	test_must_fail test_cmp host actual &&
+	test ! -e ns-pool/sock
+"
+
+test_expect_success ECHO,KILL,PRINTF,SHELL,SLEEP,TEST,WAIT 'Test launch from a --daemon' "
+	mkdir -p daemon &&
+	{
+		ccon --daemon --socket daemon/sock &
+	} &&
+	echo \$! >daemon-pid &&
+	while ! test -S daemon/sock
+	do
+		sleep 0
+	done &&
+	ccon-cli --launch --socket daemon/sock --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {
+		    \"args\": [\"echo\", \"hello\"]
+		  }
+		}' >actual &&
+	test_expect_code 3 ccon-cli --launch --socket daemon/sock --config-string '{
+		  \"version\": \"0.5.0\",
+		  \"process\": {
+		    \"args\": [\"sh\", \"-c\", \"echo goodbye; exit 3\"]
+		  }
+		}' >>actual &&
+	kill -TERM \$(cat daemon-pid) &&
+	wait &&
+	printf 'hello\\ngoodbye\\n' >expected &&
+	test_cmp expected actual &&
+	test ! -e daemon/sock
+"
+
+test_expect_success ECHO,PRINTF,SHELL,SLEEP,TEST,WAIT 'Test exec requests before start' "
+	mkdir -p exec &&
+	>actual &&
+	{
+		ccon --socket exec/sock --config-string '{
+			  \"version\": \"0.5.0\",
+			  \"process\": {
+			    \"args\": [\"echo\", \"container\"]
+			  }
+			}' >>actual &
+	} &&
+	while ! test -S exec/sock
+	do
+		sleep 0
+	done &&
+	ccon-cli --exec --socket exec/sock --config-string '{
+		  \"args\": [\"echo\", \"first\"]
+		}' >>actual &&
+	test_expect_code 3 ccon-cli --exec --socket exec/sock --config-string '{
+		  \"args\": [\"sh\", \"-c\", \"echo second; exit 3\"]
+		}' >>actual &&
+	ccon-cli --socket exec/sock --config-string '' &&
+	wait &&
+	printf 'first\\nsecond\\ncontainer\\n' >expected &&
+	test_cmp expected actual
+"
+
+test_expect_success ECHO,PRINTF,SHELL,SLEEP,TEST,WAIT 'Test start with a framed process config' "
+	mkdir -p frame &&
+	BIG=\$(printf '%0100000d' 0) &&
+	printf '{\"args\": [\"sh\", \"-c\", \"echo \\\${#A} \\\${#B}\"], \"env\": [\"A=%s\", \"B=%s\"]}' \"\$BIG\" \"\$BIG\" >frame/process.json &&
+	{
+		ccon --socket frame/sock --config-string '{
+			  \"version\": \"0.5.0\"
+			}' >actual &
+	} &&
+	while ! test -S frame/sock
+	do
+		sleep 0
+	done &&
+	ccon-cli --socket frame/sock --config frame/process.json &&
+	wait &&
+	echo '100000 100000' >expected &&
+	test_cmp expected actual
+"
+
 test_done